@@ -48,7 +48,9 @@ const char *const expression_type_names[] = {
     "Bool",
     "Null",
     "String",
+    "Interp",
     "Call",
+    "Builtin",
     "Func",
     "Declaration",
     "Block",
@@ -71,6 +73,7 @@ Expression *allocexpr() {
     expr->symbol = NULL;
     expr->scope = NULL;
     expr->immutable = 0;
+    expr->types = 0;
 
     return expr;
 }
@@ -114,6 +117,45 @@ void free_list(ExpressionList *list) {
     }
 }
 
+/*
+ * Turns expr into a literal of the given type. Children are freed; the
+ * caller sets the value afterwards. Not for declarations or functions,
+ * which own a symbol or scope.
+ */
+void become_literal(Expression *expr, ExpressionType type) {
+    free_expr(expr->cond);
+    free_expr(expr->lexpr);
+    free_expr(expr->rexpr);
+    free_list(expr->llist);
+    free_list(expr->rlist);
+
+    if (expr->type == TYPE_VARREF || expr->type == TYPE_STRING) {
+        free(expr->value.s);
+    }
+
+    expr->type = type;
+    expr->cond = NULL;
+    expr->lexpr = NULL;
+    expr->rexpr = NULL;
+    expr->llist = NULL;
+    expr->rlist = NULL;
+    expr->symbol = NULL;
+}
+
+/*
+ * Replaces expr with one of its own children, which is detached first so
+ * freeing the rest of expr does not take it along.
+ */
+void become_child(Expression *expr, Expression *child) {
+    if (child == expr->cond)  expr->cond = NULL;
+    if (child == expr->lexpr) expr->lexpr = NULL;
+    if (child == expr->rexpr) expr->rexpr = NULL;
+
+    become_literal(expr, child->type);
+    *expr = *child;
+    free(child);
+}
+
 ExpressionList *make_list() {
     ExpressionList *list = malloc(sizeof *list);
 
@@ -281,6 +323,16 @@ Expression *make_str(SourcePos pos, char *str) {
     return expr;
 }
 
+Expression *make_interp(SourcePos pos, ExpressionList *parts) {
+    Expression *expr = allocexpr();
+
+    expr->type = TYPE_INTERP;
+    expr->pos = pos;
+    expr->llist = parts;
+
+    return expr;
+}
+
 Expression *make_call(SourcePos pos, Expression *target, ExpressionList *arguments) {
     Expression *expr = allocexpr();
 
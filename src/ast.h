@@ -51,7 +51,9 @@ typedef enum {
     TYPE_BOOL, // value (i)
     TYPE_NULL,
     TYPE_STRING, // value (s)
+    TYPE_INTERP, // llist
     TYPE_CALL, // lexpr, llist
+    TYPE_BUILTIN, // lexpr, llist (a call to a builtin function; set by semant)
     TYPE_FUNC, // llist, rexpr
     TYPE_DECLARATION, // rexpr, value (s),
     TYPE_BLOCK, // llist, rlist
@@ -83,6 +85,9 @@ struct Expression {
     Scope *scope;
     SourcePos pos;
 
+    // set by type inference to the types its value may have, or 0
+    int types;
+
     union {
         int i;
         double d;
@@ -106,6 +111,9 @@ const char *const expression_type_names[NUM_EXPRESSION_TYPES];
 void free_expr(Expression *expr);
 void free_list(ExpressionList *list);
 
+void become_literal(Expression *expr, ExpressionType type);
+void become_child(Expression *expr, Expression *child);
+
 ExpressionList *make_list();
 ExpressionList *list1(Expression *expr);
 ExpressionList *expression_list_append(ExpressionList *list, Expression *expr);
@@ -122,6 +130,7 @@ Expression *make_real(SourcePos pos, double d);
 Expression *make_bool(SourcePos pos, int i);
 Expression *make_null(SourcePos pos);
 Expression *make_str(SourcePos pos, char *str);
+Expression *make_interp(SourcePos pos, ExpressionList *parts);
 Expression *make_call(SourcePos pos, Expression *target, ExpressionList *arguments);
 Expression *make_func(SourcePos pos, char *name, ExpressionList *parameters, Expression *body);
 Expression *make_block(SourcePos pos, ExpressionList *block, ExpressionList *handler);
@@ -0,0 +1,407 @@
+/*
+ * Copyright (c) 2014, Eric Fritz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+ * BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <limits.h>
+#include <string.h>
+
+#include "chinnu.h"
+#include "builtin.h"
+#include "str.h"
+#include "search.h"
+#include "regex.h"
+
+const char *const builtin_names[] = {
+    "len",
+    "at",
+    "sub",
+    "find",
+    "contains",
+    "count",
+    "split",
+    "replace",
+    "trim",
+    "starts_with",
+    "ends_with",
+    "match",
+    "search",
+    "group",
+    "group_start",
+    "group_end"
+};
+
+const int builtin_arity[] = {
+    1,
+    2,
+    3,
+    2,
+    2,
+    2,
+    3,
+    3,
+    1,
+    2,
+    2,
+    2,
+    2,
+    3,
+    3,
+    3
+};
+
+int find_builtin(const char *name) {
+    int i;
+    for (i = 0; i < NUM_BUILTINS; i++) {
+        if (strcmp(builtin_names[i], name) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+void string_arg(StringArg *arg, StackObject *o, int id) {
+    if (!IS_STRING_VALUE(o)) {
+        fatal("Expected string argument to %s.", builtin_names[id]);
+    }
+
+    value_to_arg(arg, o);
+}
+
+int int_arg(StackObject *o, int id) {
+    if (o->type != OBJECT_INT) {
+        fatal("Expected integer argument to %s.", builtin_names[id]);
+    }
+
+    return o->value.i;
+}
+
+void return_string(VM *vm, StackObject *dest, const char *s, int length) {
+    make_string_value(vm, dest, s, length);
+
+    if (dest->type == OBJECT_REFERENCE) {
+        PROFILE_ALLOC(vm, ALLOC_BUILTIN, sizeof(HeapObject) + sizeof(String) + length + 1);
+    }
+}
+
+void return_bool(StackObject *dest, int b) {
+    dest->type = OBJECT_BOOL;
+    dest->value.i = b != 0;
+}
+
+void return_int(StackObject *dest, int i) {
+    dest->type = OBJECT_INT;
+    dest->value.i = i;
+}
+
+int count_occurrences(const char *s, int length, const char *t, int tlength) {
+    int n = 0;
+    int i = 0;
+    int k;
+
+    while ((k = find_bytes(s + i, length - i, t, tlength)) != -1) {
+        n++;
+        i = concat_length(i, k + tlength);
+    }
+
+    return n;
+}
+
+// finds group n of the first match of re in s as byte offsets; 0 if unset
+int regex_group_arg(VM *vm, StackObject *args, int id, StringArg *s, int *start, int *end) {
+    StringArg pattern;
+    string_arg(s, &args[0], id);
+    string_arg(&pattern, &args[1], id);
+    int n = int_arg(&args[2], id);
+
+    Regex *re = lookup_regex(vm, &pattern);
+
+    if (n < 0 || n >= regex_groups(re)) {
+        fatal("Group index out of range.");
+    }
+
+    return regex_search(re, arg_chars(s), s->length, n, start, end) && *start != -1;
+}
+
+#define IS_SPACE(c) ((c) == ' ' || (c) == '\t' || (c) == '\n' || (c) == '\r' || (c) == '\f' || (c) == '\v')
+
+/*
+ * Arguments are in consecutive registers starting at args; the arity was
+ * checked when the call was compiled. The collector is held off for the
+ * duration of the call.
+ */
+
+void call_builtin(VM *vm, int id, StackObject *dest, StackObject *args) {
+    switch ((BuiltinId) id) {
+        case BUILTIN_LEN:
+        {
+            StringArg s;
+            string_arg(&s, &args[0], id);
+
+            dest->type = OBJECT_INT;
+            dest->value.i = arg_numchars(&s);
+        } break;
+
+        case BUILTIN_AT:
+        {
+            StringArg s;
+            string_arg(&s, &args[0], id);
+            int i = int_arg(&args[1], id);
+
+            if (i < 0 || i >= arg_numchars(&s)) {
+                fatal("String index out of range.");
+            }
+
+            int start = arg_offset(&s, i);
+            int end = arg_offset(&s, i + 1);
+
+            return_string(vm, dest, arg_chars(&s) + start, end - start);
+        } break;
+
+        case BUILTIN_SUB:
+        {
+            StringArg s;
+            string_arg(&s, &args[0], id);
+            int i = int_arg(&args[1], id);
+            int j = int_arg(&args[2], id);
+
+            if (i < 0 || j < i || j > arg_numchars(&s)) {
+                fatal("String index out of range.");
+            }
+
+            int start = arg_offset(&s, i);
+            int end = arg_offset(&s, j);
+
+            substring_value(vm, dest, &s, start, end - start);
+        } break;
+
+        case BUILTIN_FIND:
+        {
+            StringArg s, t;
+            string_arg(&s, &args[0], id);
+            string_arg(&t, &args[1], id);
+
+            int k = find_bytes(arg_chars(&s), s.length, arg_chars(&t), t.length);
+            return_int(dest, k == -1 ? -1 : arg_char_index(&s, k));
+        } break;
+
+        case BUILTIN_CONTAINS:
+        {
+            StringArg s, t;
+            string_arg(&s, &args[0], id);
+            string_arg(&t, &args[1], id);
+
+            return_bool(dest, find_bytes(arg_chars(&s), s.length, arg_chars(&t), t.length) != -1);
+        } break;
+
+        case BUILTIN_COUNT:
+        {
+            StringArg s, t;
+            string_arg(&s, &args[0], id);
+            string_arg(&t, &args[1], id);
+
+            if (t.length == 0) {
+                fatal("Empty search string in count.");
+            }
+
+            return_int(dest, count_occurrences(arg_chars(&s), s.length, arg_chars(&t), t.length));
+        } break;
+
+        case BUILTIN_SPLIT:
+        {
+            StringArg s, sep;
+            string_arg(&s, &args[0], id);
+            string_arg(&sep, &args[1], id);
+            int n = int_arg(&args[2], id);
+
+            if (sep.length == 0) {
+                fatal("Empty separator in split.");
+            }
+
+            if (n < 0) {
+                fatal("Field index out of range.");
+            }
+
+            const char *chars = arg_chars(&s);
+            const char *c = arg_chars(&sep);
+
+            // skip to the start of field n
+            int start = 0;
+            while (n > 0) {
+                int k = find_bytes(chars + start, s.length - start, c, sep.length);
+
+                if (k == -1) {
+                    dest->type = OBJECT_NULL;
+                    return;
+                }
+
+                start = concat_length(start, k + sep.length);
+                n--;
+            }
+
+            int k = find_bytes(chars + start, s.length - start, c, sep.length);
+            int end = k == -1 ? s.length : start + k;
+
+            substring_value(vm, dest, &s, start, end - start);
+        } break;
+
+        case BUILTIN_REPLACE:
+        {
+            StringArg s, t, u;
+            string_arg(&s, &args[0], id);
+            string_arg(&t, &args[1], id);
+            string_arg(&u, &args[2], id);
+
+            if (t.length == 0) {
+                fatal("Empty search string in replace.");
+            }
+
+            const char *chars = arg_chars(&s);
+            const char *from = arg_chars(&t);
+            const char *to = arg_chars(&u);
+
+            int n = count_occurrences(chars, s.length, from, t.length);
+
+            if (n == 0) {
+                *dest = args[0];
+                break;
+            }
+
+            // the result is sized exactly and written once; only a longer
+            // replacement can make it overflow
+            if (u.length > t.length && n > (INT_MAX - s.length) / (u.length - t.length)) {
+                fatal("String too long.");
+            }
+
+            int length = s.length + n * (u.length - t.length);
+            char *out = begin_string_value(vm, dest, length);
+
+            if (dest->type == OBJECT_REFERENCE) {
+                PROFILE_ALLOC(vm, ALLOC_BUILTIN, sizeof(HeapObject) + sizeof(String) + length + 1);
+            }
+
+            int i = 0;
+            int k;
+
+            while ((k = find_bytes(chars + i, s.length - i, from, t.length)) != -1) {
+                memcpy(out, chars + i, k);
+                memcpy(out + k, to, u.length);
+
+                out += k + u.length;
+                i += k + t.length;
+            }
+
+            memcpy(out, chars + i, s.length - i);
+        } break;
+
+        case BUILTIN_TRIM:
+        {
+            StringArg s;
+            string_arg(&s, &args[0], id);
+
+            const char *chars = arg_chars(&s);
+
+            int start = 0;
+            int end = s.length;
+
+            while (start < end && IS_SPACE(chars[start])) {
+                start++;
+            }
+
+            while (end > start && IS_SPACE(chars[end - 1])) {
+                end--;
+            }
+
+            if (start == 0 && end == s.length) {
+                *dest = args[0];
+                break;
+            }
+
+            substring_value(vm, dest, &s, start, end - start);
+        } break;
+
+        case BUILTIN_STARTS_WITH:
+        {
+            StringArg s, t;
+            string_arg(&s, &args[0], id);
+            string_arg(&t, &args[1], id);
+
+            return_bool(dest, t.length <= s.length && memcmp(arg_chars(&s), arg_chars(&t), t.length) == 0);
+        } break;
+
+        case BUILTIN_ENDS_WITH:
+        {
+            StringArg s, t;
+            string_arg(&s, &args[0], id);
+            string_arg(&t, &args[1], id);
+
+            return_bool(dest, t.length <= s.length && memcmp(arg_chars(&s) + s.length - t.length, arg_chars(&t), t.length) == 0);
+        } break;
+
+        case BUILTIN_MATCH:
+        {
+            StringArg s, pattern;
+            string_arg(&s, &args[0], id);
+            string_arg(&pattern, &args[1], id);
+
+            Regex *re = lookup_regex(vm, &pattern);
+            return_bool(dest, regex_match(re, arg_chars(&s), s.length));
+        } break;
+
+        case BUILTIN_SEARCH:
+        {
+            StringArg s, pattern;
+            string_arg(&s, &args[0], id);
+            string_arg(&pattern, &args[1], id);
+
+            Regex *re = lookup_regex(vm, &pattern);
+
+            int start, end;
+            if (regex_search(re, arg_chars(&s), s.length, 0, &start, &end)) {
+                return_int(dest, arg_char_index(&s, start));
+            } else {
+                return_int(dest, -1);
+            }
+        } break;
+
+        case BUILTIN_GROUP:
+        {
+            StringArg s;
+            int start, end;
+
+            if (regex_group_arg(vm, args, id, &s, &start, &end)) {
+                substring_value(vm, dest, &s, start, end - start);
+            } else {
+                dest->type = OBJECT_NULL;
+            }
+        } break;
+
+        case BUILTIN_GROUP_START:
+        case BUILTIN_GROUP_END:
+        {
+            StringArg s;
+            int start, end;
+
+            if (regex_group_arg(vm, args, id, &s, &start, &end)) {
+                return_int(dest, arg_char_index(&s, id == BUILTIN_GROUP_START ? start : end));
+            } else {
+                return_int(dest, -1);
+            }
+        } break;
+    }
+}
@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2014, Eric Fritz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+ * BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "vm.h"
+
+typedef enum {
+    BUILTIN_LEN,            // len(s): number of characters in s
+    BUILTIN_AT,             // at(s, i): the i-th character of s
+    BUILTIN_SUB,            // sub(s, i, j): characters i up to (not including) j
+    BUILTIN_FIND,           // find(s, t): index of the first t in s, or -1
+    BUILTIN_CONTAINS,       // contains(s, t): whether t occurs in s
+    BUILTIN_COUNT,          // count(s, t): number of non-overlapping t in s
+    BUILTIN_SPLIT,          // split(s, sep, i): i-th field of s split on sep, or null
+    BUILTIN_REPLACE,        // replace(s, t, u): s with every t replaced by u
+    BUILTIN_TRIM,           // trim(s): s without leading and trailing whitespace
+    BUILTIN_STARTS_WITH,    // starts_with(s, t): whether s begins with t
+    BUILTIN_ENDS_WITH,      // ends_with(s, t): whether s ends with t
+    BUILTIN_MATCH,          // match(s, re): whether all of s matches re
+    BUILTIN_SEARCH,         // search(s, re): index of the first match of re in s, or -1
+    BUILTIN_GROUP,          // group(s, re, n): text of group n of the first match, or null
+    BUILTIN_GROUP_START,    // group_start(s, re, n): index where group n begins, or -1
+    BUILTIN_GROUP_END       // group_end(s, re, n): index where group n ends, or -1
+} BuiltinId;
+
+#define NUM_BUILTINS (BUILTIN_GROUP_END + 1)
+
+const char *const builtin_names[NUM_BUILTINS];
+const int builtin_arity[NUM_BUILTINS];
+
+int find_builtin(const char *name);
+void call_builtin(VM *vm, int id, StackObject *dest, StackObject *args);
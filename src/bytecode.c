@@ -31,16 +31,101 @@ const char *const opcode_names[] = {
     "POW",
     "UNM",
     "NOT",
+    "CONCAT",
     "EQ",
+    "NE",
     "LT",
     "LE",
+    "TEST_EQ",
+    "TEST_LT",
+    "TEST_LE",
     "CLOSURE",
     "CALL",
+    "CALL_DIRECT",
+    "BUILTIN",
     "RETURN",
     "JUMP",
     "JUMP_TRUE",
     "JUMP_FALSE",
     "THROW",
     "ENTER_TRY",
-    "LEAVE_TRY"
+    "LEAVE_TRY",
+    "ADD_INT",
+    "SUB_INT",
+    "MUL_INT",
+    "DIV_INT",
+    "MOD_INT",
+    "UNM_INT",
+    "ADD_REAL",
+    "SUB_REAL",
+    "MUL_REAL",
+    "DIV_REAL",
+    "NOT_BOOL",
+    "EQ_INT",
+    "NE_INT",
+    "LT_INT",
+    "LE_INT",
+    "LT_REAL",
+    "LE_REAL",
+    "TEST_EQ_INT",
+    "TEST_LT_INT",
+    "TEST_LE_INT",
+    "TEST_LT_REAL",
+    "TEST_LE_REAL",
+    "JUMP_TRUE_BOOL",
+    "JUMP_FALSE_BOOL"
 };
+
+/*
+ * Returns the instruction a typed one is a form of, or op itself. Passes
+ * over bytecode treat the two alike, as they have the same operands.
+ */
+OpCode generic_opcode(OpCode op) {
+    switch (op) {
+        case OP_ADD_INT:
+        case OP_ADD_REAL:
+            return OP_ADD;
+
+        case OP_SUB_INT:
+        case OP_SUB_REAL:
+            return OP_SUB;
+
+        case OP_MUL_INT:
+        case OP_MUL_REAL:
+            return OP_MUL;
+
+        case OP_DIV_INT:
+        case OP_DIV_REAL:
+            return OP_DIV;
+
+        case OP_MOD_INT:         return OP_MOD;
+        case OP_NEG_INT:         return OP_NEG;
+        case OP_NOT_BOOL:        return OP_NOT;
+        case OP_EQ_INT:          return OP_EQ;
+        case OP_NE_INT:          return OP_NE;
+
+        case OP_LT_INT:
+        case OP_LT_REAL:
+            return OP_LT;
+
+        case OP_LE_INT:
+        case OP_LE_REAL:
+            return OP_LE;
+
+        case OP_TEST_EQ_INT:     return OP_TEST_EQ;
+
+        case OP_TEST_LT_INT:
+        case OP_TEST_LT_REAL:
+            return OP_TEST_LT;
+
+        case OP_TEST_LE_INT:
+        case OP_TEST_LE_REAL:
+            return OP_TEST_LE;
+
+        case OP_JUMP_TRUE_BOOL:  return OP_JUMP_TRUE;
+        case OP_JUMP_FALSE_BOOL: return OP_JUMP_FALSE;
+
+        default:
+            return op;
+    }
+}
@@ -39,7 +39,9 @@
 #define GET_B(i) (((i) >> POS_B) & MAX_B)
 #define GET_C(i) (((i) >> POS_C) & MAX_C)
 
-#define CREATE(op, a, b, c) ((op << POS_O) | ((a) << POS_A) | ((b) << POS_B) | ((c) << POS_C))
+// shifted unsigned; C reaches the sign bit
+#define CREATE(op, a, b, c) ((int) (((unsigned) (op) << POS_O) | ((unsigned) (a) << POS_A) \
+    | ((unsigned) (b) << POS_B) | ((unsigned) (c) << POS_C)))
 
 typedef enum {
     OP_MOVE,            // R(A) := RK(B)
@@ -54,13 +56,21 @@ typedef enum {
     OP_POW,             // R(A) := RK(B) ^ RK(C)
     OP_NEG,             // R(A) := -RK(B)
     OP_NOT,             // R(A) := ~RK(B)
+    OP_CONCAT,          // R(A) := R(B) .. R(B+1) .. ... .. R(B+C-1)
 
     OP_EQ,              // R(A) := RK(B) == RK(C)
+    OP_NE,              // R(A) := RK(B) != RK(C)
     OP_LT,              // R(A) := RK(B) <  RK(C)
     OP_LE,              // R(A) := RK(B) <= RK(C)
 
-    OP_CLOSURE,         // R(A) := Closure[B]
-    OP_CALL,            // R(A) := R(B)(R(C), R(C+1), ...)
+    OP_TEST_EQ,         // if (RK(B) == RK(C)) != A then PC++
+    OP_TEST_LT,         // if (RK(B) <  RK(C)) != A then PC++
+    OP_TEST_LE,         // if (RK(B) <= RK(C)) != A then PC++
+
+    OP_CLOSURE,         // R(A) := Closure[B] (owned by the frame if C)
+    OP_CALL,            // R(A) := R(B)(R(B+1), ..., R(B+C))
+    OP_CALL_DIRECT,     // R(A) := R(B)(R(C), R(C+1), ...) (arity checked by semant)
+    OP_BUILTIN,         // R(A) := Builtin[B](R(C), R(C+1), ...)
     OP_RETURN,          // return RK(B)
 
     OP_JUMP,            // PC := PC + (R(C) ? -B : B)
@@ -69,9 +79,42 @@ typedef enum {
 
     OP_THROW,           // Throw R(A)
     OP_ENTER_TRY,       // Handlers := add(Handlers, Instruction[B])
-    OP_LEAVE_TRY        // Handlers := pop(Handlers)
+    OP_LEAVE_TRY,       // Handlers := pop(Handlers)
+
+    // forms of the instructions above for operands which type inference
+    // has proven to have the type named; they do not check it
+
+    OP_ADD_INT,         // R(A) := RK(B) + RK(C)
+    OP_SUB_INT,         // R(A) := RK(B) - RK(C)
+    OP_MUL_INT,         // R(A) := RK(B) * RK(C)
+    OP_DIV_INT,         // R(A) := RK(B) / RK(C)
+    OP_MOD_INT,         // R(A) := RK(B) % RK(C)
+    OP_NEG_INT,         // R(A) := -RK(B)
+    OP_ADD_REAL,        // R(A) := RK(B) + RK(C)
+    OP_SUB_REAL,        // R(A) := RK(B) - RK(C)
+    OP_MUL_REAL,        // R(A) := RK(B) * RK(C)
+    OP_DIV_REAL,        // R(A) := RK(B) / RK(C)
+    OP_NOT_BOOL,        // R(A) := ~RK(B)
+
+    OP_EQ_INT,          // R(A) := RK(B) == RK(C)
+    OP_NE_INT,          // R(A) := RK(B) != RK(C)
+    OP_LT_INT,          // R(A) := RK(B) <  RK(C)
+    OP_LE_INT,          // R(A) := RK(B) <= RK(C)
+    OP_LT_REAL,         // R(A) := RK(B) <  RK(C)
+    OP_LE_REAL,         // R(A) := RK(B) <= RK(C)
+
+    OP_TEST_EQ_INT,     // if (RK(B) == RK(C)) != A then PC++
+    OP_TEST_LT_INT,     // if (RK(B) <  RK(C)) != A then PC++
+    OP_TEST_LE_INT,     // if (RK(B) <= RK(C)) != A then PC++
+    OP_TEST_LT_REAL,    // if (RK(B) <  RK(C)) != A then PC++
+    OP_TEST_LE_REAL,    // if (RK(B) <= RK(C)) != A then PC++
+
+    OP_JUMP_TRUE_BOOL,  // PC := PC + (R(C) ? -B : B) : if R(A) == true
+    OP_JUMP_FALSE_BOOL  // PC := PC + (R(C) ? -B : B) : if R(A) == false
 } OpCode;
 
-#define NUM_OPCODES OP_LEAVE_TRY + 1
+#define NUM_OPCODES OP_JUMP_FALSE_BOOL + 1
 
 const char *const opcode_names[NUM_OPCODES];
+
+OpCode generic_opcode(OpCode op);
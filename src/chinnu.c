@@ -25,12 +25,28 @@
 #include "chinnu.h"
 #include "vm.h"
 #include "bytecode.h"
+#include "snapshot.h"
+#include "profile.h"
+#include "builtin.h"
+#include "optimize.h"
+#include "fold.h"
+#include "dead.h"
+#include "inline.h"
+#include "evaluate.h"
+#include "escape.h"
+#include "regalloc.h"
+#include "typeinfer.h"
 
 extern FILE *yyin;
 extern int yyparse();
 extern void yylex_destroy();
 
 void fatal(const char *fmt, ...) {
+    // a call evaluated at compile time is given up on instead
+    if (sandbox_exit) {
+        longjmp(*sandbox_exit, 1);
+    }
+
     va_list args;
     va_start(args, fmt);
 
@@ -209,6 +225,12 @@ void show_usage(char *program) {
     printf("  -o            optimize before running\n");
     printf("  -h --help     display usage and exit\n");
     printf("  -v --version  display version and exit\n");
+    printf("\n");
+    printf("  --snapshot <file>         write heap snapshots at exit and on SIGUSR1\n");
+    printf("  --snapshot-threshold <n>  also snapshot when the heap reaches n objects\n");
+    printf("  --summarize <file>        summarize a heap snapshot file and exit\n");
+    printf("  --alloc-profile <file>    write an allocation profile (and <file>.folded)\n");
+    printf("  --alloc-sample <n>        record one in every n allocations\n");
 }
 
 void show_version(char *program) {
@@ -220,6 +242,7 @@ static int version_flag = 0;
 static int disassemble_flag = 0;
 static int compile_flag = 0;
 static int optimize_flag = 0;
+static char *summarize_file = NULL;
 
 static struct option options[] = {
     {"help",    no_argument,       &help_flag,    1},
@@ -230,6 +253,12 @@ static struct option options[] = {
     {"o",       no_argument,       0,             'o'},
     {"h",       no_argument,       0,             'h'},
     {"v",       no_argument,       0,             'v'},
+
+    {"snapshot",           required_argument, 0, 'S'},
+    {"snapshot-threshold", required_argument, 0, 'T'},
+    {"summarize",          required_argument, 0, 'Y'},
+    {"alloc-profile",      required_argument, 0, 'P'},
+    {"alloc-sample",       required_argument, 0, 'N'},
     {0,         0,                 0,             0}
 };
 
@@ -282,6 +311,7 @@ void dump_chunk(Chunk *chunk, FILE *fp) {
         switch (chunk->constants[i]->type) {
             case CONST_INT:
             case CONST_BOOL:
+            case CONST_FUNC:
                 dump_int(fp, chunk->constants[i]->value.i);
                 break;
 
@@ -394,10 +424,12 @@ Chunk *read_chunk(FILE *fp) {
         }
 
         c->type = type;
+        c->object = NULL;
 
         switch (type) {
             case CONST_INT:
             case CONST_BOOL:
+            case CONST_FUNC:
                 c->value.i = read_int(fp);
                 break;
 
@@ -445,6 +477,10 @@ void print_const(Constant *c) {
         case CONST_STRING:
             printf("\"%s\"", c->value.s);
             break;
+
+        case CONST_FUNC:
+            printf("function %d", c->value.i);
+            break;
     }
 }
 
@@ -458,7 +494,8 @@ void dis(Chunk *chunk) {
         int b = GET_B(instruction);
         int c = GET_C(instruction);
 
-        switch (o) {
+        // typed forms print like the instruction they are a form of
+        switch (generic_opcode(o)) {
                 case OP_RETURN:
                 case OP_LEAVE_TRY:
                     printf("%d\t%-15s%d", i + 1, opcode_names[o], b);
@@ -478,12 +515,24 @@ void dis(Chunk *chunk) {
                         printf("\t; b=");
                         print_const(chunk->constants[b - 256]);
                     }
+
+                    // an upvar captured by value
+                    if (o == OP_MOVE && c) {
+                        printf("\t; by value");
+                    }
                 } break;
 
                 case OP_GETUPVAR:
                 case OP_SETUPVAR:
+                    printf("%d\t%-15s%d %d", i + 1, opcode_names[o], a, b);
+                    break;
+
                 case OP_CLOSURE:
                     printf("%d\t%-15s%d %d", i + 1, opcode_names[o], a, b);
+
+                    if (c) {
+                        printf("\t; local");
+                    }
                     break;
 
                 case OP_JUMP:
@@ -501,8 +550,12 @@ void dis(Chunk *chunk) {
                 case OP_MOD:
                 case OP_POW:
                 case OP_EQ:
+                case OP_NE:
                 case OP_LT:
                 case OP_LE:
+                case OP_TEST_EQ:
+                case OP_TEST_LT:
+                case OP_TEST_LE:
                 {
                     printf("%d\t%-15s%d %d %d", i + 1, opcode_names[o], a, b, c);
 
@@ -515,15 +568,30 @@ void dis(Chunk *chunk) {
                         printf("\t; b=");
                         print_const(chunk->constants[b - 256]);
                     }
+
+                    if (c > 255) {
+                        printf("\t; c=");
+                        print_const(chunk->constants[c - 256]);
+                    }
                 } break;
 
                 case OP_CALL:
+                case OP_CALL_DIRECT:
+                case OP_CONCAT:
                     printf("%d\t%-15s%d %d %d", i + 1, opcode_names[o], a, b, c);
                     break;
 
+                case OP_BUILTIN:
+                    printf("%d\t%-15s%d %d %d\t; %s", i + 1, opcode_names[o], a, b, c, builtin_names[b]);
+                    break;
+
                 case OP_ENTER_TRY:
                     printf("%d\t%-15s%d\t; j=%d", i + 1, opcode_names[o], b, i + b + 1);
                     break;
+
+                default:
+                    // never a typed opcode; those were mapped to their generic form
+                    break;
         }
 
         printf("\n");
@@ -534,6 +602,14 @@ void dis(Chunk *chunk) {
     }
 }
 
+void dis_stats(OptimizerStats *stats) {
+    printf("; optimizer: %d moves folded, %d moves forwarded, %d dead stores removed, %d jumps threaded, %d comparisons folded\n",
+        stats->moves, stats->forwards, stats->stores, stats->jumps, stats->compares);
+
+    printf("; ssa: %d instructions hoisted, %d values reused, %d copies propagated\n",
+        stats->hoisted, stats->values, stats->copies);
+}
+
 int valid_cache(char *filename) {
     FILE *fp = fopen(filename, "rb");
 
@@ -591,6 +667,35 @@ Chunk *make(char *file) {
         exit(EXIT_FAILURE);
     }
 
+    if (optimize_flag) {
+        fold(program);
+    }
+
+    if (optimize_flag || warning_flags[WARNING_UNREACHABLE]) {
+        eliminate_dead_code(program, optimize_flag, 1);
+    }
+
+    // the results of calls made at compile time are folded again, before
+    // inlining can turn the calls into copies of the body
+    if (optimize_flag && evaluate_pure_calls(program) > 0) {
+        fold(program);
+        eliminate_dead_code(program, 1, 0);
+    }
+
+    // inlined bodies are folded again with the arguments they were given
+    if (optimize_flag && inline_calls(program) > 0) {
+        fold(program);
+        eliminate_dead_code(program, 1, 0);
+    }
+
+    analyze_escapes(program);
+    allocate_registers(program, optimize_flag);
+
+    // after allocation, which decides which locals closures may change
+    if (optimize_flag) {
+        infer_static_types(program);
+    }
+
     Chunk *chunk = compile(program);
     free_expr(program);
 
@@ -641,6 +746,26 @@ int main(int argc, char **argv) {
                 version_flag = 1;
                 break;
 
+            case 'S':
+                snapshot_file = optarg;
+                break;
+
+            case 'T':
+                snapshot_threshold = atoi(optarg);
+                break;
+
+            case 'Y':
+                summarize_file = optarg;
+                break;
+
+            case 'P':
+                profile_file = optarg;
+                break;
+
+            case 'N':
+                profile_sample = atoi(optarg);
+                break;
+
             case 0:
                 /* getopt_long set a flag */
                 break;
@@ -661,16 +786,32 @@ int main(int argc, char **argv) {
         return EXIT_SUCCESS;
     }
 
+    if (profile_sample < 1) {
+        profile_sample = 1;
+    }
+
+    if (summarize_file) {
+        summarize_snapshot(summarize_file);
+        return EXIT_SUCCESS;
+    }
+
     if (optind == argc) {
         printf("No files supplied.\n");
         return EXIT_FAILURE;
     }
 
     for ( ; optind < argc; optind++) {
+        OptimizerStats stats;
+        memset(&stats, 0, sizeof stats);
+
         if (compile_flag == 1) {
             Chunk *chunk = make(argv[optind]);
             char *output = get_cache_name(argv[optind]);
 
+            if (optimize_flag) {
+                optimize(chunk, &stats);
+            }
+
             save(chunk, output);
 
             free(output);
@@ -690,8 +831,16 @@ int main(int argc, char **argv) {
                 chunk = make(argv[optind]);
             }
 
+            if (optimize_flag) {
+                optimize(chunk, &stats);
+            }
+
             if (disassemble_flag) {
                 dis(chunk);
+
+                if (optimize_flag) {
+                    dis_stats(&stats);
+                }
             } else {
                 execute(chunk);
             }
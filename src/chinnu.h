@@ -27,7 +27,7 @@
 
 #define MAGIC_BYTE 0x43484E55
 #define MAJOR_VERSION 0
-#define MINOR_VERSION 0
+#define MINOR_VERSION 1
 #define CHINNU_VERSION TOSTR(MAJOR_VERSION) "." TOSTR(MINOR_VERSION)
 
 Expression *program;
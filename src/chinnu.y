@@ -70,6 +70,7 @@ void yyerror(const char *fmt, ...);
 %token <i> INTEGER_LITERAL
 %token <d> REAL_LITERAL
 %token <s> STRING_LITERAL
+%token <s> INTERP_BEGIN INTERP_MID INTERP_END
 
 %token IF THEN ELIF ELSE WHILE DO END FUN VAR VAL TRUE FALSE NIL THROW CATCH
 
@@ -82,8 +83,8 @@ void yyerror(const char *fmt, ...);
 %left POW
 %left NOT UNARY
 
-%type <expr> program expr block else_block
-%type <list> expr_list arg_list arg_list2 param_list param_list2
+%type <expr> program expr block else_block interp
+%type <list> expr_list arg_list arg_list2 param_list param_list2 interp_list
 
 %start program
 
@@ -133,6 +134,7 @@ expr : IF expr THEN block else_block END     { $$ = make_if(@$, $2, $4, $5); }
      | INTEGER_LITERAL                       { $$ = make_int(@$, $1); }
      | REAL_LITERAL                          { $$ = make_real(@$, $1); }
      | STRING_LITERAL                        { $$ = make_str(@$, $1); }
+     | interp                                { $$ = $1; }
      | TRUE                                  { $$ = make_bool(@$, 1); }
      | FALSE                                 { $$ = make_bool(@$, 0); }
      | NIL                                   { $$ = make_null(@$); }
@@ -159,6 +161,13 @@ param_list2 : param_list2 ',' IDENT          { $$ = expression_list_append($1, m
             | IDENT                          { $$ = list1(make_declaration(@1, $1, 0, 1)); }
             ;
 
+interp : interp_list INTERP_END              { $$ = make_interp(@$, expression_list_append($1, make_str(@2, $2))); }
+       ;
+
+interp_list : interp_list INTERP_MID expr    { $$ = expression_list_append(expression_list_append($1, make_str(@2, $2)), $3); }
+            | INTERP_BEGIN expr              { $$ = expression_list_append(list1(make_str(@1, $1)), $2); }
+            ;
+
 else_block : ELSE block                      { $$ = $2; }
            | ELIF expr THEN block else_block { $$ = make_if(@$, $2, $4, $5); }
            |                                 { $$ = NULL; }
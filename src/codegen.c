@@ -23,6 +23,9 @@
 #include "chinnu.h"
 #include "codegen.h"
 #include "bytecode.h"
+#include "builtin.h"
+#include "escape.h"
+#include "typeinfer.h"
 
 #define MAX(a, b) ((a > b) ? a : b)
 
@@ -94,6 +97,7 @@ Constant *make_const() {
         fatal("Out of memory.");
     }
 
+    c->object = NULL;
     return c;
 }
 
@@ -176,6 +180,15 @@ int add_string(Chunk *chunk, char *value) {
     return add_constant(chunk, c);
 }
 
+int add_func(Chunk *chunk, int child) {
+    Constant *c = make_const();
+
+    c->type = CONST_FUNC;
+    c->value.i = child;
+
+    return add_constant(chunk, c);
+}
+
 int add_func_child(Chunk *chunk, Chunk *child) {
     if (chunk->numchildren % CHUNK_CHUNK_SIZE == 0) {
         Chunk **resize = realloc(chunk->children, (chunk->numchildren + CHUNK_CHUNK_SIZE) * sizeof **resize);
@@ -210,7 +223,7 @@ int get_local_index(Scope *scope, Symbol *symbol) {
     int i;
     for (i = 0; i < scope->numlocals; i++) {
         if (scope->locals[i] == symbol) {
-            return i + 1;
+            return symbol->slot;
         }
     }
 
@@ -229,12 +242,478 @@ int get_upvar_index(Scope *scope, Symbol *symbol) {
 }
 
 int get_temp_index(Scope *scope, int temp) {
-    return scope->numlocals + temp + 1;
+    return scope->numslots + temp + 1;
 }
 
 /* forward */
+int compile_expr(Expression *expr, Chunk *chunk, Scope *scope, int dest, int temp);
 int compile_list(ExpressionList *list, Chunk *chunk, Scope *scope, int dest, int temp);
 
+/*
+ * Returns non-zero if expr refers to the symbol anywhere, as a value or
+ * as the target of an assignment.
+ */
+int refers_to(Expression *expr, Symbol *symbol);
+
+int list_refers_to(ExpressionList *list, Symbol *symbol) {
+    if (list) {
+        ExpressionNode *head;
+        for (head = list->head; head != NULL; head = head->next) {
+            if (refers_to(head->expr, symbol)) {
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+int refers_to(Expression *expr, Symbol *symbol) {
+    if (!expr) {
+        return 0;
+    }
+
+    if (expr->type == TYPE_VARREF && expr->symbol == symbol) {
+        return 1;
+    }
+
+    return refers_to(expr->cond, symbol)
+        || refers_to(expr->lexpr, symbol)
+        || refers_to(expr->rexpr, symbol)
+        || list_refers_to(expr->llist, symbol)
+        || list_refers_to(expr->rlist, symbol);
+}
+
+/*
+ * Returns non-zero if evaluating expr could change the value held in the
+ * register of the local. Only assignments in this function can, unless
+ * the local is captured.
+ */
+int may_write(Expression *expr, Symbol *symbol);
+
+int list_may_write(ExpressionList *list, Symbol *symbol) {
+    if (list) {
+        ExpressionNode *head;
+        for (head = list->head; head != NULL; head = head->next) {
+            if (may_write(head->expr, symbol)) {
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+int may_write(Expression *expr, Symbol *symbol) {
+    if (!expr) {
+        return 0;
+    }
+
+    if (symbol->captured) {
+        return 1;
+    }
+
+    if (expr->type == TYPE_ASSIGN && expr->lexpr->symbol == symbol) {
+        return 1;
+    }
+
+    return may_write(expr->cond, symbol)
+        || may_write(expr->lexpr, symbol)
+        || may_write(expr->rexpr, symbol)
+        || list_may_write(expr->llist, symbol)
+        || list_may_write(expr->rlist, symbol);
+}
+
+/*
+ * Returns the register or constant an instruction can read the operand
+ * from without code to load it, or -1. A local qualifies only if nothing
+ * evaluated between here and the read can change it.
+ */
+int direct_operand(Expression *expr, Expression *later, Chunk *chunk, Scope *scope) {
+    int index;
+
+    switch (expr->type) {
+        case TYPE_INT:    index = add_int(chunk, expr->value.i);    break;
+        case TYPE_REAL:   index = add_real(chunk, expr->value.d);   break;
+        case TYPE_BOOL:   index = add_bool(chunk, expr->value.i);   break;
+        case TYPE_NULL:   index = add_null(chunk);                  break;
+        case TYPE_STRING: index = add_string(chunk, expr->value.s); break;
+
+        case TYPE_VARREF:
+            if (may_write(later, expr->symbol)) {
+                return -1;
+            }
+
+            return get_local_index(scope, expr->symbol);
+
+        default:
+            return -1;
+    }
+
+    return index < 256 ? index + 256 : -1;
+}
+
+/*
+ * Returns non-zero if value can be computed directly in the register of
+ * the local instead of a temporary. Partial results are stored there as
+ * the expression is evaluated, so this requires that they cannot be
+ * observed: the local is neither captured nor assigned inside a protected
+ * block, and is not read again after its register is first written.
+ */
+int safe_target(Expression *value, Symbol *symbol) {
+    if (!refers_to(value, symbol)) {
+        return 1;
+    }
+
+    switch (value->type) {
+        case TYPE_VARREF:
+            return 1;
+
+        // the left operand is computed into the destination, and the right
+        // operand into a temporary
+        case TYPE_ADD:
+        case TYPE_SUB:
+        case TYPE_MUL:
+        case TYPE_DIV:
+        case TYPE_MOD:
+        case TYPE_POW:
+        case TYPE_EQEQ:
+        case TYPE_NEQ:
+        case TYPE_LT:
+        case TYPE_LEQ:
+        case TYPE_GT:
+        case TYPE_GEQ:
+            return safe_target(value->lexpr, symbol) && !refers_to(value->rexpr, symbol);
+
+        default:
+            return 0;
+    }
+}
+
+int can_target(Expression *value, Symbol *symbol) {
+    return !symbol->captured && !symbol->guarded && safe_target(value, symbol);
+}
+
+/*
+ * Compiles the operands of a binary operator, leaving the register or
+ * constant each can be read from in *b and *c.
+ */
+int compile_operands(Expression *expr, Chunk *chunk, Scope *scope, int dest, int temp, int *b, int *c) {
+    int max = temp;
+
+    *b = direct_operand(expr->lexpr, expr->rexpr, chunk, scope);
+
+    if (*b == -1) {
+        max = compile_expr(expr->lexpr, chunk, scope, dest, temp);
+        *b = dest;
+    }
+
+    *c = direct_operand(expr->rexpr, NULL, chunk, scope);
+
+    if (*c == -1) {
+        *c = get_temp_index(scope, temp);
+
+        int max2 = compile_expr(expr->rexpr, chunk, scope, *c, temp + 1);
+        max = MAX(max, max2);
+    }
+
+    return max;
+}
+
+/*
+ * Returns the typed form of an instruction for operands known to have
+ * the types t1 and t2 (which are the same for a unary instruction), or
+ * op itself if there is none. Without -o nothing is known about types.
+ */
+OpCode typed_opcode(OpCode op, int t1, int t2) {
+    if (t1 == T_INT && t2 == T_INT) {
+        switch (op) {
+            case OP_ADD:     return OP_ADD_INT;
+            case OP_SUB:     return OP_SUB_INT;
+            case OP_MUL:     return OP_MUL_INT;
+            case OP_DIV:     return OP_DIV_INT;
+            case OP_MOD:     return OP_MOD_INT;
+            case OP_NEG:     return OP_NEG_INT;
+            case OP_EQ:      return OP_EQ_INT;
+            case OP_NE:      return OP_NE_INT;
+            case OP_LT:      return OP_LT_INT;
+            case OP_LE:      return OP_LE_INT;
+            case OP_TEST_EQ: return OP_TEST_EQ_INT;
+            case OP_TEST_LT: return OP_TEST_LT_INT;
+            case OP_TEST_LE: return OP_TEST_LE_INT;
+
+            default:
+                break;
+        }
+    }
+
+    if (t1 == T_REAL && t2 == T_REAL) {
+        switch (op) {
+            case OP_ADD:     return OP_ADD_REAL;
+            case OP_SUB:     return OP_SUB_REAL;
+            case OP_MUL:     return OP_MUL_REAL;
+            case OP_DIV:     return OP_DIV_REAL;
+            case OP_LT:      return OP_LT_REAL;
+            case OP_LE:      return OP_LE_REAL;
+            case OP_TEST_LT: return OP_TEST_LT_REAL;
+            case OP_TEST_LE: return OP_TEST_LE_REAL;
+
+            default:
+                break;
+        }
+    }
+
+    if (t1 == T_BOOL && t2 == T_BOOL) {
+        switch (op) {
+            case OP_NOT:        return OP_NOT_BOOL;
+            case OP_JUMP_TRUE:  return OP_JUMP_TRUE_BOOL;
+            case OP_JUMP_FALSE: return OP_JUMP_FALSE_BOOL;
+
+            default:
+                break;
+        }
+    }
+
+    return op;
+}
+
+int compile_binop(Expression *expr, OpCode op, int swap, Chunk *chunk, Scope *scope, int dest, int temp) {
+    int b, c;
+    int max = compile_operands(expr, chunk, scope, dest, temp, &b, &c);
+
+    op = typed_opcode(op, expr->lexpr->types, expr->rexpr->types);
+
+    if (swap) {
+        add_instruction(chunk, CREATE(op, dest, c, b));
+    } else {
+        add_instruction(chunk, CREATE(op, dest, b, c));
+    }
+
+    return max;
+}
+
+/*
+ * Conditions of an if or while, and the operands of and, or and not, are
+ * compiled as control flow rather than values: the code jumps somewhere
+ * when the condition has a given value and falls through otherwise. A
+ * comparison becomes a test that skips the jump following it, and and,
+ * or and not only decide where the jumps of their operands go, so no
+ * boolean is stored on the way. The jumps are emitted before their
+ * target is known and collected in a list to be patched.
+ */
+
+#define JUMP_CHUNK_SIZE 4
+
+typedef struct {
+    int *jumps;
+    int numjumps;
+} JumpList;
+
+void add_pending_jump(JumpList *list, int index) {
+    if (list->numjumps % JUMP_CHUNK_SIZE == 0) {
+        int *resize = realloc(list->jumps, (list->numjumps + JUMP_CHUNK_SIZE) * sizeof *resize);
+
+        if (!resize) {
+            fatal("Out of memory.");
+        }
+
+        list->jumps = resize;
+    }
+
+    list->jumps[list->numjumps++] = index;
+}
+
+// points every jump in the list at target, and empties it
+void patch_jumps(Chunk *chunk, JumpList *list, int target) {
+    int i;
+    for (i = 0; i < list->numjumps; i++) {
+        int index = list->jumps[i];
+        int instruction = chunk->instructions[index];
+
+        if (target > index) {
+            chunk->instructions[index] = CREATE(GET_O(instruction), GET_A(instruction), target - index - 1, 0);
+        } else {
+            chunk->instructions[index] = CREATE(GET_O(instruction), GET_A(instruction), index + 1 - target, 1);
+        }
+    }
+
+    free(list->jumps);
+    list->jumps = NULL;
+    list->numjumps = 0;
+}
+
+int compile_test(Expression *expr, OpCode op, int swap, int sense, JumpList *jumps, Chunk *chunk, Scope *scope, int dest, int temp) {
+    int b, c;
+    int max = compile_operands(expr, chunk, scope, dest, temp, &b, &c);
+
+    op = typed_opcode(op, expr->lexpr->types, expr->rexpr->types);
+
+    if (swap) {
+        add_instruction(chunk, CREATE(op, sense, c, b));
+    } else {
+        add_instruction(chunk, CREATE(op, sense, b, c));
+    }
+
+    add_pending_jump(jumps, add_instruction(chunk, CREATE(OP_JUMP, 0, 0, 0)));
+    return max;
+}
+
+/*
+ * Compiles a condition which jumps (by a jump added to the list) when its
+ * value is sense, and falls through when it is not.
+ */
+int compile_condition(Expression *expr, int sense, JumpList *jumps, Chunk *chunk, Scope *scope, int dest, int temp) {
+    switch (expr->type) {
+        case TYPE_EQEQ:
+            return compile_test(expr, OP_TEST_EQ, 0, sense, jumps, chunk, scope, dest, temp);
+
+        case TYPE_NEQ:
+            return compile_test(expr, OP_TEST_EQ, 0, !sense, jumps, chunk, scope, dest, temp);
+
+        case TYPE_LT:
+            return compile_test(expr, OP_TEST_LT, 0, sense, jumps, chunk, scope, dest, temp);
+
+        case TYPE_LEQ:
+            return compile_test(expr, OP_TEST_LE, 0, sense, jumps, chunk, scope, dest, temp);
+
+        case TYPE_GT:
+            return compile_test(expr, OP_TEST_LT, 1, sense, jumps, chunk, scope, dest, temp);
+
+        case TYPE_GEQ:
+            return compile_test(expr, OP_TEST_LE, 1, sense, jumps, chunk, scope, dest, temp);
+
+        case TYPE_NOT:
+            return compile_condition(expr->lexpr, !sense, jumps, chunk, scope, dest, temp);
+
+        case TYPE_AND:
+        case TYPE_OR:
+        {
+            // the right operand decides unless the left one has the value
+            // that decides on its own: false for and, true for or
+            int decides = expr->type == TYPE_OR;
+
+            if (sense == decides) {
+                int max1 = compile_condition(expr->lexpr, sense, jumps, chunk, scope, dest, temp);
+                int max2 = compile_condition(expr->rexpr, sense, jumps, chunk, scope, dest, temp);
+
+                return MAX(max1, max2);
+            }
+
+            JumpList skip = { NULL, 0 };
+
+            int max1 = compile_condition(expr->lexpr, !sense, &skip, chunk, scope, dest, temp);
+            int max2 = compile_condition(expr->rexpr, sense, jumps, chunk, scope, dest, temp);
+
+            patch_jumps(chunk, &skip, chunk->numinstructions);
+            return MAX(max1, max2);
+        }
+
+        case TYPE_BOOL:
+            if (expr->value.i == sense) {
+                add_pending_jump(jumps, add_instruction(chunk, CREATE(OP_JUMP, 0, 0, 0)));
+            }
+
+            return temp;
+
+        default:
+        {
+            // anything else is a value, which must be a boolean
+            OpCode op = typed_opcode(sense ? OP_JUMP_TRUE : OP_JUMP_FALSE, expr->types, expr->types);
+
+            int max = temp;
+            int r = -1;
+
+            if (expr->type == TYPE_VARREF) {
+                r = get_local_index(scope, expr->symbol);
+            }
+
+            if (r == -1) {
+                max = compile_expr(expr, chunk, scope, dest, temp);
+                r = dest;
+            }
+
+            add_pending_jump(jumps, add_instruction(chunk, CREATE(op, r, 0, 0)));
+            return max;
+        }
+    }
+}
+
+Chunk *compile_function(Expression *expr) {
+    Chunk *chunk = make_chunk();
+    int max = compile_expr(expr->rexpr, chunk, expr->scope, 0, 0);
+    add_instruction(chunk, CREATE(OP_RETURN, 0, 0, 0));
+
+    chunk->numtemps = max;
+    chunk->numlocals = expr->scope->numslots;
+    chunk->numupvars = expr->scope->numupvars;
+    chunk->numparams = expr->scope->numparams;
+    return chunk;
+}
+
+void compile_closure(Expression *expr, Chunk *chunk, Scope *scope, int dest) {
+    int index = add_func_child(chunk, compile_function(expr));
+
+    // without upvars every closure of the function would be the same, so
+    // one shared closure is loaded like a constant
+    if (expr->scope->numupvars == 0) {
+        add_instruction(chunk, CREATE(OP_MOVE, dest, add_func(chunk, index) + 256, 0));
+        return;
+    }
+
+    add_instruction(chunk, CREATE(OP_CLOSURE, dest, index, !expr->scope->escapes));
+
+    // each upvar is described by the instruction that follows: a local of
+    // this frame, captured by reference or by value, or an upvar shared
+    // with this closure
+    int i;
+    for (i = 0; i < expr->scope->numupvars; i++) {
+        int index = get_local_index(scope, expr->scope->upvars[i]);
+
+        if (index != -1) {
+            add_instruction(chunk, CREATE(OP_MOVE, i, index, captures_by_value(expr, expr->scope->upvars[i])));
+        } else {
+            index = get_upvar_index(scope, expr->scope->upvars[i]);
+            add_instruction(chunk, CREATE(OP_GETUPVAR, i, index, 0));
+        }
+    }
+}
+
+/*
+ * Compiles an expression whose value is not used. Declarations and
+ * assignments are computed straight into their local where that is safe,
+ * rather than into dest and then moved.
+ */
+int compile_effect(Expression *expr, Chunk *chunk, Scope *scope, int dest, int temp) {
+    switch (expr->type) {
+        case TYPE_DECLARATION:
+            if (expr->rexpr && can_target(expr->rexpr, expr->symbol)) {
+                return compile_expr(expr->rexpr, chunk, scope, get_local_index(scope, expr->symbol), temp);
+            }
+            break;
+
+        case TYPE_ASSIGN:
+        {
+            int index = get_local_index(scope, expr->lexpr->symbol);
+
+            if (index != -1 && can_target(expr->rexpr, expr->lexpr->symbol)) {
+                return compile_expr(expr->rexpr, chunk, scope, index, temp);
+            }
+        } break;
+
+        case TYPE_FUNC:
+            if (expr->symbol) {
+                compile_closure(expr, chunk, scope, get_local_index(scope, expr->symbol));
+                return temp;
+            }
+            break;
+
+        default:
+            break;
+    }
+
+    return compile_expr(expr, chunk, scope, dest, temp);
+}
+
 int compile_expr(Expression *expr, Chunk *chunk, Scope *scope, int dest, int temp) {
     switch (expr->type) {
         case TYPE_MODULE:
@@ -248,8 +727,17 @@ int compile_expr(Expression *expr, Chunk *chunk, Scope *scope, int dest, int tem
         case TYPE_DECLARATION:
         {
             if (expr->rexpr) {
+                int index = get_local_index(scope, expr->symbol);
+
+                if (can_target(expr->rexpr, expr->symbol)) {
+                    int max = compile_expr(expr->rexpr, chunk, scope, index, temp);
+                    add_instruction(chunk, CREATE(OP_MOVE, dest, index, 0));
+
+                    return max;
+                }
+
                 int max = compile_expr(expr->rexpr, chunk, scope, dest, temp);
-                add_instruction(chunk, CREATE(OP_MOVE, get_local_index(scope, expr->symbol), dest, 0));
+                add_instruction(chunk, CREATE(OP_MOVE, index, dest, 0));
 
                 return max;
             }
@@ -259,33 +747,13 @@ int compile_expr(Expression *expr, Chunk *chunk, Scope *scope, int dest, int tem
 
         case TYPE_FUNC:
         {
-            Chunk *child = make_chunk();
-            int max = compile_expr(expr->rexpr, child, expr->scope, 0, 0);
-            add_instruction(child, CREATE(OP_RETURN, 0, 0, 0));
-
-            child->numtemps = max;
-            child->numlocals = expr->scope->numlocals;
-            child->numupvars = expr->scope->numupvars;
-            child->numparams = expr->scope->numparams;
-
-            int index = add_func_child(chunk, child);
-            add_instruction(chunk, CREATE(OP_CLOSURE, dest, index, 0));
-
-            int i;
-            for (i = 0; i < expr->scope->numupvars; i++) {
-                int index = get_local_index(scope, expr->scope->upvars[i]);
-
-                if (index != -1) {
-                    add_instruction(chunk, CREATE(OP_MOVE, i, index, 0));
-                } else {
-                    index = get_upvar_index(scope, expr->scope->upvars[i]);
-                    add_instruction(chunk, CREATE(OP_GETUPVAR, i, index, 0));
-                }
-            }
-
             if (expr->symbol) {
                 int index = get_local_index(scope, expr->symbol);
-                add_instruction(chunk, CREATE(OP_MOVE, index, dest, 0));
+
+                compile_closure(expr, chunk, scope, index);
+                add_instruction(chunk, CREATE(OP_MOVE, dest, index, 0));
+            } else {
+                compile_closure(expr, chunk, scope, dest);
             }
 
             return temp;
@@ -293,34 +761,79 @@ int compile_expr(Expression *expr, Chunk *chunk, Scope *scope, int dest, int tem
 
         case TYPE_CALL:
         {
-            // compile receiver
-            int max = compile_expr(expr->lexpr, chunk, scope, dest, temp);
+            int numargs = 0;
 
-            /**
-             * TODO
-             * How to pass params safely? Currently, if you pass the wrong
-             * number of params you will either waste temporaries (okay), or
-             * the receiver will read into your local space (bad), or segfault
-             * (also bad). Not sure the correct thing to do in this case.
-             */
+            ExpressionNode *head;
+            for (head = expr->llist->head; head != NULL; head = head->next) {
+                numargs++;
+            }
 
-            if (expr->llist->head == NULL) {
-                add_instruction(chunk, CREATE(OP_CALL, dest, dest, 0));
-            } else {
-                int f = get_temp_index(scope, temp);
-                int t = f;
+            // semant checked the arity, but inlining may have bound a
+            // function literal passed as an argument to a new variable
+            Expression *func = called_function(expr);
 
-                ExpressionNode *head;
-                for (head = expr->llist->head; head != NULL; head = head->next) {
-                    int n = compile_expr(head->expr, chunk, scope, t, ++temp);
-                    max = MAX(n, max);
+            if (func && numargs == func->scope->numparams) {
+                // call from the local unless the function is an upvar
+                int max = temp;
+                int r = get_local_index(scope, expr->lexpr->symbol);
 
-                    t = get_temp_index(scope, temp);
+                if (r == -1) {
+                    max = compile_expr(expr->lexpr, chunk, scope, dest, temp);
+                    r = dest;
                 }
 
-                add_instruction(chunk, CREATE(OP_CALL, dest, dest, f));
+                if (numargs == 0) {
+                    add_instruction(chunk, CREATE(OP_CALL_DIRECT, dest, r, 0));
+                } else {
+                    int f = get_temp_index(scope, temp);
+                    int t = f;
+
+                    for (head = expr->llist->head; head != NULL; head = head->next) {
+                        int n = compile_expr(head->expr, chunk, scope, t, ++temp);
+                        max = MAX(n, max);
+
+                        t = get_temp_index(scope, temp);
+                    }
+
+                    add_instruction(chunk, CREATE(OP_CALL_DIRECT, dest, r, f));
+                }
+
+                return max;
+            }
+
+            // anything else may be called with the wrong number of
+            // arguments, which the VM checks, so they follow the receiver
+            int f = get_temp_index(scope, temp);
+            int max = compile_expr(expr->lexpr, chunk, scope, f, ++temp);
+            int t = get_temp_index(scope, temp);
+
+            for (head = expr->llist->head; head != NULL; head = head->next) {
+                int n = compile_expr(head->expr, chunk, scope, t, ++temp);
+                max = MAX(n, max);
+
+                t = get_temp_index(scope, temp);
+            }
+
+            add_instruction(chunk, CREATE(OP_CALL, dest, f, numargs));
+            return max;
+        }
+
+        case TYPE_BUILTIN:
+        {
+            int max = temp;
+            int f = get_temp_index(scope, temp);
+            int t = f;
+
+            ExpressionNode *head;
+            for (head = expr->llist->head; head != NULL; head = head->next) {
+                int n = compile_expr(head->expr, chunk, scope, t, ++temp);
+                max = MAX(n, max);
+
+                t = get_temp_index(scope, temp);
             }
 
+            add_instruction(chunk, CREATE(OP_BUILTIN, dest, find_builtin(expr->lexpr->value.s), f));
+
             return max;
         }
 
@@ -341,25 +854,25 @@ int compile_expr(Expression *expr, Chunk *chunk, Scope *scope, int dest, int tem
         /* control flow */
         case TYPE_IF:
         {
-            //      cond
-            // [t1] jump if false [t3 - t1]
+            //      cond, jumping to [t2 + 1] if false
             //      true branch
             // [t2] jump [nm - t2]
             // [t2 + 1] false branch
             // [nm]
 
-            // condition
-            int max1 = compile_expr(expr->cond, chunk, scope, dest, temp);
+            JumpList falses = { NULL, 0 };
 
-            // dummy jump 1
-            int t1 = add_instruction(chunk, 0);
+            // condition
+            int max1 = compile_condition(expr->cond, 0, &falses, chunk, scope, dest, temp);
 
             // true branch
             int max2 = compile_expr(expr->lexpr, chunk, scope, dest, temp);
 
-            // dummy jump 2
+            // dummy jump
             int t2 = add_instruction(chunk, 0);
 
+            patch_jumps(chunk, &falses, t2 + 1);
+
             int max3 = 0;
             if (expr->rexpr) {
                 max3 = compile_expr(expr->rexpr, chunk, scope, dest, temp);
@@ -370,10 +883,7 @@ int compile_expr(Expression *expr, Chunk *chunk, Scope *scope, int dest, int tem
 
             int nm = chunk->numinstructions;
 
-            // fill in 1st jump
-            chunk->instructions[t1] = CREATE(OP_JUMP_FALSE, dest, t2 - t1, 0);
-
-            // fill in 2nd jump
+            // fill in jump
             chunk->instructions[t2] = CREATE(OP_JUMP, 0, nm - t2 - 1, 0);
 
             return MAX(max1, MAX(max2, max3));
@@ -381,33 +891,33 @@ int compile_expr(Expression *expr, Chunk *chunk, Scope *scope, int dest, int tem
 
         case TYPE_WHILE:
         {
-            // [t0] cond
-            // [t1] jump if false [t3 - t1]
-            //      body
-            // [t2] jump [t2 - t0]
-            // [t3] null
-
-            int t0 = chunk->numinstructions;
-            int max1 = compile_expr(expr->cond, chunk, scope, dest, temp);
+            // the condition is placed after the body, so that each
+            // iteration takes a single branch back
+            //
+            //      jump [t1 - 1]
+            // [t0] body
+            // [t1] cond, jumping to [t0] if true
+            //      null
 
-            // dummy jump 1
-            int t1 = add_instruction(chunk, 0);
+            // dummy jump
+            int t = add_instruction(chunk, 0);
 
             // compile body
-            int max2 = compile_expr(expr->lexpr, chunk, scope, dest, temp);
+            int t0 = chunk->numinstructions;
+            int max1 = compile_expr(expr->lexpr, chunk, scope, dest, temp);
 
-            // dummy jump 2
-            int t2 = add_instruction(chunk, 0);
+            int t1 = chunk->numinstructions;
+            JumpList trues = { NULL, 0 };
+
+            int max2 = compile_condition(expr->cond, 1, &trues, chunk, scope, dest, temp);
+            patch_jumps(chunk, &trues, t0);
 
             // return null
             int index = add_null(chunk);
-            int t3 = add_instruction(chunk, CREATE(OP_MOVE, dest, index + 256, 0));
-
-            // fill in 1st jump
-            chunk->instructions[t1] = CREATE(OP_JUMP_FALSE, dest, t3 - t1 - 1, 0);
+            add_instruction(chunk, CREATE(OP_MOVE, dest, index + 256, 0));
 
-            // fill in 2nd jump
-            chunk->instructions[t2] = CREATE(OP_JUMP, 0, t3 - t0, 1);
+            // fill in jump
+            chunk->instructions[t] = CREATE(OP_JUMP, 0, t1 - t - 1, 0);
 
             return MAX(max1, max2);
         }
@@ -415,10 +925,17 @@ int compile_expr(Expression *expr, Chunk *chunk, Scope *scope, int dest, int tem
         /* binary cases */
         case TYPE_ASSIGN:
         {
-            int max = compile_expr(expr->rexpr, chunk, scope, dest, temp);
-
             int index = get_local_index(scope, expr->lexpr->symbol);
 
+            if (index != -1 && can_target(expr->rexpr, expr->lexpr->symbol)) {
+                int max = compile_expr(expr->rexpr, chunk, scope, index, temp);
+                add_instruction(chunk, CREATE(OP_MOVE, dest, index, 0));
+
+                return max;
+            }
+
+            int max = compile_expr(expr->rexpr, chunk, scope, dest, temp);
+
             if (index != -1) {
                 add_instruction(chunk, CREATE(OP_MOVE, index, dest, 0));
             } else {
@@ -430,246 +947,73 @@ int compile_expr(Expression *expr, Chunk *chunk, Scope *scope, int dest, int tem
         }
 
         case TYPE_ADD:
-        {
-            int max1 = compile_expr(expr->lexpr, chunk, scope, dest, temp);
-
-            int t = get_temp_index(scope, temp);
-            int max2 = compile_expr(expr->rexpr, chunk, scope, t, temp + 1);
-
-            add_instruction(chunk, CREATE(OP_ADD, dest, dest, t));
-
-            return MAX(max1, max2);
-        }
+            return compile_binop(expr, OP_ADD, 0, chunk, scope, dest, temp);
 
         case TYPE_SUB:
-        {
-            int max1 = compile_expr(expr->lexpr, chunk, scope, dest, temp);
-
-            int t = get_temp_index(scope, temp);
-            int max2 = compile_expr(expr->rexpr, chunk, scope, t, temp + 1);
-
-            add_instruction(chunk, CREATE(OP_SUB, dest, dest, t));
-
-            return MAX(max1, max2);
-        }
+            return compile_binop(expr, OP_SUB, 0, chunk, scope, dest, temp);
 
         case TYPE_MUL:
-        {
-            int max1 = compile_expr(expr->lexpr, chunk, scope, dest, temp);
-
-            int t = get_temp_index(scope, temp);
-            int max2 = compile_expr(expr->rexpr, chunk, scope, t, temp + 1);
-
-            add_instruction(chunk, CREATE(OP_MUL, dest, dest, t));
-
-            return MAX(max1, max2);
-        }
+            return compile_binop(expr, OP_MUL, 0, chunk, scope, dest, temp);
 
         case TYPE_DIV:
-        {
-            int max1 = compile_expr(expr->lexpr, chunk, scope, dest, temp);
-
-            int t = get_temp_index(scope, temp);
-            int max2 = compile_expr(expr->rexpr, chunk, scope, t, temp + 1);
-
-            add_instruction(chunk, CREATE(OP_DIV, dest, dest, t));
-
-            return MAX(max1, max2);
-        }
+            return compile_binop(expr, OP_DIV, 0, chunk, scope, dest, temp);
 
         case TYPE_MOD:
-        {
-            int max1 = compile_expr(expr->lexpr, chunk, scope, dest, temp);
-
-            int t = get_temp_index(scope, temp);
-            int max2 = compile_expr(expr->rexpr, chunk, scope, t, temp + 1);
-
-            add_instruction(chunk, CREATE(OP_MOD, dest, dest, t));
-
-            return MAX(max1, max2);
-        }
+            return compile_binop(expr, OP_MOD, 0, chunk, scope, dest, temp);
 
         case TYPE_POW:
-        {
-            int max1 = compile_expr(expr->lexpr, chunk, scope, dest, temp);
-
-            int t = get_temp_index(scope, temp);
-            int max2 = compile_expr(expr->rexpr, chunk, scope, t, temp + 1);
-
-            add_instruction(chunk, CREATE(OP_POW, dest, dest, t));
-
-            return MAX(max1, max2);
-        }
-
-        /**
-         * optimization - boolean-resulting commands should have a second
-         * form that takes branch statements to jump to on true/false instead
-         * of actually generating that value (for control flow).
-         */
+            return compile_binop(expr, OP_POW, 0, chunk, scope, dest, temp);
 
         case TYPE_EQEQ:
-        {
-            int max1 = compile_expr(expr->lexpr, chunk, scope, dest, temp);
-
-            int t = get_temp_index(scope, temp);
-            int max2 = compile_expr(expr->rexpr, chunk, scope, t, temp + 1);
-
-            add_instruction(chunk, CREATE(OP_EQ, dest, dest, t));
-
-            return MAX(max1, max2);
-        }
+            return compile_binop(expr, OP_EQ, 0, chunk, scope, dest, temp);
 
         case TYPE_NEQ:
-        {
-            int max1 = compile_expr(expr->lexpr, chunk, scope, dest, temp);
-
-            int t = get_temp_index(scope, temp);
-            int max2 = compile_expr(expr->rexpr, chunk, scope, t, temp + 1);
-
-            add_instruction(chunk, CREATE(OP_EQ, dest, dest, t));
-            add_instruction(chunk, CREATE(OP_NOT, dest, dest, 0));
-
-            return MAX(max1, max2);
-        }
+            return compile_binop(expr, OP_NE, 0, chunk, scope, dest, temp);
 
         case TYPE_LT:
-        {
-            int max1 = compile_expr(expr->lexpr, chunk, scope, dest, temp);
-
-            int t = get_temp_index(scope, temp);
-            int max2 = compile_expr(expr->rexpr, chunk, scope, t, temp + 1);
-
-            add_instruction(chunk, CREATE(OP_LT, dest, dest, t));
-
-            return MAX(max1, max2);
-        }
+            return compile_binop(expr, OP_LT, 0, chunk, scope, dest, temp);
 
         case TYPE_LEQ:
-        {
-            int max1 = compile_expr(expr->lexpr, chunk, scope, dest, temp);
-
-            int t = get_temp_index(scope, temp);
-            int max2 = compile_expr(expr->rexpr, chunk, scope, t, temp + 1);
-
-            add_instruction(chunk, CREATE(OP_LE, dest, dest, t));
-
-            return MAX(max1, max2);
-        }
+            return compile_binop(expr, OP_LE, 0, chunk, scope, dest, temp);
 
         case TYPE_GT:
-        {
-            int max1 = compile_expr(expr->lexpr, chunk, scope, dest, temp);
-
-            int t = get_temp_index(scope, temp);
-            int max2 = compile_expr(expr->rexpr, chunk, scope, t, temp + 1);
-
-            add_instruction(chunk, CREATE(OP_LT, dest, t, dest));
-
-            return MAX(max1, max2);
-        }
+            return compile_binop(expr, OP_LT, 1, chunk, scope, dest, temp);
 
         case TYPE_GEQ:
-        {
-            int max1 = compile_expr(expr->lexpr, chunk, scope, dest, temp);
-
-            int t = get_temp_index(scope, temp);
-            int max2 = compile_expr(expr->rexpr, chunk, scope, t, temp + 1);
-
-            add_instruction(chunk, CREATE(OP_LE, dest, t, dest));
-
-            return MAX(max1, max2);
-        }
+            return compile_binop(expr, OP_LE, 1, chunk, scope, dest, temp);
 
         case TYPE_AND:
-        {
-            int tindex = add_bool(chunk, 1);
-            int findex = add_bool(chunk, 0);
-
-            //      lexpr
-            // [t1] if false [t3 - t1]
-            //      rexpr
-            // [t2] if false [t3 - t2]
-            //      load true
-            // [t3] load false
-
-            // lexpr
-            int max1 = compile_expr(expr->lexpr, chunk, scope, dest, temp);
-
-            // dummy jump
-            int t1 = add_instruction(chunk, 0);
-
-            // rexpr
-            int max2 = compile_expr(expr->rexpr, chunk, scope, dest, temp);
-
-            // dummy jump
-            int t2 = add_instruction(chunk, 0);
-
-            // load true
-            add_instruction(chunk, CREATE(OP_MOVE, dest, tindex + 256, 0));
-
-            // load false
-            int t3 = add_instruction(chunk, CREATE(OP_MOVE, dest, findex + 256, 0));
-
-            // fill in 1st jump
-            chunk->instructions[t1] = CREATE(OP_JUMP_FALSE, dest, t3 - t1 - 1, 0);
-
-            // fill in 2nd jump
-            chunk->instructions[t2] = CREATE(OP_JUMP_FALSE, dest, t3 - t2 - 1, 0);
-
-            return MAX(max1, max2);
-        }
-
         case TYPE_OR:
         {
-            int tindex = add_bool(chunk, 1);
-            int findex = add_bool(chunk, 0);
-
-            //      lexpr
-            // [t1] if true [t3 - t1]
-            //      rexpr
-            // [t2] if true [t3 - t2]
-            //      load false
-            // [t3] load true
-
-            // lexpr
-            int max1 = compile_expr(expr->lexpr, chunk, scope, dest, temp);
-
-            // dummy jump
-            int t1 = add_instruction(chunk, 0);
-
-            // rexpr
-            int max2 = compile_expr(expr->rexpr, chunk, scope, dest, temp);
-
-            // dummy jump
-            int t2 = add_instruction(chunk, 0);
-
-            // load false
-            add_instruction(chunk, CREATE(OP_MOVE, dest, findex + 256, 0));
+            //      cond, jumping to [t2] if false
+            //      load true
+            //      jump [1]
+            // [t2] load false
 
-            // load true
-            int t3 = add_instruction(chunk, CREATE(OP_MOVE, dest, tindex + 256, 0));
+            JumpList falses = { NULL, 0 };
+            int max = compile_condition(expr, 0, &falses, chunk, scope, dest, temp);
 
-            // fill in 1st jump
-            chunk->instructions[t1] = CREATE(OP_JUMP_FALSE, dest, t3 - t1 - 1, 0);
+            add_instruction(chunk, CREATE(OP_MOVE, dest, add_bool(chunk, 1) + 256, 0));
+            add_instruction(chunk, CREATE(OP_JUMP, 0, 1, 0));
 
-            // fill in 2nd jump
-            chunk->instructions[t2] = CREATE(OP_JUMP_FALSE, dest, t3 - t2 - 1, 0);
+            patch_jumps(chunk, &falses, chunk->numinstructions);
+            add_instruction(chunk, CREATE(OP_MOVE, dest, add_bool(chunk, 0) + 256, 0));
 
-            return MAX(max1, max2);
+            return max;
         }
 
         /* unary cases */
         case TYPE_NEG:
         {
             int max = compile_expr(expr->lexpr, chunk, scope, dest, temp);
-            add_instruction(chunk, CREATE(OP_NEG, dest, dest, 0));
+            add_instruction(chunk, CREATE(typed_opcode(OP_NEG, expr->lexpr->types, expr->lexpr->types), dest, dest, 0));
             return max;
         }
 
         case TYPE_NOT:
         {
             int max = compile_expr(expr->lexpr, chunk, scope, dest, temp);
-            add_instruction(chunk, CREATE(OP_NOT, dest, dest, 0));
+            add_instruction(chunk, CREATE(typed_opcode(OP_NOT, expr->lexpr->types, expr->lexpr->types), dest, dest, 0));
             return max;
         }
 
@@ -709,6 +1053,34 @@ int compile_expr(Expression *expr, Chunk *chunk, Scope *scope, int dest, int tem
             return temp;
         }
 
+        case TYPE_INTERP:
+        {
+            // pieces go into consecutive temporaries, and are joined by
+            // a single concat; empty literal pieces are dropped
+
+            int max = temp;
+            int f = get_temp_index(scope, temp);
+            int t = f;
+            int n = 0;
+
+            ExpressionNode *head;
+            for (head = expr->llist->head; head != NULL; head = head->next) {
+                if (head->expr->type == TYPE_STRING && strlen(head->expr->value.s) == 0) {
+                    continue;
+                }
+
+                int k = compile_expr(head->expr, chunk, scope, t, ++temp);
+                max = MAX(k, max);
+
+                t = get_temp_index(scope, temp);
+                n++;
+            }
+
+            add_instruction(chunk, CREATE(OP_CONCAT, dest, f, n));
+
+            return max;
+        }
+
         case TYPE_BLOCK:
         {
             // [t1]     enter try [t2 - t1 - 1]
@@ -765,7 +1137,10 @@ int compile_list(ExpressionList *list, Chunk *chunk, Scope *scope, int dest, int
 
     ExpressionNode *head;
     for (head = list->head; head != NULL; head = head->next) {
-        int n = compile_expr(head->expr, chunk, scope, dest, temp);
+        int n = head->next
+            ? compile_effect(head->expr, chunk, scope, dest, temp)
+            : compile_expr(head->expr, chunk, scope, dest, temp);
+
         if (n > max) {
             max = n;
         }
@@ -774,12 +1149,40 @@ int compile_list(ExpressionList *list, Chunk *chunk, Scope *scope, int dest, int
     return max;
 }
 
+int chunk_path(Chunk *chunk, Chunk *target, char *buffer, int length) {
+    if (chunk == target) {
+        return 1;
+    }
+
+    int n = strlen(buffer);
+
+    int i;
+    for (i = 0; i < chunk->numchildren; i++) {
+        snprintf(buffer + n, length - n, ".%d", i);
+
+        if (chunk_path(chunk->children[i], target, buffer, length)) {
+            return 1;
+        }
+    }
+
+    buffer[n] = '\0';
+    return 0;
+}
+
+void chunk_name(Chunk *root, Chunk *chunk, char *buffer, int length) {
+    snprintf(buffer, length, "main");
+
+    if (!chunk_path(root, chunk, buffer, length)) {
+        snprintf(buffer, length, "?");
+    }
+}
+
 Chunk *compile(Expression *expr) {
     Chunk *chunk = make_chunk();
     int max = compile_expr(expr, chunk, expr->scope, 0, 0);
 
     chunk->numtemps = max;
-    chunk->numlocals = expr->scope->numlocals;
+    chunk->numlocals = expr->scope->numslots;
     chunk->numupvars = expr->scope->numupvars;
     chunk->numparams = expr->scope->numparams;
     return chunk;
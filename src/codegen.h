@@ -24,13 +24,15 @@
 
 typedef struct Chunk Chunk;
 typedef struct Constant Constant;
+typedef struct HeapObject HeapObject;
 
 typedef enum {
     CONST_INT,
     CONST_REAL,
     CONST_BOOL,
     CONST_NULL,
-    CONST_STRING
+    CONST_STRING,
+    CONST_FUNC
 } ConstantType;
 
 struct Constant {
@@ -40,6 +42,11 @@ struct Constant {
         double d;
         char *s;
     } value;
+
+    // interned string object, or the shared closure of a function (whose
+    // value is the index of its chunk among the children); filled in by
+    // the vm on first use
+    HeapObject *object;
 };
 
 struct Chunk {
@@ -58,5 +65,7 @@ struct Chunk {
 };
 
 void free_chunk(Chunk *chunk);
+void chunk_name(Chunk *root, Chunk *chunk, char *buffer, int length);
 
 Chunk *compile(Expression *expr);
+Chunk *compile_function(Expression *expr);
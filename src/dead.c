@@ -0,0 +1,319 @@
+/*
+ * Copyright (c) 2014, Eric Fritz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+ * BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include <stdlib.h>
+
+#include "chinnu.h"
+#include "dead.h"
+
+/*
+ * Dead code elimination
+ *
+ * A walk over the resolved tree in evaluation order which tracks whether
+ * control can still reach the end of each expression. Evaluation never
+ * completes past a throw or a `while true` (the language has no break),
+ * and never enters the branch of an if or the body of a while that a
+ * literal condition rules out. Code that cannot be reached is reported
+ * with -wunreachable and, when pruning (-o), removed along with the
+ * statements of a block whose value is discarded and that are pure.
+ *
+ * Only whole statements and branches are removed; an operand following
+ * a throw inside a larger expression is left in place.
+ *
+ * The pass is run again after inlining without reporting, since a body
+ * that the arguments of one call make partly unreachable is not a
+ * problem in the source.
+ */
+
+typedef struct {
+    int prune;
+    int report;
+} Eliminator;
+
+void report_unreachable(Eliminator *elim, Expression *expr) {
+    if (elim->report && warning_flags[WARNING_UNREACHABLE]) {
+        warning(expr->pos, "Unreachable code.");
+    }
+}
+
+/*
+ * An expression is pure if evaluating it cannot throw, fail, or have any
+ * effect besides producing its value. Most operators can fail on a bad
+ * operand type at run time, so the list is short.
+ */
+int is_pure(Expression *expr) {
+    switch (expr->type) {
+        case TYPE_INT:
+        case TYPE_REAL:
+        case TYPE_BOOL:
+        case TYPE_NULL:
+        case TYPE_STRING:
+        case TYPE_VARREF:
+            return 1;
+
+        case TYPE_FUNC:
+            // named functions also bind a local
+            return expr->value.s == NULL;
+
+        case TYPE_INTERP:
+        {
+            ExpressionNode *head;
+            for (head = expr->llist->head; head != NULL; head = head->next) {
+                if (!is_pure(head->expr)) {
+                    return 0;
+                }
+            }
+
+            return 1;
+        }
+
+        default:
+            return 0;
+    }
+}
+
+/* forward */
+int eliminate_expr(Eliminator *elim, Expression *expr);
+
+void remove_node(ExpressionList *list, ExpressionNode *node) {
+    if (node->prev) {
+        node->prev->next = node->next;
+    } else {
+        list->head = node->next;
+    }
+
+    if (node->next) {
+        node->next->prev = node->prev;
+    } else {
+        list->tail = node->prev;
+    }
+
+    free_expr(node->expr);
+    free(node);
+}
+
+/*
+ * Returns zero if no element of the list completes. Elements following
+ * one that does not complete are unreachable.
+ */
+int eliminate_list(Eliminator *elim, ExpressionList *list) {
+    ExpressionNode *head;
+    for (head = list->head; head != NULL; head = head->next) {
+        if (!eliminate_expr(elim, head->expr)) {
+            if (head->next) {
+                report_unreachable(elim, head->next->expr);
+
+                if (elim->prune) {
+                    while (head->next) {
+                        remove_node(list, head->next);
+                    }
+                }
+            }
+
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * Like eliminate_list, but for operands: nothing is removed, as the
+ * expressions are not statements.
+ */
+int eliminate_operands(Eliminator *elim, ExpressionList *list) {
+    ExpressionNode *head;
+    for (head = list->head; head != NULL; head = head->next) {
+        if (!eliminate_expr(elim, head->expr)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * Drops pure statements whose value is discarded: everything but the
+ * last element of a block.
+ */
+void remove_unused(ExpressionList *list) {
+    ExpressionNode *head = list->head;
+
+    while (head != NULL && head->next != NULL) {
+        ExpressionNode *next = head->next;
+
+        if (is_pure(head->expr)) {
+            remove_node(list, head);
+        }
+
+        head = next;
+    }
+}
+
+/*
+ * Returns non-zero if evaluation of the expression can complete.
+ */
+int eliminate_expr(Eliminator *elim, Expression *expr) {
+    switch (expr->type) {
+        case TYPE_MODULE:
+            return eliminate_expr(elim, expr->lexpr);
+
+        case TYPE_BLOCK:
+        {
+            int done1 = eliminate_list(elim, expr->llist);
+
+            if (elim->prune) {
+                remove_unused(expr->llist);
+            }
+
+            if (!expr->rlist) {
+                return done1;
+            }
+
+            int done2 = eliminate_list(elim, expr->rlist);
+
+            if (elim->prune) {
+                remove_unused(expr->rlist);
+            }
+
+            // a protected block that does not complete ends in the handler
+            return done1 || done2;
+        }
+
+        case TYPE_FUNC:
+            eliminate_expr(elim, expr->rexpr);
+            return 1;
+
+        case TYPE_IF:
+        {
+            if (!eliminate_expr(elim, expr->cond)) {
+                return 0;
+            }
+
+            if (expr->cond->type == TYPE_BOOL) {
+                Expression *live = expr->cond->value.i == 1 ? expr->lexpr : expr->rexpr;
+                Expression *dead = expr->cond->value.i == 1 ? expr->rexpr : expr->lexpr;
+
+                if (dead) {
+                    report_unreachable(elim, dead);
+                }
+
+                int done = live ? eliminate_expr(elim, live) : 1;
+
+                if (elim->prune) {
+                    if (live) {
+                        become_child(expr, live);
+                    } else {
+                        become_literal(expr, TYPE_NULL);
+                    }
+                }
+
+                return done;
+            }
+
+            int done1 = eliminate_expr(elim, expr->lexpr);
+            int done2 = expr->rexpr ? eliminate_expr(elim, expr->rexpr) : 1;
+
+            return done1 || done2;
+        }
+
+        case TYPE_WHILE:
+            if (!eliminate_expr(elim, expr->cond)) {
+                return 0;
+            }
+
+            if (expr->cond->type == TYPE_BOOL && expr->cond->value.i == 0) {
+                report_unreachable(elim, expr->lexpr);
+
+                if (elim->prune) {
+                    become_literal(expr, TYPE_NULL);
+                }
+
+                return 1;
+            }
+
+            eliminate_expr(elim, expr->lexpr);
+            return !(expr->cond->type == TYPE_BOOL && expr->cond->value.i == 1);
+
+        case TYPE_THROW:
+            eliminate_expr(elim, expr->lexpr);
+            return 0;
+
+        case TYPE_DECLARATION:
+            return expr->rexpr ? eliminate_expr(elim, expr->rexpr) : 1;
+
+        case TYPE_ASSIGN:
+            return eliminate_expr(elim, expr->rexpr);
+
+        case TYPE_CALL:
+            return eliminate_expr(elim, expr->lexpr) && eliminate_operands(elim, expr->llist);
+
+        case TYPE_BUILTIN:
+        case TYPE_INTERP:
+            return eliminate_operands(elim, expr->llist);
+
+        case TYPE_ADD:
+        case TYPE_SUB:
+        case TYPE_MUL:
+        case TYPE_DIV:
+        case TYPE_MOD:
+        case TYPE_POW:
+        case TYPE_EQEQ:
+        case TYPE_NEQ:
+        case TYPE_LT:
+        case TYPE_LEQ:
+        case TYPE_GT:
+        case TYPE_GEQ:
+            return eliminate_expr(elim, expr->lexpr) && eliminate_expr(elim, expr->rexpr);
+
+        case TYPE_AND:
+        case TYPE_OR:
+            // the right operand may be skipped
+            if (!eliminate_expr(elim, expr->lexpr)) {
+                return 0;
+            }
+
+            eliminate_expr(elim, expr->rexpr);
+            return 1;
+
+        case TYPE_NEG:
+        case TYPE_NOT:
+            return eliminate_expr(elim, expr->lexpr);
+
+        /* constants */
+        case TYPE_VARREF:
+        case TYPE_INT:
+        case TYPE_REAL:
+        case TYPE_BOOL:
+        case TYPE_NULL:
+        case TYPE_STRING:
+            return 1;
+    }
+
+    return 1;
+}
+
+void eliminate_dead_code(Expression *expr, int prune, int report) {
+    Eliminator elim;
+    elim.prune = prune;
+    elim.report = report;
+
+    eliminate_expr(&elim, expr);
+}
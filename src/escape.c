@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2014, Eric Fritz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+ * BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+
+#include "chinnu.h"
+#include "escape.h"
+
+/*
+ * Escape analysis
+ *
+ * Decides how each closure holds the variables it captures, and whether
+ * it needs to live on the heap at all.
+ *
+ * A variable that is never assigned keeps the value it was declared with
+ * for as long as a closure can see it, so closures capture it by value:
+ * the value is copied into the closure when it is created, and no upval
+ * has to be kept open and closed when the frame returns. A named
+ * function is the exception for its own closure, which is created before
+ * the local holding it is written.
+ *
+ * A function literal bound by a declaration whose value is discarded
+ * does not escape if the local it is bound to is never assigned, and is
+ * only ever called, and only from the function that declares it. Such a
+ * closure cannot outlive the frame that created it, so the frame owns it
+ * instead of the heap. Its upvals refer to the frame's registers
+ * directly and are never closed. It is created once per frame, however
+ * often its declaration is evaluated. A function that creates closures
+ * of its own always escapes, as those could take its upvals with them.
+ */
+
+int captures_by_value(Expression *func, Symbol *symbol) {
+    return !symbol->assigned && symbol != func->symbol;
+}
+
+/* forward */
+void find_escapes(Expression *expr);
+
+void find_list_escapes(ExpressionList *list) {
+    if (list) {
+        ExpressionNode *head;
+        for (head = list->head; head != NULL; head = head->next) {
+            find_escapes(head->expr);
+        }
+    }
+}
+
+/*
+ * Marks each variable whose value is used by anything but a call from
+ * the function that declares it.
+ */
+void find_escapes(Expression *expr) {
+    if (!expr) {
+        return;
+    }
+
+    switch (expr->type) {
+        case TYPE_VARREF:
+            if (expr->symbol) {
+                expr->symbol->escapes = 1;
+            }
+            return;
+
+        case TYPE_CALL:
+            if (expr->lexpr->type != TYPE_VARREF) {
+                find_escapes(expr->lexpr);
+            }
+
+            find_list_escapes(expr->llist);
+            return;
+
+        case TYPE_FUNC:
+        {
+            int i;
+            for (i = 0; i < expr->scope->numupvars; i++) {
+                expr->scope->upvars[i]->escapes = 1;
+            }
+        } break;
+
+        default:
+            break;
+    }
+
+    find_escapes(expr->cond);
+    find_escapes(expr->lexpr);
+    find_escapes(expr->rexpr);
+    find_list_escapes(expr->llist);
+    find_list_escapes(expr->rlist);
+}
+
+int creates_closures(Expression *expr);
+
+int list_creates_closures(ExpressionList *list) {
+    if (list) {
+        ExpressionNode *head;
+        for (head = list->head; head != NULL; head = head->next) {
+            if (creates_closures(head->expr)) {
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+int creates_closures(Expression *expr) {
+    if (!expr) {
+        return 0;
+    }
+
+    return expr->type == TYPE_FUNC
+        || creates_closures(expr->cond)
+        || creates_closures(expr->lexpr)
+        || creates_closures(expr->rexpr)
+        || list_creates_closures(expr->llist)
+        || list_creates_closures(expr->rlist);
+}
+
+/*
+ * Returns the function literal a statement binds to a local, or NULL.
+ */
+Expression *bound_function(Expression *expr, Symbol **symbol) {
+    if (expr->type == TYPE_FUNC && expr->symbol) {
+        *symbol = expr->symbol;
+        return expr;
+    }
+
+    if (expr->type == TYPE_DECLARATION && expr->rexpr && expr->rexpr->type == TYPE_FUNC && !expr->rexpr->symbol) {
+        *symbol = expr->symbol;
+        return expr->rexpr;
+    }
+
+    return NULL;
+}
+
+/* forward */
+void find_local_closures(Expression *expr);
+
+void find_list_local_closures(ExpressionList *list, int effect) {
+    if (list) {
+        ExpressionNode *head;
+        for (head = list->head; head != NULL; head = head->next) {
+            Symbol *symbol;
+            Expression *func = bound_function(head->expr, &symbol);
+
+            // the last statement of a block produces its value
+            if (func && effect && head->next) {
+                func->scope->escapes = symbol->assigned || symbol->escapes || creates_closures(func->rexpr);
+            }
+
+            find_local_closures(head->expr);
+        }
+    }
+}
+
+void find_local_closures(Expression *expr) {
+    if (!expr) {
+        return;
+    }
+
+    find_local_closures(expr->cond);
+    find_local_closures(expr->lexpr);
+    find_local_closures(expr->rexpr);
+    find_list_local_closures(expr->llist, expr->type == TYPE_BLOCK);
+    find_list_local_closures(expr->rlist, expr->type == TYPE_BLOCK);
+}
+
+void analyze_escapes(Expression *expr) {
+    find_escapes(expr);
+    find_local_closures(expr);
+}
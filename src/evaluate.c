@@ -0,0 +1,277 @@
+/*
+ * Copyright (c) 2014, Eric Fritz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+ * BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "chinnu.h"
+#include "evaluate.h"
+#include "codegen.h"
+#include "vm.h"
+#include "escape.h"
+#include "regalloc.h"
+
+/*
+ * Compile-time evaluation
+ *
+ * A call to a pure function (see semant.c) whose arguments are all
+ * literals produces the same value every time it is made, so with -o it
+ * is made once, while compiling, and replaced by a literal of its result.
+ * The function is compiled on its own, along with the pure functions its
+ * upvars are bound to, and called in a VM of its own (see evaluate_call).
+ * A call that fails, runs out of budget or does not produce a constant
+ * is left to be made at run time, where it fails the same way. So is a
+ * call producing a string too long to be worth keeping as a literal.
+ *
+ * Calls are evaluated innermost first, so the result of one can be the
+ * argument of another. Run after folding, which turns constant argument
+ * expressions into literals, and before inlining, which would turn the
+ * calls into copies of the body.
+ */
+
+#define EVALUATION_BUDGET 100000
+#define EVALUATION_MEMORY (16 * 1024 * 1024)
+#define EVALUATION_STRING_LENGTH 256
+
+typedef struct Instance Instance;
+
+// a function compiled for evaluation, and its closure
+struct Instance {
+    Expression *func;
+    Chunk *chunk;
+    HeapObject *closure;
+    Instance *next;
+};
+
+/*
+ * Returns the closure of the function, compiling it and the functions
+ * bound to its upvars unless already in the list. A recursive function
+ * is its own upvar.
+ */
+HeapObject *instantiate(Expression *func, Instance **list) {
+    Instance *instance;
+    for (instance = *list; instance != NULL; instance = instance->next) {
+        if (instance->func == func) {
+            return instance->closure;
+        }
+    }
+
+    instance = malloc(sizeof *instance);
+
+    if (!instance) {
+        fatal("Out of memory.");
+    }
+
+    // registers and escapes are decided again for the whole program later
+    analyze_escapes(func);
+    allocate_registers(func, 1);
+
+    instance->func = func;
+    instance->chunk = compile_function(func);
+    instance->closure = make_static_closure(instance->chunk);
+    instance->next = *list;
+    *list = instance;
+
+    int i;
+    for (i = 0; i < func->scope->numupvars; i++) {
+        Expression *upvar = symbol_function(func->scope->upvars[i]);
+        set_static_upval(instance->closure, i, instantiate(upvar, list));
+    }
+
+    return instance->closure;
+}
+
+void free_instances(Instance *instance) {
+    while (instance) {
+        Instance *temp = instance->next;
+
+        release_constants(instance->chunk);
+        free_static_closure(instance->closure);
+        free_chunk(instance->chunk);
+        free(instance);
+
+        instance = temp;
+    }
+}
+
+Constant *literal_to_constant(Expression *expr) {
+    Constant *c = malloc(sizeof *c);
+
+    if (!c) {
+        fatal("Out of memory.");
+    }
+
+    c->object = NULL;
+
+    switch (expr->type) {
+        case TYPE_INT:    c->type = CONST_INT;    c->value.i = expr->value.i; break;
+        case TYPE_REAL:   c->type = CONST_REAL;   c->value.d = expr->value.d; break;
+        case TYPE_BOOL:   c->type = CONST_BOOL;   c->value.i = expr->value.i; break;
+        case TYPE_NULL:   c->type = CONST_NULL;                               break;
+        case TYPE_STRING: c->type = CONST_STRING; c->value.s = expr->value.s; break;
+
+        default:
+            free(c);
+            return NULL;
+    }
+
+    return c;
+}
+
+/*
+ * Replaces the call with a literal of its result. Returns non-zero if
+ * it was evaluated.
+ */
+int evaluate(Expression *expr) {
+    Expression *func = called_function(expr);
+
+    if (!func || !func->scope->pure) {
+        return 0;
+    }
+
+    int numargs = 0;
+
+    ExpressionNode *head;
+    for (head = expr->llist->head; head != NULL; head = head->next) {
+        numargs++;
+    }
+
+    // arity was checked by semant, but inlining binds new variables
+    if (numargs != func->scope->numparams) {
+        return 0;
+    }
+
+    Constant **args = malloc(numargs * sizeof *args);
+
+    if (numargs > 0 && !args) {
+        fatal("Out of memory.");
+    }
+
+    int i = 0;
+    for (head = expr->llist->head; head != NULL; head = head->next) {
+        args[i] = literal_to_constant(head->expr);
+
+        if (!args[i]) {
+            break;
+        }
+
+        i++;
+    }
+
+    Constant *result = NULL;
+
+    if (i == numargs) {
+        Instance *list = NULL;
+        result = evaluate_call(instantiate(func, &list), args, EVALUATION_BUDGET, EVALUATION_MEMORY);
+        free_instances(list);
+    }
+
+    // string arguments still belong to their literals
+    while (i > 0) {
+        free(args[--i]);
+    }
+
+    free(args);
+
+    if (!result) {
+        return 0;
+    }
+
+    switch (result->type) {
+        case CONST_INT:
+            become_literal(expr, TYPE_INT);
+            expr->value.i = result->value.i;
+            break;
+
+        case CONST_REAL:
+            become_literal(expr, TYPE_REAL);
+            expr->value.d = result->value.d;
+            break;
+
+        case CONST_BOOL:
+            become_literal(expr, TYPE_BOOL);
+            expr->value.i = result->value.i;
+            break;
+
+        case CONST_NULL:
+            become_literal(expr, TYPE_NULL);
+            break;
+
+        case CONST_STRING:
+            if (strlen(result->value.s) > EVALUATION_STRING_LENGTH) {
+                free(result->value.s);
+                free(result);
+                return 0;
+            }
+
+            become_literal(expr, TYPE_STRING);
+            expr->value.s = result->value.s;
+            break;
+
+        case CONST_FUNC:
+            // never produced; a closure is not a constant result
+            free(result);
+            return 0;
+    }
+
+    free(result);
+    return 1;
+}
+
+/* forward */
+int evaluate_expr(Expression *expr);
+
+int evaluate_list(ExpressionList *list) {
+    int count = 0;
+
+    if (list) {
+        ExpressionNode *head;
+        for (head = list->head; head != NULL; head = head->next) {
+            count += evaluate_expr(head->expr);
+        }
+    }
+
+    return count;
+}
+
+int evaluate_expr(Expression *expr) {
+    if (!expr) {
+        return 0;
+    }
+
+    int count = evaluate_expr(expr->cond)
+        + evaluate_expr(expr->lexpr)
+        + evaluate_expr(expr->rexpr)
+        + evaluate_list(expr->llist)
+        + evaluate_list(expr->rlist);
+
+    if (expr->type == TYPE_CALL) {
+        count += evaluate(expr);
+    }
+
+    return count;
+}
+
+/*
+ * Returns the number of calls evaluated.
+ */
+int evaluate_pure_calls(Expression *expr) {
+    find_pure_functions(expr);
+    return evaluate_expr(expr);
+}
@@ -0,0 +1,517 @@
+/*
+ * Copyright (c) 2014, Eric Fritz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+ * BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+
+#include "chinnu.h"
+#include "fold.h"
+#include "str.h"
+
+/*
+ * Constant folding
+ *
+ * Run over the resolved tree with -o, before code generation. Operators
+ * whose operands are literals are replaced by the literal the vm would
+ * have produced, references to a val bound to a literal are replaced by
+ * a copy of that literal. Branches made dead by a folded condition are
+ * removed afterwards by the dead code pass.
+ *
+ * Anything the vm would reject at run time (division by zero, comparing
+ * two booleans) is left alone so that the
+ * error still happens when, and only if, the expression is evaluated.
+ * The same goes for the cases where the vm's result is not a pure
+ * function of the operands: overflowing int division, real modulus and
+ * real negation.
+ */
+
+#define IS_LITERAL(e) ((e)->type == TYPE_INT || (e)->type == TYPE_REAL || (e)->type == TYPE_BOOL \
+    || (e)->type == TYPE_NULL || (e)->type == TYPE_STRING)
+
+#define IS_NUMERIC(e) ((e)->type == TYPE_INT || (e)->type == TYPE_REAL)
+
+#define AS_DOUBLE(e) ((e)->type == TYPE_INT ? (double) (e)->value.i : (e)->value.d)
+
+/* forward */
+void fold_expr(Expression *expr);
+
+void fold_list(ExpressionList *list) {
+    if (list) {
+        ExpressionNode *head;
+        for (head = list->head; head != NULL; head = head->next) {
+            fold_expr(head->expr);
+        }
+    }
+}
+
+void copy_literal(Expression *expr, Expression *literal) {
+    become_literal(expr, literal->type);
+
+    if (literal->type == TYPE_STRING) {
+        expr->value.s = strdup(literal->value.s);
+
+        if (!expr->value.s) {
+            fatal("Out of memory.");
+        }
+    } else {
+        expr->value = literal->value;
+    }
+}
+
+/*
+ * Formats a literal the way the vm does when it is concatenated to a
+ * string. The result is malloc'd.
+ */
+char *literal_to_str(Expression *expr) {
+    char buffer[NUMBER_LENGTH];
+    const char *s = buffer;
+
+    switch (expr->type) {
+        case TYPE_INT:    format_int(buffer, expr->value.i);  break;
+        case TYPE_REAL:   format_real(buffer, expr->value.d); break;
+        case TYPE_BOOL:   s = expr->value.i == 1 ? "true" : "false"; break;
+        case TYPE_NULL:   s = "<null>"; break;
+        case TYPE_STRING: s = expr->value.s; break;
+
+        default:
+            fatal("Expected literal, not %s.", expression_type_names[expr->type]);
+    }
+
+    char *copy = strdup(s);
+
+    if (!copy) {
+        fatal("Out of memory.");
+    }
+
+    return copy;
+}
+
+char *join_literals(Expression *left, Expression *right) {
+    char *s1 = literal_to_str(left);
+    char *s2 = literal_to_str(right);
+
+    int l1 = strlen(s1);
+    int l2 = strlen(s2);
+
+    char *s = malloc(l1 + l2 + 1);
+
+    if (!s) {
+        fatal("Out of memory.");
+    }
+
+    memcpy(s, s1, l1);
+    memcpy(s + l1, s2, l2 + 1);
+
+    free(s1);
+    free(s2);
+    return s;
+}
+
+// same ordering as compare_string_args
+int compare_literal_strings(const char *s1, const char *s2) {
+    int l1 = strlen(s1);
+    int l2 = strlen(s2);
+
+    int cmp = memcmp(s1, s2, l1 < l2 ? l1 : l2);
+    return cmp != 0 ? cmp : l1 - l2;
+}
+
+/*
+ * Folds an arithmetic operator over two numeric literals. Int operands
+ * stay int (wrapping on overflow, as the vm's registers do), anything
+ * else is computed in double.
+ */
+void fold_arithmetic(Expression *expr) {
+    Expression *l = expr->lexpr;
+    Expression *r = expr->rexpr;
+
+    if (l->type == TYPE_INT && r->type == TYPE_INT) {
+        unsigned int a = l->value.i;
+        unsigned int b = r->value.i;
+        int result;
+
+        switch (expr->type) {
+            case TYPE_ADD: result = (int) (a + b); break;
+            case TYPE_SUB: result = (int) (a - b); break;
+            case TYPE_MUL: result = (int) (a * b); break;
+
+            case TYPE_DIV:
+            case TYPE_MOD:
+                if (r->value.i == 0 || (l->value.i == INT_MIN && r->value.i == -1)) {
+                    return;
+                }
+
+                result = expr->type == TYPE_DIV ? l->value.i / r->value.i : l->value.i % r->value.i;
+                break;
+
+            case TYPE_POW:
+            {
+                double d = pow(l->value.i, r->value.i);
+
+                if (!(d >= INT_MIN && d <= INT_MAX)) {
+                    return;
+                }
+
+                result = (int) d;
+            } break;
+
+            default:
+                return;
+        }
+
+        become_literal(expr, TYPE_INT);
+        expr->value.i = result;
+        return;
+    }
+
+    double a = AS_DOUBLE(l);
+    double b = AS_DOUBLE(r);
+    double result;
+
+    switch (expr->type) {
+        case TYPE_ADD: result = a + b; break;
+        case TYPE_SUB: result = a - b; break;
+        case TYPE_MUL: result = a * b; break;
+        case TYPE_POW: result = pow(a, b); break;
+
+        case TYPE_DIV:
+            if (b == 0) {
+                return;
+            }
+
+            result = a / b;
+            break;
+
+        default:
+            return;
+    }
+
+    become_literal(expr, TYPE_REAL);
+    expr->value.d = result;
+}
+
+/*
+ * Folds a comparison, returning early whenever the vm would not produce
+ * a boolean for these operands. Greater-than compiles to less-than with
+ * the operands swapped, so it is folded that way as well.
+ */
+void fold_comparison(Expression *expr) {
+    Expression *l = expr->lexpr;
+    Expression *r = expr->rexpr;
+
+    if (expr->type == TYPE_GT || expr->type == TYPE_GEQ) {
+        l = expr->rexpr;
+        r = expr->lexpr;
+    }
+
+    int result;
+
+    switch (expr->type) {
+        case TYPE_EQEQ:
+        case TYPE_NEQ:
+            if (IS_NUMERIC(l) && IS_NUMERIC(r)) {
+                result = AS_DOUBLE(l) == AS_DOUBLE(r);
+            } else if (l->type == TYPE_STRING && r->type == TYPE_STRING) {
+                result = strcmp(l->value.s, r->value.s) == 0;
+            } else if (l->type == TYPE_STRING || r->type == TYPE_STRING) {
+                result = 0;
+            } else {
+                return;
+            }
+
+            if (expr->type == TYPE_NEQ) {
+                result = !result;
+            }
+            break;
+
+        case TYPE_LT:
+        case TYPE_LEQ:
+        case TYPE_GT:
+        case TYPE_GEQ:
+        {
+            int strict = expr->type == TYPE_LT || expr->type == TYPE_GT;
+
+            if (l->type == TYPE_STRING && r->type == TYPE_STRING) {
+                int cmp = compare_literal_strings(l->value.s, r->value.s);
+                result = strict ? cmp < 0 : cmp <= 0;
+            } else if (IS_NUMERIC(l) && IS_NUMERIC(r)) {
+                result = strict ? AS_DOUBLE(l) < AS_DOUBLE(r) : AS_DOUBLE(l) <= AS_DOUBLE(r);
+            } else {
+                return;
+            }
+        } break;
+
+        default:
+            return;
+    }
+
+    become_literal(expr, TYPE_BOOL);
+    expr->value.i = result;
+}
+
+/*
+ * Merges runs of adjacent literal pieces of an interpolated string. If
+ * only one literal is left the whole expression becomes that string.
+ */
+void fold_interp(Expression *expr) {
+    ExpressionNode *head = expr->llist->head;
+
+    while (head != NULL) {
+        ExpressionNode *next = head->next;
+
+        if (next && IS_LITERAL(head->expr) && IS_LITERAL(next->expr)) {
+            char *s = join_literals(head->expr, next->expr);
+
+            become_literal(head->expr, TYPE_STRING);
+            head->expr->value.s = s;
+
+            head->next = next->next;
+
+            if (next->next) {
+                next->next->prev = head;
+            } else {
+                expr->llist->tail = head;
+            }
+
+            free_expr(next->expr);
+            free(next);
+            continue;
+        }
+
+        head = next;
+    }
+
+    head = expr->llist->head;
+
+    if (head && !head->next && IS_LITERAL(head->expr)) {
+        char *s = literal_to_str(head->expr);
+
+        become_literal(expr, TYPE_STRING);
+        expr->value.s = s;
+    }
+}
+
+/*
+ * A val whose initializer folded to a literal can be replaced by that
+ * literal everywhere. Every use follows the declaration in the tree, so
+ * the initializer has always been folded by the time a use is reached.
+ */
+Expression *constant_val(Symbol *symbol) {
+    if (!symbol) {
+        return NULL;
+    }
+
+    Expression *decl = symbol->declaration;
+
+    if (decl->type != TYPE_DECLARATION || !decl->immutable || !decl->rexpr || !IS_LITERAL(decl->rexpr)) {
+        return NULL;
+    }
+
+    return decl->rexpr;
+}
+
+/*
+ * Drops captured vals that have been propagated into a function; the
+ * closure no longer needs to carry an upval for them.
+ */
+void remove_constant_upvars(Scope *scope) {
+    int i, j = 0;
+    for (i = 0; i < scope->numupvars; i++) {
+        if (!constant_val(scope->upvars[i])) {
+            scope->upvars[j++] = scope->upvars[i];
+        }
+    }
+
+    scope->numupvars = j;
+}
+
+void fold_expr(Expression *expr) {
+    switch (expr->type) {
+        case TYPE_MODULE:
+            fold_expr(expr->lexpr);
+            break;
+
+        case TYPE_BLOCK:
+            fold_list(expr->llist);
+            fold_list(expr->rlist);
+            break;
+
+        case TYPE_DECLARATION:
+            if (expr->rexpr) {
+                fold_expr(expr->rexpr);
+            }
+            break;
+
+        case TYPE_FUNC:
+            fold_list(expr->llist);
+            fold_expr(expr->rexpr);
+            remove_constant_upvars(expr->scope);
+            break;
+
+        case TYPE_VARREF:
+        {
+            Expression *literal = constant_val(expr->symbol);
+
+            if (literal) {
+                copy_literal(expr, literal);
+            }
+        } break;
+
+        case TYPE_IF:
+            fold_expr(expr->cond);
+            fold_expr(expr->lexpr);
+
+            if (expr->rexpr) {
+                fold_expr(expr->rexpr);
+            }
+            break;
+
+        case TYPE_WHILE:
+            fold_expr(expr->cond);
+            fold_expr(expr->lexpr);
+            break;
+
+        case TYPE_CALL:
+            fold_expr(expr->lexpr);
+            fold_list(expr->llist);
+            break;
+
+        case TYPE_BUILTIN:
+            fold_list(expr->llist);
+            break;
+
+        case TYPE_ASSIGN:
+            // the target is a var, never a val
+            fold_expr(expr->rexpr);
+            break;
+
+        case TYPE_ADD:
+            fold_expr(expr->lexpr);
+            fold_expr(expr->rexpr);
+
+            if (IS_LITERAL(expr->lexpr) && IS_LITERAL(expr->rexpr)
+                    && (expr->lexpr->type == TYPE_STRING || expr->rexpr->type == TYPE_STRING)) {
+                char *s = join_literals(expr->lexpr, expr->rexpr);
+
+                become_literal(expr, TYPE_STRING);
+                expr->value.s = s;
+                break;
+            }
+
+            if (IS_NUMERIC(expr->lexpr) && IS_NUMERIC(expr->rexpr)) {
+                fold_arithmetic(expr);
+            }
+            break;
+
+        case TYPE_SUB:
+        case TYPE_MUL:
+        case TYPE_DIV:
+        case TYPE_MOD:
+        case TYPE_POW:
+            fold_expr(expr->lexpr);
+            fold_expr(expr->rexpr);
+
+            if (IS_NUMERIC(expr->lexpr) && IS_NUMERIC(expr->rexpr)) {
+                fold_arithmetic(expr);
+            }
+            break;
+
+        case TYPE_EQEQ:
+        case TYPE_NEQ:
+        case TYPE_LT:
+        case TYPE_LEQ:
+        case TYPE_GT:
+        case TYPE_GEQ:
+            fold_expr(expr->lexpr);
+            fold_expr(expr->rexpr);
+
+            if (IS_LITERAL(expr->lexpr) && IS_LITERAL(expr->rexpr)) {
+                fold_comparison(expr);
+            }
+            break;
+
+        case TYPE_AND:
+        case TYPE_OR:
+            fold_expr(expr->lexpr);
+            fold_expr(expr->rexpr);
+
+            // false and x, true or x: the right operand is never evaluated
+            if (expr->lexpr->type == TYPE_BOOL) {
+                int value = expr->lexpr->value.i;
+
+                if (value == (expr->type == TYPE_OR)) {
+                    become_literal(expr, TYPE_BOOL);
+                    expr->value.i = value;
+                } else if (expr->rexpr->type == TYPE_BOOL) {
+                    value = expr->rexpr->value.i;
+
+                    become_literal(expr, TYPE_BOOL);
+                    expr->value.i = value;
+                }
+            }
+            break;
+
+        case TYPE_INTERP:
+            fold_list(expr->llist);
+            fold_interp(expr);
+            break;
+
+        case TYPE_NEG:
+            fold_expr(expr->lexpr);
+
+            if (expr->lexpr->type == TYPE_INT) {
+                int i = (int) -(unsigned int) expr->lexpr->value.i;
+
+                become_literal(expr, TYPE_INT);
+                expr->value.i = i;
+            }
+            break;
+
+        case TYPE_NOT:
+            fold_expr(expr->lexpr);
+
+            if (expr->lexpr->type == TYPE_BOOL) {
+                int i = expr->lexpr->value.i == 1 ? 0 : 1;
+
+                become_literal(expr, TYPE_BOOL);
+                expr->value.i = i;
+            }
+            break;
+
+        case TYPE_THROW:
+            fold_expr(expr->lexpr);
+            break;
+
+        /* constants */
+        case TYPE_INT:
+        case TYPE_REAL:
+        case TYPE_BOOL:
+        case TYPE_NULL:
+        case TYPE_STRING:
+            /* ignore */
+            break;
+    }
+}
+
+void fold(Expression *expr) {
+    fold_expr(expr);
+}
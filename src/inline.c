@@ -0,0 +1,338 @@
+/*
+ * Copyright (c) 2014, Eric Fritz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+ * BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "chinnu.h"
+#include "inline.h"
+
+/*
+ * Function inlining
+ *
+ * Replaces a call whose target is known at compile time with a copy of
+ * the callee's body. The target must be a local bound to a function
+ * literal (a named function, or a val or var initialized with one) that
+ * is never assigned, so that every call through it reaches the same
+ * closure. The call
+ *
+ *     f(x + 1, y)
+ *
+ * becomes a block which binds each argument to a fresh local standing in
+ * for its parameter, followed by the copied body:
+ *
+ *     { val a = x + 1; val b = y; <body of f> }
+ *
+ * The block is evaluated in the caller's frame. Locals declared by the
+ * body are copied into the caller. The free variables of the body are
+ * referred to directly: those that are not locals of the caller become
+ * its upvars (and those of each function between it and the declaring
+ * one), as if the body had been written at the call site, which sees the
+ * same variables as the callee. A throw in the body unwinds from the
+ * caller's frame, which is where the handler that would have caught it
+ * from the callee's frame is anyway.
+ *
+ * Only small bodies that declare no functions are inlined, never into
+ * the callee itself, and only when the number of arguments matches the
+ * number of parameters. A callee is always visited before its uses, so
+ * the calls inlined into its body are inlined along with it.
+ */
+
+#define INLINE_SIZE 32
+#define RENAME_CHUNK_SIZE 8
+
+typedef struct {
+    Symbol **from;
+    Symbol **to;
+    int length;
+} Renaming;
+
+void add_renaming(Renaming *names, Symbol *from, Symbol *to) {
+    if (names->length % RENAME_CHUNK_SIZE == 0) {
+        Symbol **resize1 = realloc(names->from, (names->length + RENAME_CHUNK_SIZE) * sizeof *resize1);
+        Symbol **resize2 = realloc(names->to, (names->length + RENAME_CHUNK_SIZE) * sizeof *resize2);
+
+        if (!resize1 || !resize2) {
+            fatal("Out of memory.");
+        }
+
+        names->from = resize1;
+        names->to = resize2;
+    }
+
+    names->from[names->length] = from;
+    names->to[names->length] = to;
+    names->length++;
+}
+
+/*
+ * Returns the variable a reference in the copied body refers to from
+ * the caller, making it an upvar of the caller if it is declared further
+ * out.
+ */
+Symbol *rename_symbol(Renaming *names, Scope *scope, Symbol *symbol) {
+    int i;
+    for (i = 0; i < names->length; i++) {
+        if (names->from[i] == symbol) {
+            return names->to[i];
+        }
+    }
+
+    if (local_index(scope, symbol) == -1) {
+        register_upvar(scope, symbol);
+    }
+
+    return symbol;
+}
+
+int scope_level(Scope *scope) {
+    int level = 0;
+
+    for (scope = scope->parent; scope != NULL; scope = scope->parent) {
+        level++;
+    }
+
+    return level;
+}
+
+Symbol *copy_local(Renaming *names, Scope *scope, Symbol *symbol, Expression *declaration) {
+    Symbol *copy = make_symbol(symbol->name, scope_level(scope), declaration);
+    copy->assigned = symbol->assigned;
+
+    add_local(scope, copy);
+    add_renaming(names, symbol, copy);
+
+    return copy;
+}
+
+/* forward */
+Expression *copy_body(Renaming *names, Scope *scope, Expression *expr);
+
+ExpressionList *copy_body_list(Renaming *names, Scope *scope, ExpressionList *list) {
+    if (!list) {
+        return NULL;
+    }
+
+    ExpressionList *copy = make_list();
+
+    ExpressionNode *head;
+    for (head = list->head; head != NULL; head = head->next) {
+        expression_list_append(copy, copy_body(names, scope, head->expr));
+    }
+
+    return copy;
+}
+
+/*
+ * Copies an expression of the callee's body into the caller, whose scope
+ * is given. The initializer of a declaration is copied before the local
+ * it declares, as it cannot refer to it.
+ */
+Expression *copy_body(Renaming *names, Scope *scope, Expression *expr) {
+    if (!expr) {
+        return NULL;
+    }
+
+    Expression *copy = malloc(sizeof *copy);
+
+    if (!copy) {
+        fatal("Out of memory.");
+    }
+
+    *copy = *expr;
+    copy->cond = copy_body(names, scope, expr->cond);
+    copy->lexpr = copy_body(names, scope, expr->lexpr);
+    copy->rexpr = copy_body(names, scope, expr->rexpr);
+    copy->llist = copy_body_list(names, scope, expr->llist);
+    copy->rlist = copy_body_list(names, scope, expr->rlist);
+
+    switch (expr->type) {
+        case TYPE_DECLARATION:
+            copy->value.s = strdup(expr->value.s);
+            copy->symbol = copy_local(names, scope, expr->symbol, copy);
+            break;
+
+        case TYPE_VARREF:
+            copy->value.s = strdup(expr->value.s);
+
+            // the target of a builtin call has no symbol
+            if (expr->symbol) {
+                copy->symbol = rename_symbol(names, scope, expr->symbol);
+            }
+            break;
+
+        case TYPE_STRING:
+            copy->value.s = strdup(expr->value.s);
+            break;
+
+        default:
+            break;
+    }
+
+    return copy;
+}
+
+/*
+ * Returns the number of expressions in the tree, or stops counting once
+ * the limit is passed. Returns a value over the limit if the tree
+ * declares a function, which is never inlined.
+ */
+int body_size(Expression *expr, int limit);
+
+int body_list_size(ExpressionList *list, int limit) {
+    int size = 0;
+
+    if (list) {
+        ExpressionNode *head;
+        for (head = list->head; head != NULL && size <= limit; head = head->next) {
+            size += body_size(head->expr, limit - size);
+        }
+    }
+
+    return size;
+}
+
+int body_size(Expression *expr, int limit) {
+    if (!expr) {
+        return 0;
+    }
+
+    if (expr->type == TYPE_FUNC) {
+        return limit + 1;
+    }
+
+    int size = 1;
+
+    if (size <= limit) size += body_size(expr->cond, limit - size);
+    if (size <= limit) size += body_size(expr->lexpr, limit - size);
+    if (size <= limit) size += body_size(expr->rexpr, limit - size);
+    if (size <= limit) size += body_list_size(expr->llist, limit - size);
+    if (size <= limit) size += body_list_size(expr->rlist, limit - size);
+
+    return size;
+}
+
+int can_inline(Expression *expr, Expression *func, Scope *scope) {
+    int numargs = 0;
+
+    ExpressionNode *head;
+    for (head = expr->llist->head; head != NULL; head = head->next) {
+        numargs++;
+    }
+
+    if (numargs != func->scope->numparams) {
+        return 0;
+    }
+
+    // the call is inside the body being copied
+    for (; scope != NULL; scope = scope->parent) {
+        if (scope == func->scope) {
+            return 0;
+        }
+    }
+
+    return body_size(func->rexpr, INLINE_SIZE) <= INLINE_SIZE;
+}
+
+/*
+ * Turns the call into a block binding the arguments to the parameters,
+ * followed by the body.
+ */
+void inline_call(Expression *expr, Expression *func, Scope *scope) {
+    Renaming names = { NULL, NULL, 0 };
+
+    ExpressionList *block = make_list();
+    ExpressionNode *param = func->llist->head;
+    ExpressionNode *head = expr->llist->head;
+
+    while (head != NULL) {
+        Symbol *symbol = param->expr->symbol;
+        Expression *decl = make_declaration(expr->pos, strdup(symbol->name), head->expr, !symbol->assigned);
+        decl->symbol = copy_local(&names, scope, symbol, decl);
+
+        expression_list_append(block, decl);
+
+        ExpressionNode *temp = head->next;
+        free(head);
+        head = temp;
+
+        param = param->next;
+    }
+
+    expression_list_append(block, copy_body(&names, scope, func->rexpr));
+
+    free(expr->llist);
+    free_expr(expr->lexpr);
+    free(names.from);
+    free(names.to);
+
+    expr->type = TYPE_BLOCK;
+    expr->lexpr = NULL;
+    expr->llist = block;
+}
+
+/* forward */
+int inline_expr(Expression *expr, Scope *scope);
+
+int inline_list(ExpressionList *list, Scope *scope) {
+    int count = 0;
+
+    if (list) {
+        ExpressionNode *head;
+        for (head = list->head; head != NULL; head = head->next) {
+            count += inline_expr(head->expr, scope);
+        }
+    }
+
+    return count;
+}
+
+int inline_expr(Expression *expr, Scope *scope) {
+    if (!expr) {
+        return 0;
+    }
+
+    if (expr->type == TYPE_FUNC || expr->type == TYPE_MODULE) {
+        scope = expr->scope;
+    }
+
+    int count = inline_expr(expr->cond, scope)
+        + inline_expr(expr->lexpr, scope)
+        + inline_expr(expr->rexpr, scope)
+        + inline_list(expr->llist, scope)
+        + inline_list(expr->rlist, scope);
+
+    if (expr->type == TYPE_CALL) {
+        Expression *func = called_function(expr);
+
+        if (func && can_inline(expr, func, scope)) {
+            inline_call(expr, func, scope);
+            count++;
+        }
+    }
+
+    return count;
+}
+
+/*
+ * Returns the number of calls inlined.
+ */
+int inline_calls(Expression *expr) {
+    return inline_expr(expr, NULL);
+}
@@ -0,0 +1,755 @@
+/*
+ * Copyright (c) 2014, Eric Fritz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+ * BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "chinnu.h"
+#include "optimize.h"
+#include "ssa.h"
+#include "bytecode.h"
+#include "builtin.h"
+
+/*
+ * Bytecode optimizer
+ *
+ * Run over each chunk with -o, after the passes over its SSA form (see
+ * ssa.c). Instructions are decoded into a list with absolute jump
+ * targets; each pass rewrites or deletes entries, and the list is
+ * compacted (retargeting jumps into deleted instructions at the
+ * instruction that followed them) after every pass. The passes repeat
+ * until none of them changes anything, then the offsets are recomputed
+ * and the chunk re-encoded.
+ *
+ * Register liveness is computed per instruction. Registers captured by a
+ * closure are read and written behind the chunk's back, so they are
+ * treated as live everywhere and never forwarded across a call.
+ */
+
+#define NUM_REGISTERS 256
+#define SET_WORDS (NUM_REGISTERS / 32)
+
+typedef struct {
+    unsigned int bits[SET_WORDS];
+} RegisterSet;
+
+#define SET_HAS(set, r) (((set)->bits[(r) / 32] >> ((r) % 32)) & 1)
+#define SET_ADD(set, r) ((set)->bits[(r) / 32] |= 1u << ((r) % 32))
+#define SET_DEL(set, r) ((set)->bits[(r) / 32] &= ~(1u << ((r) % 32)))
+
+typedef struct {
+    OpCode op;
+    int a;
+    int b;
+    int c;
+
+    int target;         // absolute target of a jump or handler, or -1
+    int upvar;          // an upvar descriptor following a CLOSURE
+    int deleted;
+} Instruction;
+
+typedef struct {
+    Chunk *chunk;
+    Instruction *code;
+    int length;
+    int numregs;
+
+    int *targeted;      // number of jumps (or handlers) landing on each
+    RegisterSet *live;  // live out of each instruction
+    RegisterSet captured;
+    int hastry;
+} Optimizer;
+
+int is_jump(OpCode op) {
+    op = generic_opcode(op);
+    return op == OP_JUMP || op == OP_JUMP_TRUE || op == OP_JUMP_FALSE;
+}
+
+// a test skips the jump after it, so is treated as a branch to the
+// instruction after that; the two are never separated
+int is_test(OpCode op) {
+    op = generic_opcode(op);
+    return op == OP_TEST_EQ || op == OP_TEST_LT || op == OP_TEST_LE;
+}
+
+void decode_chunk(Optimizer *opt, Chunk *chunk) {
+    opt->chunk = chunk;
+    opt->length = chunk->numinstructions;
+    opt->numregs = chunk->numlocals + chunk->numtemps + 1;
+    opt->code = malloc((opt->length + 1) * sizeof *opt->code);
+    opt->targeted = malloc((opt->length + 1) * sizeof *opt->targeted);
+    opt->live = malloc((opt->length + 1) * sizeof *opt->live);
+
+    if (!opt->code || !opt->targeted || !opt->live) {
+        fatal("Out of memory.");
+    }
+
+    memset(&opt->captured, 0, sizeof opt->captured);
+    opt->hastry = 0;
+
+    int i;
+    for (i = 0; i < opt->length; i++) {
+        int instruction = chunk->instructions[i];
+        Instruction *inst = &opt->code[i];
+
+        inst->op = GET_O(instruction);
+        inst->a = GET_A(instruction);
+        inst->b = GET_B(instruction);
+        inst->c = GET_C(instruction);
+        inst->target = -1;
+        inst->upvar = 0;
+        inst->deleted = 0;
+
+        if (is_jump(inst->op)) {
+            inst->target = i + 1 + (inst->c ? -inst->b : inst->b);
+        }
+
+        if (is_test(inst->op)) {
+            inst->target = i + 2;
+        }
+
+        if (inst->op == OP_ENTER_TRY) {
+            inst->target = i + inst->b;
+            opt->hastry = 1;
+        }
+    }
+
+    for (i = 0; i < opt->length; i++) {
+        if (opt->code[i].op == OP_CLOSURE) {
+            int j;
+            for (j = 0; j < chunk->children[opt->code[i].b]->numupvars; j++) {
+                Instruction *inst = &opt->code[i + j + 1];
+                inst->upvar = 1;
+
+                // the upvar refers to this chunk's register
+                if (inst->op == OP_MOVE) {
+                    SET_ADD(&opt->captured, inst->b);
+                }
+            }
+
+            i += j;
+        }
+    }
+}
+
+void encode_chunk(Optimizer *opt) {
+    Chunk *chunk = opt->chunk;
+
+    int i;
+    for (i = 0; i < opt->length; i++) {
+        Instruction *inst = &opt->code[i];
+
+        if (is_jump(inst->op)) {
+            if (inst->target <= i) {
+                inst->b = i + 1 - inst->target;
+                inst->c = 1;
+            } else {
+                inst->b = inst->target - i - 1;
+                inst->c = 0;
+            }
+        }
+
+        if (inst->op == OP_ENTER_TRY) {
+            inst->b = inst->target - i;
+        }
+
+        chunk->instructions[i] = CREATE(inst->op, inst->a, inst->b, inst->c);
+    }
+
+    chunk->numinstructions = opt->length;
+
+    free(opt->code);
+    free(opt->targeted);
+    free(opt->live);
+}
+
+// drops deleted instructions; a jump to one lands on the next survivor
+void compact(Optimizer *opt) {
+    int *map = malloc((opt->length + 1) * sizeof *map);
+
+    if (!map) {
+        fatal("Out of memory.");
+    }
+
+    int n = 0;
+
+    int i;
+    for (i = 0; i < opt->length; i++) {
+        map[i] = n;
+
+        if (!opt->code[i].deleted) {
+            n++;
+        }
+    }
+
+    map[opt->length] = n;
+
+    n = 0;
+    for (i = 0; i < opt->length; i++) {
+        if (!opt->code[i].deleted) {
+            Instruction inst = opt->code[i];
+
+            if (inst.target != -1) {
+                inst.target = map[inst.target];
+            }
+
+            opt->code[n++] = inst;
+        }
+    }
+
+    opt->length = n;
+    free(map);
+}
+
+void count_targets(Optimizer *opt) {
+    memset(opt->targeted, 0, (opt->length + 1) * sizeof *opt->targeted);
+
+    int i;
+    for (i = 0; i < opt->length; i++) {
+        if (opt->code[i].target != -1) {
+            opt->targeted[opt->code[i].target]++;
+        }
+    }
+}
+
+/*
+ * Registers read and written by each instruction. A direct call may read
+ * any register from its first argument up, since the callee's arity is
+ * not known here.
+ */
+
+void add_operand(RegisterSet *set, int r) {
+    if (r < NUM_REGISTERS) {
+        SET_ADD(set, r);
+    }
+}
+
+void instruction_uses(Optimizer *opt, Instruction *inst, RegisterSet *set) {
+    memset(set, 0, sizeof *set);
+
+    if (inst->upvar) {
+        return;
+    }
+
+    int i;
+    switch (generic_opcode(inst->op)) {
+        case OP_MOVE:
+        case OP_NEG:
+        case OP_RETURN:
+            add_operand(set, inst->b);
+            break;
+
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_MOD:
+        case OP_POW:
+        case OP_EQ:
+        case OP_NE:
+        case OP_LT:
+        case OP_LE:
+        case OP_TEST_EQ:
+        case OP_TEST_LT:
+        case OP_TEST_LE:
+            add_operand(set, inst->b);
+            add_operand(set, inst->c);
+            break;
+
+        case OP_NOT:
+        case OP_SETUPVAR:
+        case OP_JUMP_TRUE:
+        case OP_JUMP_FALSE:
+        case OP_THROW:
+            add_operand(set, inst->a);
+            break;
+
+        case OP_CONCAT:
+            for (i = 0; i < inst->c; i++) {
+                add_operand(set, inst->b + i);
+            }
+            break;
+
+        case OP_BUILTIN:
+            for (i = 0; i < builtin_arity[inst->b]; i++) {
+                add_operand(set, inst->c + i);
+            }
+            break;
+
+        case OP_CALL:
+            for (i = 0; i <= inst->c; i++) {
+                add_operand(set, inst->b + i);
+            }
+            break;
+
+        case OP_CALL_DIRECT:
+            add_operand(set, inst->b);
+
+            if (inst->c > 0) {
+                for (i = inst->c; i < opt->numregs; i++) {
+                    add_operand(set, i);
+                }
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+// the register written by an instruction, or -1
+int instruction_def(Instruction *inst) {
+    if (inst->upvar) {
+        return -1;
+    }
+
+    switch (generic_opcode(inst->op)) {
+        case OP_SETUPVAR:
+        case OP_RETURN:
+        case OP_TEST_EQ:
+        case OP_TEST_LT:
+        case OP_TEST_LE:
+        case OP_JUMP:
+        case OP_JUMP_TRUE:
+        case OP_JUMP_FALSE:
+        case OP_THROW:
+        case OP_ENTER_TRY:
+        case OP_LEAVE_TRY:
+            return -1;
+
+        default:
+            return inst->a;
+    }
+}
+
+int falls_through(OpCode op) {
+    return op != OP_JUMP && op != OP_RETURN && op != OP_THROW;
+}
+
+// the handler of the innermost try block around each instruction, or -1
+void find_handlers(Optimizer *opt, int *handlers) {
+    int i;
+    for (i = 0; i < opt->length; i++) {
+        handlers[i] = -1;
+    }
+
+    // outer blocks come first, so inner ones overwrite them
+    for (i = 0; i < opt->length; i++) {
+        if (opt->code[i].op == OP_ENTER_TRY) {
+            int j;
+            for (j = i + 1; j < opt->code[i].target; j++) {
+                handlers[j] = opt->code[i].target;
+            }
+        }
+    }
+}
+
+void compute_liveness(Optimizer *opt) {
+    RegisterSet *in = calloc(opt->length + 1, sizeof *in);
+    int *handlers = malloc((opt->length + 1) * sizeof *handlers);
+
+    if (!in || !handlers) {
+        fatal("Out of memory.");
+    }
+
+    find_handlers(opt, handlers);
+
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+
+        int i;
+        for (i = opt->length - 1; i >= 0; i--) {
+            Instruction *inst = &opt->code[i];
+            RegisterSet out;
+            memset(&out, 0, sizeof out);
+
+            int w;
+            if (falls_through(inst->op) && i + 1 < opt->length) {
+                for (w = 0; w < SET_WORDS; w++) {
+                    out.bits[w] |= in[i + 1].bits[w];
+                }
+            }
+
+            if (inst->target != -1 && inst->op != OP_ENTER_TRY) {
+                for (w = 0; w < SET_WORDS; w++) {
+                    out.bits[w] |= in[inst->target].bits[w];
+                }
+            }
+
+            if (handlers[i] != -1) {
+                for (w = 0; w < SET_WORDS; w++) {
+                    out.bits[w] |= in[handlers[i]].bits[w];
+                }
+            }
+
+            RegisterSet uses;
+            instruction_uses(opt, inst, &uses);
+
+            RegisterSet result = out;
+            int def = instruction_def(inst);
+
+            if (def != -1) {
+                SET_DEL(&result, def);
+            }
+
+            for (w = 0; w < SET_WORDS; w++) {
+                result.bits[w] |= uses.bits[w];
+            }
+
+            opt->live[i] = out;
+
+            if (memcmp(&result, &in[i], sizeof result) != 0) {
+                in[i] = result;
+                changed = 1;
+            }
+        }
+    }
+
+    free(in);
+    free(handlers);
+}
+
+int live_after(Optimizer *opt, int i, int r) {
+    return SET_HAS(&opt->captured, r) || SET_HAS(&opt->live[i], r);
+}
+
+/*
+ * EQ followed by a NOT of its result becomes NE.
+ */
+
+int fold_comparisons(Optimizer *opt, OptimizerStats *stats) {
+    int changed = 0;
+
+    int i;
+    for (i = 0; i + 1 < opt->length; i++) {
+        Instruction *cmp = &opt->code[i];
+        Instruction *not = &opt->code[i + 1];
+
+        if (generic_opcode(cmp->op) == OP_EQ && generic_opcode(not->op) == OP_NOT && not->a == cmp->a && !opt->targeted[i + 1]) {
+            cmp->op = cmp->op == OP_EQ_INT ? OP_NE_INT : OP_NE;
+            not->deleted = 1;
+
+            stats->compares++;
+            changed = 1;
+            i++;
+        }
+    }
+
+    return changed;
+}
+
+/*
+ * A jump to an unconditional jump goes straight to its target, and a
+ * conditional jump to a conditional jump on the same register (which
+ * cannot have changed in between) goes wherever that one is known to go.
+ * An unconditional jump to the next instruction is removed, unless a test
+ * skips it.
+ */
+
+int thread_jumps(Optimizer *opt, OptimizerStats *stats) {
+    int changed = 0;
+
+    int i;
+    for (i = 0; i < opt->length; i++) {
+        Instruction *inst = &opt->code[i];
+
+        if (!is_jump(inst->op)) {
+            continue;
+        }
+
+        // bounded, in case of a cycle of jumps
+        int hops;
+        for (hops = 0; hops < opt->length && inst->target < opt->length; hops++) {
+            Instruction *next = &opt->code[inst->target];
+            int target = -1;
+
+            if (next->op == OP_JUMP) {
+                target = next->target;
+            } else if (inst->op != OP_JUMP && is_jump(next->op) && next->a == inst->a) {
+                target = generic_opcode(next->op) == generic_opcode(inst->op) ? next->target : inst->target + 1;
+            }
+
+            if (target == -1 || target == inst->target) {
+                break;
+            }
+
+            inst->target = target;
+
+            stats->jumps++;
+            changed = 1;
+        }
+
+        if (inst->op == OP_JUMP && inst->target == i + 1 && !(i > 0 && is_test(opt->code[i - 1].op))) {
+            inst->deleted = 1;
+
+            stats->jumps++;
+            changed = 1;
+        }
+    }
+
+    return changed;
+}
+
+/*
+ * Code generation computes a value into a scratch register and then
+ * moves it where it belongs. When the scratch register is not read
+ * again, the instruction computing it can write the destination itself.
+ */
+
+int retargetable(Instruction *inst) {
+    if (inst->upvar) {
+        return 0;
+    }
+
+    switch (generic_opcode(inst->op)) {
+        case OP_MOVE:
+        case OP_GETUPVAR:
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_MOD:
+        case OP_POW:
+        case OP_NEG:
+        case OP_CONCAT:
+        case OP_EQ:
+        case OP_NE:
+        case OP_LT:
+        case OP_LE:
+        case OP_CALL:
+        case OP_CALL_DIRECT:
+        case OP_BUILTIN:
+            return 1;
+
+        default:
+            return 0;
+    }
+}
+
+int remove_redundant_moves(Optimizer *opt, OptimizerStats *stats) {
+    int changed = 0;
+
+    compute_liveness(opt);
+
+    int i;
+    for (i = 0; i + 1 < opt->length; i++) {
+        Instruction *inst = &opt->code[i];
+        Instruction *move = &opt->code[i + 1];
+
+        if (!retargetable(inst) || move->op != OP_MOVE || move->upvar || opt->targeted[i + 1]) {
+            continue;
+        }
+
+        if (move->b != inst->a || move->a == inst->a || live_after(opt, i + 1, inst->a)) {
+            continue;
+        }
+
+        // writing a register the instruction reads would be safe for
+        // most instructions, but is not worth reasoning about
+        RegisterSet uses;
+        instruction_uses(opt, inst, &uses);
+
+        if (SET_HAS(&uses, move->a)) {
+            continue;
+        }
+
+        inst->a = move->a;
+        move->deleted = 1;
+
+        stats->moves++;
+        changed = 1;
+        i++;
+    }
+
+    return changed;
+}
+
+/*
+ * A move into a scratch register that is read once, by an instruction
+ * that takes a register-or-constant operand, is replaced by using the
+ * move's source in that operand. The source must not change in between.
+ * Inside a try block anything may throw to a handler that reads the
+ * scratch register, so there the reader must immediately follow.
+ */
+
+int rk_operands(Instruction *inst) {
+    if (inst->upvar) {
+        return 0;
+    }
+
+    switch (generic_opcode(inst->op)) {
+        case OP_MOVE:
+        case OP_NEG:
+            return 1;
+
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_MOD:
+        case OP_POW:
+        case OP_EQ:
+        case OP_NE:
+        case OP_LT:
+        case OP_LE:
+        case OP_TEST_EQ:
+        case OP_TEST_LT:
+        case OP_TEST_LE:
+            return 2;
+
+        default:
+            return 0;
+    }
+}
+
+int forward_moves(Optimizer *opt, OptimizerStats *stats) {
+    int changed = 0;
+
+    compute_liveness(opt);
+
+    int i;
+    for (i = 0; i < opt->length; i++) {
+        Instruction *move = &opt->code[i];
+
+        if (move->op != OP_MOVE || move->upvar || move->a == move->b || SET_HAS(&opt->captured, move->a)) {
+            continue;
+        }
+
+        int t = move->a;
+        int s = move->b;
+
+        // find the one reader in the same block
+        int j;
+        for (j = i + 1; j < opt->length && !opt->targeted[j]; j++) {
+            Instruction *inst = &opt->code[j];
+
+            RegisterSet uses;
+            instruction_uses(opt, inst, &uses);
+
+            if (SET_HAS(&uses, t)) {
+                break;
+            }
+
+            int def = instruction_def(inst);
+
+            if (opt->hastry || inst->op == OP_CALL || inst->op == OP_CALL_DIRECT || !falls_through(inst->op) || is_jump(inst->op) || def == t || def == s) {
+                j = opt->length;
+                break;
+            }
+        }
+
+        if (j == opt->length || opt->targeted[j]) {
+            continue;
+        }
+
+        Instruction *inst = &opt->code[j];
+        int n = rk_operands(inst);
+
+        if (n == 0 || live_after(opt, j, t)) {
+            continue;
+        }
+
+        if (inst->b == t) {
+            inst->b = s;
+        }
+
+        if (n == 2 && inst->c == t) {
+            inst->c = s;
+        }
+
+        move->deleted = 1;
+
+        stats->forwards++;
+        changed = 1;
+    }
+
+    return changed;
+}
+
+/*
+ * A move into a register nothing reads afterwards is removed, such as
+ * the null a while loop leaves behind as its value.
+ */
+
+int remove_dead_stores(Optimizer *opt, OptimizerStats *stats) {
+    int changed = 0;
+
+    compute_liveness(opt);
+
+    int i;
+    for (i = 0; i < opt->length; i++) {
+        Instruction *inst = &opt->code[i];
+
+        if (inst->op != OP_MOVE || inst->upvar) {
+            continue;
+        }
+
+        if (inst->a == inst->b || !live_after(opt, i, inst->a)) {
+            inst->deleted = 1;
+
+            stats->stores++;
+            changed = 1;
+        }
+    }
+
+    return changed;
+}
+
+typedef int (*Pass)(Optimizer *opt, OptimizerStats *stats);
+
+static const Pass passes[] = {
+    fold_comparisons,
+    thread_jumps,
+    remove_redundant_moves,
+    forward_moves,
+    remove_dead_stores
+};
+
+#define NUM_PASSES (sizeof passes / sizeof passes[0])
+
+void optimize(Chunk *chunk, OptimizerStats *stats) {
+    optimize_ssa(chunk, stats);
+
+    Optimizer opt;
+    decode_chunk(&opt, chunk);
+
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+
+        unsigned int i;
+        for (i = 0; i < NUM_PASSES; i++) {
+            count_targets(&opt);
+
+            if (passes[i](&opt, stats)) {
+                compact(&opt);
+                changed = 1;
+            }
+        }
+    }
+
+    encode_chunk(&opt);
+
+    int i;
+    for (i = 0; i < chunk->numchildren; i++) {
+        optimize(chunk->children[i], stats);
+    }
+}
@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2014, Eric Fritz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+ * BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#pragma once
+
+#include "codegen.h"
+
+typedef struct {
+    int moves;          // moves folded into the instruction computing their source
+    int forwards;       // moves whose source was used in place of their destination
+    int stores;         // moves into registers that are never read
+    int jumps;          // jumps threaded through other jumps or removed
+    int compares;       // EQ and NOT pairs folded into NE
+    int hoisted;        // loop-invariant instructions moved out of loops
+    int values;         // instructions replaced by a register holding their value
+    int copies;         // instructions reading a copy from its original instead
+} OptimizerStats;
+
+void optimize(Chunk *chunk, OptimizerStats *stats);
@@ -0,0 +1,248 @@
+/*
+ * Copyright (c) 2014, Eric Fritz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+ * BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "chinnu.h"
+#include "profile.h"
+
+typedef struct Site Site;
+typedef struct Stack Stack;
+
+struct Site {
+    Chunk *chunk;
+    int pc;
+    AllocKind kind;
+
+    unsigned long count;
+    unsigned long bytes;
+    Site *next;
+};
+
+struct Stack {
+    char *frames;
+
+    unsigned long count;
+    unsigned long bytes;
+    Stack *next;
+};
+
+#define PROFILE_MAP_SIZE 256
+
+const char *const alloc_kind_names[] = {
+    "constant",
+    "concat",
+    "coerce",
+    "closure",
+    "upval",
+    "frame",
+    "catch-frame",
+    "builtin",
+    "substring"
+};
+
+static Site *sites[PROFILE_MAP_SIZE];
+static Stack *stacks[PROFILE_MAP_SIZE];
+
+static int numsites = 0;
+static int numstacks = 0;
+
+unsigned int site_hash(Chunk *chunk, int pc, AllocKind kind) {
+    unsigned long h = (unsigned long) chunk;
+    h = (h >> 4) * 31 + pc;
+    h = h * 31 + kind;
+
+    return h % PROFILE_MAP_SIZE;
+}
+
+// djb2 by Dan Bernstein
+unsigned int stack_hash(char *str) {
+    unsigned int hash = 5381;
+    int c;
+
+    while ((c = *str++)) {
+        hash = ((hash << 5) + hash) ^ c;
+    }
+
+    return hash % PROFILE_MAP_SIZE;
+}
+
+void record_allocation(Chunk *chunk, int pc, char *frames, AllocKind kind, size_t bytes, int weight) {
+    Site **site = &sites[site_hash(chunk, pc, kind)];
+
+    while (*site && ((*site)->chunk != chunk || (*site)->pc != pc || (*site)->kind != kind)) {
+        site = &(*site)->next;
+    }
+
+    if (!*site) {
+        if (!(*site = malloc(sizeof **site))) {
+            fatal("Out of memory.");
+        }
+
+        (*site)->chunk = chunk;
+        (*site)->pc = pc;
+        (*site)->kind = kind;
+        (*site)->count = 0;
+        (*site)->bytes = 0;
+        (*site)->next = NULL;
+        numsites++;
+    }
+
+    (*site)->count += weight;
+    (*site)->bytes += bytes * weight;
+
+    Stack **stack = &stacks[stack_hash(frames)];
+
+    while (*stack && strcmp((*stack)->frames, frames) != 0) {
+        stack = &(*stack)->next;
+    }
+
+    if (!*stack) {
+        if (!(*stack = malloc(sizeof **stack))) {
+            fatal("Out of memory.");
+        }
+
+        (*stack)->frames = strdup(frames);
+        (*stack)->count = 0;
+        (*stack)->bytes = 0;
+        (*stack)->next = NULL;
+        numstacks++;
+    }
+
+    (*stack)->count += weight;
+    (*stack)->bytes += bytes * weight;
+}
+
+int compare_sites(const void *a, const void *b) {
+    const Site *s1 = *(Site * const *) a;
+    const Site *s2 = *(Site * const *) b;
+
+    if (s1->bytes != s2->bytes) {
+        return s1->bytes < s2->bytes ? 1 : -1;
+    }
+
+    return s1->count < s2->count ? 1 : s1->count > s2->count ? -1 : 0;
+}
+
+void write_report(Chunk *root, FILE *fp) {
+    Site **ranked = malloc((numsites + 1) * sizeof *ranked);
+
+    if (!ranked) {
+        fatal("Out of memory.");
+    }
+
+    unsigned long kindcount[NUM_ALLOC_KINDS] = { 0 };
+    unsigned long kindbytes[NUM_ALLOC_KINDS] = { 0 };
+
+    int n = 0;
+
+    int i;
+    for (i = 0; i < PROFILE_MAP_SIZE; i++) {
+        Site *site;
+        for (site = sites[i]; site != NULL; site = site->next) {
+            ranked[n++] = site;
+
+            kindcount[site->kind] += site->count;
+            kindbytes[site->kind] += site->bytes;
+        }
+    }
+
+    qsort(ranked, n, sizeof *ranked, compare_sites);
+
+    fprintf(fp, "Allocation profile (sampling 1 in %d)\n\n", profile_sample);
+    fprintf(fp, "%10s %12s  %s\n", "count", "bytes", "site");
+
+    for (i = 0; i < n; i++) {
+        char name[256];
+        chunk_name(root, ranked[i]->chunk, name, sizeof name);
+
+        fprintf(fp, "%10lu %12lu  %s@%d %s\n",
+            ranked[i]->count, ranked[i]->bytes,
+            name, ranked[i]->pc + 1,
+            alloc_kind_names[ranked[i]->kind]);
+    }
+
+    fprintf(fp, "\n%10s %12s  %s\n", "count", "bytes", "kind");
+
+    for (i = 0; i < NUM_ALLOC_KINDS; i++) {
+        if (kindcount[i] > 0) {
+            fprintf(fp, "%10lu %12lu  %s\n", kindcount[i], kindbytes[i], alloc_kind_names[i]);
+        }
+    }
+
+    free(ranked);
+}
+
+void write_folded(FILE *fp) {
+    int i;
+    for (i = 0; i < PROFILE_MAP_SIZE; i++) {
+        Stack *stack;
+        for (stack = stacks[i]; stack != NULL; stack = stack->next) {
+            fprintf(fp, "%s %lu\n", stack->frames, stack->bytes);
+        }
+    }
+}
+
+void write_profile(Chunk *root) {
+    FILE *fp = fopen(profile_file, "w");
+
+    if (!fp) {
+        fatal("Could not open allocation profile file.");
+    }
+
+    write_report(root, fp);
+    fclose(fp);
+
+    char *folded = malloc((strlen(profile_file) + 8) * sizeof *folded);
+
+    if (!folded) {
+        fatal("Out of memory.");
+    }
+
+    strcpy(folded, profile_file);
+    strcat(folded, ".folded");
+
+    if (!(fp = fopen(folded, "w"))) {
+        fatal("Could not open allocation profile file.");
+    }
+
+    write_folded(fp);
+    fclose(fp);
+    free(folded);
+
+    int i;
+    for (i = 0; i < PROFILE_MAP_SIZE; i++) {
+        while (sites[i]) {
+            Site *temp = sites[i];
+            sites[i] = temp->next;
+            free(temp);
+        }
+
+        while (stacks[i]) {
+            Stack *temp = stacks[i];
+            stacks[i] = temp->next;
+            free(temp->frames);
+            free(temp);
+        }
+    }
+
+    numsites = 0;
+    numstacks = 0;
+}
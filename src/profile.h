@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2014, Eric Fritz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+ * BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#include "codegen.h"
+
+typedef enum {
+    ALLOC_CONSTANT,
+    ALLOC_CONCAT,
+    ALLOC_COERCE,
+    ALLOC_CLOSURE,
+    ALLOC_UPVAL,
+    ALLOC_FRAME,
+    ALLOC_CATCH_FRAME,
+    ALLOC_BUILTIN,
+    ALLOC_SUBSTRING
+} AllocKind;
+
+#define NUM_ALLOC_KINDS (ALLOC_SUBSTRING + 1)
+
+const char *const alloc_kind_names[NUM_ALLOC_KINDS];
+
+char *profile_file;
+int profile_sample;
+
+void record_allocation(Chunk *chunk, int pc, char *stack, AllocKind kind, size_t bytes, int weight);
+void write_profile(Chunk *root);
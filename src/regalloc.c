@@ -0,0 +1,291 @@
+/*
+ * Copyright (c) 2014, Eric Fritz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+ * BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include <stdlib.h>
+
+#include "chinnu.h"
+#include "regalloc.h"
+#include "escape.h"
+
+/*
+ * Register allocation
+ *
+ * Assigns each local a register in its function's frame. Register 0
+ * holds the value of the expression being evaluated, parameters follow
+ * in order, then the locals; temporaries are placed after the locals by
+ * codegen.
+ *
+ * Without sharing every declaration gets its own register. With sharing
+ * the locals are allocated like a stack: a local's register is released
+ * when the contour that declared it ends, so the disjoint branches of an
+ * if (or consecutive blocks) reuse the same registers. Locals captured
+ * by reference are excluded, as an open upval refers to the register
+ * itself for as long as the frame lives; they are given registers of
+ * their own below the shared ones. Locals captured by value (see
+ * escape.c) are copied when the closure is created and need no such
+ * care.
+ *
+ * The allocator also records which locals codegen must not compute into
+ * directly: captured ones, whose intermediate values another closure
+ * could read, and ones assigned inside a protected block, whose
+ * intermediate values a handler could read.
+ */
+
+typedef struct {
+    int share;
+    int next;
+    int max;
+} Allocator;
+
+/* forward */
+void mark_expr(Expression *expr, int guarded);
+void allocate_function(Expression *expr, int share);
+
+void mark_list(ExpressionList *list, int guarded) {
+    if (list) {
+        ExpressionNode *head;
+        for (head = list->head; head != NULL; head = head->next) {
+            mark_expr(head->expr, guarded);
+        }
+    }
+}
+
+void mark_expr(Expression *expr, int guarded) {
+    if (!expr) {
+        return;
+    }
+
+    switch (expr->type) {
+        case TYPE_FUNC:
+        {
+            // a copy taken when the closure is created does not refer
+            // to the register
+            int i;
+            for (i = 0; i < expr->scope->numupvars; i++) {
+                if (!captures_by_value(expr, expr->scope->upvars[i])) {
+                    expr->scope->upvars[i]->captured = 1;
+                }
+            }
+
+            // a handler in the enclosing frame never sees this frame's locals
+            mark_list(expr->llist, 0);
+            mark_expr(expr->rexpr, 0);
+        } return;
+
+        case TYPE_BLOCK:
+            mark_list(expr->llist, guarded || expr->rlist != NULL);
+            mark_list(expr->rlist, guarded);
+            return;
+
+        case TYPE_ASSIGN:
+            if (guarded) {
+                expr->lexpr->symbol->guarded = 1;
+            }
+            break;
+
+        default:
+            break;
+    }
+
+    mark_expr(expr->cond, guarded);
+    mark_expr(expr->lexpr, guarded);
+    mark_expr(expr->rexpr, guarded);
+    mark_list(expr->llist, guarded);
+    mark_list(expr->rlist, guarded);
+}
+
+int take_slot(Allocator *alloc) {
+    int slot = alloc->next++;
+
+    if (alloc->next > alloc->max) {
+        alloc->max = alloc->next;
+    }
+
+    return slot;
+}
+
+/*
+ * Gives the captured locals of a function their registers. Only needed
+ * when sharing; otherwise they are allocated in order with the rest.
+ */
+void allocate_captured(Allocator *alloc, Expression *expr);
+
+void allocate_captured_list(Allocator *alloc, ExpressionList *list) {
+    if (list) {
+        ExpressionNode *head;
+        for (head = list->head; head != NULL; head = head->next) {
+            allocate_captured(alloc, head->expr);
+        }
+    }
+}
+
+void allocate_captured(Allocator *alloc, Expression *expr) {
+    if (!expr) {
+        return;
+    }
+
+    if (expr->type == TYPE_DECLARATION || (expr->type == TYPE_FUNC && expr->symbol)) {
+        if (expr->symbol->captured) {
+            expr->symbol->slot = take_slot(alloc);
+        }
+    }
+
+    if (expr->type == TYPE_FUNC) {
+        return;
+    }
+
+    allocate_captured(alloc, expr->cond);
+    allocate_captured(alloc, expr->lexpr);
+    allocate_captured(alloc, expr->rexpr);
+    allocate_captured_list(alloc, expr->llist);
+    allocate_captured_list(alloc, expr->rlist);
+}
+
+/* forward */
+void allocate_expr(Allocator *alloc, Expression *expr);
+
+void allocate_list(Allocator *alloc, ExpressionList *list) {
+    ExpressionNode *head;
+    for (head = list->head; head != NULL; head = head->next) {
+        allocate_expr(alloc, head->expr);
+    }
+}
+
+/*
+ * Allocates the locals declared in a contour, releasing their registers
+ * at its end when sharing. Mirrors the contours entered by resolve.
+ */
+void allocate_contour(Allocator *alloc, Expression *expr) {
+    int next = alloc->next;
+    allocate_expr(alloc, expr);
+
+    if (alloc->share) {
+        alloc->next = next;
+    }
+}
+
+void allocate_contour_list(Allocator *alloc, ExpressionList *list) {
+    int next = alloc->next;
+    allocate_list(alloc, list);
+
+    if (alloc->share) {
+        alloc->next = next;
+    }
+}
+
+void allocate_local(Allocator *alloc, Symbol *symbol) {
+    if (!alloc->share || !symbol->captured) {
+        symbol->slot = take_slot(alloc);
+    }
+}
+
+void allocate_expr(Allocator *alloc, Expression *expr) {
+    switch (expr->type) {
+        case TYPE_MODULE:
+            allocate_expr(alloc, expr->lexpr);
+            break;
+
+        case TYPE_DECLARATION:
+            // the register is taken before the initializer is allocated,
+            // so the initializer's own locals never land on it
+            allocate_local(alloc, expr->symbol);
+
+            if (expr->rexpr) {
+                allocate_expr(alloc, expr->rexpr);
+            }
+            break;
+
+        case TYPE_FUNC:
+            if (expr->symbol) {
+                allocate_local(alloc, expr->symbol);
+            }
+
+            allocate_function(expr, alloc->share);
+            break;
+
+        case TYPE_BLOCK:
+            allocate_contour_list(alloc, expr->llist);
+
+            if (expr->rlist) {
+                allocate_contour_list(alloc, expr->rlist);
+            }
+            break;
+
+        case TYPE_IF:
+            allocate_expr(alloc, expr->cond);
+            allocate_contour(alloc, expr->lexpr);
+
+            if (expr->rexpr) {
+                allocate_contour(alloc, expr->rexpr);
+            }
+            break;
+
+        case TYPE_WHILE:
+            allocate_expr(alloc, expr->cond);
+            allocate_contour(alloc, expr->lexpr);
+            break;
+
+        case TYPE_CALL:
+            allocate_expr(alloc, expr->lexpr);
+            allocate_contour_list(alloc, expr->llist);
+            break;
+
+        case TYPE_BUILTIN:
+            allocate_contour_list(alloc, expr->llist);
+            break;
+
+        case TYPE_INTERP:
+            allocate_list(alloc, expr->llist);
+            break;
+
+        default:
+            if (expr->lexpr) allocate_expr(alloc, expr->lexpr);
+            if (expr->rexpr) allocate_expr(alloc, expr->rexpr);
+            break;
+    }
+}
+
+void allocate_function(Expression *expr, int share) {
+    Allocator alloc;
+    alloc.share = share;
+    alloc.next = 1;
+    alloc.max = 1;
+
+    Expression *body = expr->type == TYPE_MODULE ? expr->lexpr : expr->rexpr;
+
+    if (expr->llist) {
+        ExpressionNode *head;
+        for (head = expr->llist->head; head != NULL; head = head->next) {
+            head->expr->symbol->slot = take_slot(&alloc);
+        }
+    }
+
+    if (share) {
+        allocate_captured(&alloc, body);
+    }
+
+    allocate_expr(&alloc, body);
+    expr->scope->numslots = alloc.max - 1;
+}
+
+void allocate_registers(Expression *expr, int share) {
+    mark_expr(expr, 0);
+    allocate_function(expr, share);
+}
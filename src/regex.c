@@ -0,0 +1,1405 @@
+/*
+ * Copyright (c) 2014, Eric Fritz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+ * BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "chinnu.h"
+#include "regex.h"
+
+/*
+ * Regular expressions
+ *
+ * A pattern is parsed into a tree and compiled to a program for a
+ * Thompson-style NFA over code points. Whether a string matches is
+ * decided by a DFA built lazily from that program: each DFA state is a
+ * distinct set of NFA threads, created the first time the input reaches
+ * it, and transitions on ASCII characters are cached in the state. When
+ * match positions are needed the NFA itself is simulated breadth-first
+ * (a Pike VM), which gives leftmost-first matches with captures. Both
+ * run in time linear in the input. A pattern whose DFA grows past
+ * MAX_DFA_STATES falls back to the NFA for everything.
+ *
+ * Supported syntax: literals, ., [...] and [^...] (ranges and \d \w \s),
+ * \d \w \s \D \W \S, the usual escapes, ^ and $ (start and end of the
+ * string), (...) and (?:...), |, and * + ? {m} {m,} {m,n}, each
+ * optionally followed by ? to prefer the shortest match.
+ */
+
+#define MAX_PROGRAM 10000
+#define MAX_REPEAT 1000
+#define MAX_DFA_STATES 1000
+#define DFA_TABLE_SIZE 256
+#define REGEX_TABLE_SIZE 64
+#define RECENT_REGEXES 16
+#define PROGRAM_CHUNK_SIZE 32
+
+#define IS_CONTINUATION(c) (((unsigned char) (c) & 0xC0) == 0x80)
+
+typedef struct {
+    int lo;
+    int hi;
+} Range;
+
+typedef struct {
+    Range *ranges;
+    int numranges;
+    int negated;
+} CharClass;
+
+typedef enum {
+    NODE_EMPTY,
+    NODE_CHAR,          // c
+    NODE_ANY,
+    NODE_CLASS,         // class
+    NODE_BOL,
+    NODE_EOL,
+    NODE_CAT,           // left, right
+    NODE_ALT,           // left, right
+    NODE_GROUP,         // left, group
+    NODE_REPEAT         // left, min, max (-1 for unbounded), greedy
+} NodeType;
+
+typedef struct Node Node;
+
+struct Node {
+    NodeType type;
+    Node *left;
+    Node *right;
+    CharClass *class;
+
+    int c;
+    int group;
+    int min;
+    int max;
+    int greedy;
+};
+
+typedef enum {
+    INST_CHAR,          // consume x
+    INST_ANY,           // consume anything but a newline
+    INST_CLASS,         // consume a member of class
+    INST_MATCH,
+    INST_JMP,           // goto x
+    INST_SPLIT,         // goto x and y, preferring x
+    INST_SAVE,          // captures[x] := position
+    INST_BOL,           // assert start of input
+    INST_EOL            // assert end of input
+} InstOp;
+
+typedef struct {
+    InstOp op;
+    int x;
+    int y;
+    CharClass *class;
+} Inst;
+
+typedef struct DfaState DfaState;
+
+struct DfaState {
+    int *kernel;
+    int numkernel;
+    int start;
+
+    int *closure;
+    int numclosure;
+    int accepting;
+    int acceptend;
+
+    unsigned int hash;
+    DfaState *chain;
+    DfaState *next[128];
+};
+
+typedef struct {
+    DfaState **states;
+    DfaState *initial;
+    int numstates;
+    int floating;
+} Dfa;
+
+typedef struct {
+    int *pcs;
+    int *sparse;
+    int *captures;
+    int count;
+} ThreadList;
+
+struct Regex {
+    Regex *next;
+    char *pattern;
+    int patternlength;
+    unsigned int hash;
+
+    Inst *program;
+    int length;
+    int capacity;
+    int numgroups;
+
+    Dfa anchored;
+    Dfa floating;
+    int nfaonly;
+
+    // scratch space sized by the program
+    ThreadList lists[2];
+    int *captures;
+    int *stack;
+    int *marks;
+    int generation;
+};
+
+int decode_char(const char *s, int length, int i, int *cp) {
+    unsigned char b = s[i];
+    int need = 1;
+    int c = b;
+
+    if ((b & 0xE0) == 0xC0) {
+        need = 2;
+        c = b & 0x1F;
+    } else if ((b & 0xF0) == 0xE0) {
+        need = 3;
+        c = b & 0x0F;
+    } else if ((b & 0xF8) == 0xF0) {
+        need = 4;
+        c = b & 0x07;
+    }
+
+    // a character is a lead byte and every continuation byte after it
+    int n = 1;
+    while (i + n < length && IS_CONTINUATION(s[i + n])) {
+        if (n < need) {
+            c = (c << 6) | (s[i + n] & 0x3F);
+        }
+
+        n++;
+    }
+
+    *cp = c;
+    return n;
+}
+
+/*
+ * Parsing
+ */
+
+typedef struct {
+    Regex *re;
+    const char *s;
+    int length;
+    int pos;
+
+    Node **nodes;
+    int numnodes;
+    int capacity;
+} Parser;
+
+Node *make_regex_node(Parser *p, NodeType type) {
+    Node *node = malloc(sizeof *node);
+
+    if (!node) {
+        fatal("Out of memory.");
+    }
+
+    if (p->numnodes == p->capacity) {
+        p->capacity = p->capacity ? p->capacity * 2 : PROGRAM_CHUNK_SIZE;
+        p->nodes = realloc(p->nodes, p->capacity * sizeof *p->nodes);
+
+        if (!p->nodes) {
+            fatal("Out of memory.");
+        }
+    }
+
+    p->nodes[p->numnodes++] = node;
+
+    node->type = type;
+    node->left = NULL;
+    node->right = NULL;
+    node->class = NULL;
+    node->group = 0;
+    node->greedy = 1;
+
+    return node;
+}
+
+Node *make_regex_pair(Parser *p, NodeType type, Node *left, Node *right) {
+    Node *node = make_regex_node(p, type);
+    node->left = left;
+    node->right = right;
+    return node;
+}
+
+void regex_error(Parser *p, const char *message) {
+    fatal("Invalid regular expression '%.*s': %s.", p->length, p->s, message);
+}
+
+CharClass *make_class(int negated) {
+    CharClass *class = malloc(sizeof *class);
+
+    if (!class) {
+        fatal("Out of memory.");
+    }
+
+    class->ranges = NULL;
+    class->numranges = 0;
+    class->negated = negated;
+
+    return class;
+}
+
+void add_range(CharClass *class, int lo, int hi) {
+    class->ranges = realloc(class->ranges, (class->numranges + 1) * sizeof *class->ranges);
+
+    if (!class->ranges) {
+        fatal("Out of memory.");
+    }
+
+    class->ranges[class->numranges].lo = lo;
+    class->ranges[class->numranges].hi = hi;
+    class->numranges++;
+}
+
+static const Range digit_ranges[] = { {'0', '9'} };
+static const Range word_ranges[] = { {'0', '9'}, {'A', 'Z'}, {'_', '_'}, {'a', 'z'} };
+static const Range space_ranges[] = { {'\t', '\r'}, {' ', ' '} };
+
+void add_ranges(CharClass *class, const Range *ranges, int n, int complement) {
+    int i;
+
+    if (!complement) {
+        for (i = 0; i < n; i++) {
+            add_range(class, ranges[i].lo, ranges[i].hi);
+        }
+
+        return;
+    }
+
+    // ranges are sorted and disjoint
+    int lo = 0;
+    for (i = 0; i < n; i++) {
+        if (ranges[i].lo > lo) {
+            add_range(class, lo, ranges[i].lo - 1);
+        }
+
+        lo = ranges[i].hi + 1;
+    }
+
+    add_range(class, lo, 0x10FFFF);
+}
+
+// adds the class named by a \d-style escape; returns 0 if c names none
+int add_escape_class(CharClass *class, int c) {
+    switch (c) {
+        case 'd': case 'D':
+            add_ranges(class, digit_ranges, 1, c == 'D');
+            return 1;
+
+        case 'w': case 'W':
+            add_ranges(class, word_ranges, 4, c == 'W');
+            return 1;
+
+        case 's': case 'S':
+            add_ranges(class, space_ranges, 2, c == 'S');
+            return 1;
+    }
+
+    return 0;
+}
+
+int next_pattern_char(Parser *p) {
+    int c;
+    p->pos += decode_char(p->s, p->length, p->pos, &c);
+    return c;
+}
+
+int escaped_char(Parser *p) {
+    if (p->pos >= p->length) {
+        regex_error(p, "trailing backslash");
+    }
+
+    int c = next_pattern_char(p);
+
+    switch (c) {
+        case 'n': return '\n';
+        case 't': return '\t';
+        case 'r': return '\r';
+        case 'f': return '\f';
+        case 'v': return '\v';
+        case '0': return '\0';
+    }
+
+    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')) {
+        regex_error(p, "unknown escape");
+    }
+
+    return c;
+}
+
+Node *parse_class(Parser *p) {
+    int negated = 0;
+
+    if (p->pos < p->length && p->s[p->pos] == '^') {
+        negated = 1;
+        p->pos++;
+    }
+
+    CharClass *class = make_class(negated);
+    int first = 1;
+
+    while (1) {
+        if (p->pos >= p->length) {
+            regex_error(p, "missing ]");
+        }
+
+        if (p->s[p->pos] == ']' && !first) {
+            p->pos++;
+            break;
+        }
+
+        first = 0;
+
+        int lo;
+        if (p->s[p->pos] == '\\') {
+            p->pos++;
+
+            if (p->pos < p->length && add_escape_class(class, p->s[p->pos])) {
+                p->pos++;
+                continue;
+            }
+
+            lo = escaped_char(p);
+        } else {
+            lo = next_pattern_char(p);
+        }
+
+        int hi = lo;
+        if (p->pos + 1 < p->length && p->s[p->pos] == '-' && p->s[p->pos + 1] != ']') {
+            p->pos++;
+
+            if (p->s[p->pos] == '\\') {
+                p->pos++;
+                hi = escaped_char(p);
+            } else {
+                hi = next_pattern_char(p);
+            }
+
+            if (hi < lo) {
+                regex_error(p, "range out of order");
+            }
+        }
+
+        add_range(class, lo, hi);
+    }
+
+    Node *node = make_regex_node(p, NODE_CLASS);
+    node->class = class;
+    return node;
+}
+
+/* forward */
+Node *parse_alt(Parser *p);
+
+Node *parse_atom(Parser *p) {
+    int c = next_pattern_char(p);
+
+    switch (c) {
+        case '(':
+        {
+            int group = -1;
+
+            if (p->pos + 1 < p->length && p->s[p->pos] == '?' && p->s[p->pos + 1] == ':') {
+                p->pos += 2;
+            } else {
+                group = p->re->numgroups++;
+            }
+
+            Node *inner = parse_alt(p);
+
+            if (p->pos >= p->length || p->s[p->pos] != ')') {
+                regex_error(p, "missing )");
+            }
+
+            p->pos++;
+
+            if (group == -1) {
+                return inner;
+            }
+
+            Node *node = make_regex_pair(p, NODE_GROUP, inner, NULL);
+            node->group = group;
+            return node;
+        }
+
+        case '[':
+            return parse_class(p);
+
+        case '.':
+            return make_regex_node(p, NODE_ANY);
+
+        case '^':
+            return make_regex_node(p, NODE_BOL);
+
+        case '$':
+            return make_regex_node(p, NODE_EOL);
+
+        case '\\':
+        {
+            if (p->pos < p->length) {
+                CharClass *class = make_class(0);
+
+                if (add_escape_class(class, p->s[p->pos])) {
+                    p->pos++;
+
+                    Node *node = make_regex_node(p, NODE_CLASS);
+                    node->class = class;
+                    return node;
+                }
+
+                free(class);
+            }
+
+            Node *node = make_regex_node(p, NODE_CHAR);
+            node->c = escaped_char(p);
+            return node;
+        }
+
+        case '*':
+        case '+':
+        case '?':
+        case '{':
+            regex_error(p, "nothing to repeat");
+    }
+
+    Node *node = make_regex_node(p, NODE_CHAR);
+    node->c = c;
+    return node;
+}
+
+int parse_number(Parser *p) {
+    int n = 0;
+    int digits = 0;
+
+    while (p->pos < p->length && p->s[p->pos] >= '0' && p->s[p->pos] <= '9') {
+        n = n * 10 + (p->s[p->pos++] - '0');
+
+        if (n > MAX_REPEAT) {
+            regex_error(p, "repetition count too large");
+        }
+
+        digits++;
+    }
+
+    return digits ? n : -1;
+}
+
+Node *parse_repeat(Parser *p) {
+    Node *node = parse_atom(p);
+
+    while (p->pos < p->length) {
+        int min, max;
+        char c = p->s[p->pos];
+
+        if (c == '*') {
+            min = 0;
+            max = -1;
+        } else if (c == '+') {
+            min = 1;
+            max = -1;
+        } else if (c == '?') {
+            min = 0;
+            max = 1;
+        } else if (c == '{') {
+            p->pos++;
+
+            min = parse_number(p);
+            max = min;
+
+            if (min == -1) {
+                regex_error(p, "expected a number after {");
+            }
+
+            if (p->pos < p->length && p->s[p->pos] == ',') {
+                p->pos++;
+                max = parse_number(p);
+
+                if (max != -1 && max < min) {
+                    regex_error(p, "repetition range out of order");
+                }
+            }
+
+            if (p->pos >= p->length || p->s[p->pos] != '}') {
+                regex_error(p, "missing }");
+            }
+        } else {
+            break;
+        }
+
+        p->pos++;
+
+        Node *repeat = make_regex_pair(p, NODE_REPEAT, node, NULL);
+        repeat->min = min;
+        repeat->max = max;
+
+        if (p->pos < p->length && p->s[p->pos] == '?') {
+            repeat->greedy = 0;
+            p->pos++;
+        }
+
+        node = repeat;
+    }
+
+    return node;
+}
+
+Node *parse_cat(Parser *p) {
+    Node *node = make_regex_node(p, NODE_EMPTY);
+
+    while (p->pos < p->length && p->s[p->pos] != '|' && p->s[p->pos] != ')') {
+        Node *next = parse_repeat(p);
+        node = node->type == NODE_EMPTY ? next : make_regex_pair(p, NODE_CAT, node, next);
+    }
+
+    return node;
+}
+
+Node *parse_alt(Parser *p) {
+    Node *node = parse_cat(p);
+
+    while (p->pos < p->length && p->s[p->pos] == '|') {
+        p->pos++;
+        node = make_regex_pair(p, NODE_ALT, node, parse_cat(p));
+    }
+
+    return node;
+}
+
+/*
+ * Compilation
+ */
+
+int emit_inst(Regex *re, InstOp op, int x, int y) {
+    if (re->length == MAX_PROGRAM) {
+        fatal("Regular expression '%.*s' is too large.", re->patternlength, re->pattern);
+    }
+
+    if (re->length == re->capacity) {
+        re->capacity = re->capacity ? re->capacity * 2 : PROGRAM_CHUNK_SIZE;
+        re->program = realloc(re->program, re->capacity * sizeof *re->program);
+
+        if (!re->program) {
+            fatal("Out of memory.");
+        }
+    }
+
+    Inst *inst = &re->program[re->length];
+    inst->op = op;
+    inst->x = x;
+    inst->y = y;
+    inst->class = NULL;
+
+    return re->length++;
+}
+
+// a split whose preferred branch is the next instruction when greedy
+int emit_split(Regex *re, int greedy) {
+    return emit_inst(re, INST_SPLIT, greedy ? re->length + 1 : -1, greedy ? -1 : re->length + 1);
+}
+
+void patch_split(Regex *re, int split, int target) {
+    if (re->program[split].x == -1) {
+        re->program[split].x = target;
+    } else {
+        re->program[split].y = target;
+    }
+}
+
+void compile_node(Regex *re, Node *node) {
+    switch (node->type) {
+        case NODE_EMPTY:
+            break;
+
+        case NODE_CHAR:
+            emit_inst(re, INST_CHAR, node->c, 0);
+            break;
+
+        case NODE_ANY:
+            emit_inst(re, INST_ANY, 0, 0);
+            break;
+
+        case NODE_CLASS:
+        {
+            // instructions copied by repetition share the class; the
+            // first one owns it
+            int pc = emit_inst(re, INST_CLASS, 0, 0);
+            re->program[pc].class = node->class;
+        } break;
+
+        case NODE_BOL:
+            emit_inst(re, INST_BOL, 0, 0);
+            break;
+
+        case NODE_EOL:
+            emit_inst(re, INST_EOL, 0, 0);
+            break;
+
+        case NODE_CAT:
+            compile_node(re, node->left);
+            compile_node(re, node->right);
+            break;
+
+        case NODE_ALT:
+        {
+            int split = emit_inst(re, INST_SPLIT, re->length + 1, -1);
+            compile_node(re, node->left);
+
+            int jump = emit_inst(re, INST_JMP, -1, 0);
+            re->program[split].y = re->length;
+
+            compile_node(re, node->right);
+            re->program[jump].x = re->length;
+        } break;
+
+        case NODE_GROUP:
+            emit_inst(re, INST_SAVE, 2 * node->group, 0);
+            compile_node(re, node->left);
+            emit_inst(re, INST_SAVE, 2 * node->group + 1, 0);
+            break;
+
+        case NODE_REPEAT:
+        {
+            int i;
+            for (i = 0; i + 1 < node->min; i++) {
+                compile_node(re, node->left);
+            }
+
+            if (node->max == -1) {
+                if (node->min > 0) {
+                    // x+ : x, then a split whose preferred branch
+                    // (when greedy) loops back
+                    int start = re->length;
+                    compile_node(re, node->left);
+
+                    int split = emit_split(re, !node->greedy);
+                    patch_split(re, split, start);
+                } else {
+                    // x* : split over x, jump back to the split
+                    int split = emit_split(re, node->greedy);
+                    compile_node(re, node->left);
+
+                    emit_inst(re, INST_JMP, split, 0);
+                    patch_split(re, split, re->length);
+                }
+
+                break;
+            }
+
+            if (node->min > 0) {
+                compile_node(re, node->left);
+            }
+
+            // each optional copy is skipped to the very end
+            int numsplits = node->max - node->min;
+            int *splits = malloc((numsplits + 1) * sizeof *splits);
+
+            if (!splits) {
+                fatal("Out of memory.");
+            }
+
+            for (i = 0; i < numsplits; i++) {
+                splits[i] = emit_split(re, node->greedy);
+                compile_node(re, node->left);
+            }
+
+            for (i = 0; i < numsplits; i++) {
+                patch_split(re, splits[i], re->length);
+            }
+
+            free(splits);
+        } break;
+    }
+}
+
+int class_contains(CharClass *class, int c) {
+    int i;
+    for (i = 0; i < class->numranges; i++) {
+        if (c >= class->ranges[i].lo && c <= class->ranges[i].hi) {
+            return !class->negated;
+        }
+    }
+
+    return class->negated;
+}
+
+int inst_consumes(Inst *inst, int c) {
+    switch (inst->op) {
+        case INST_CHAR:
+            return c == inst->x;
+
+        case INST_ANY:
+            return c != '\n';
+
+        case INST_CLASS:
+            return class_contains(inst->class, c);
+
+        default:
+            return 0;
+    }
+}
+
+#define IS_CONSUMING(op) ((op) == INST_CHAR || (op) == INST_ANY || (op) == INST_CLASS)
+
+void init_dfa(Dfa *dfa, int floating) {
+    dfa->states = calloc(DFA_TABLE_SIZE, sizeof *dfa->states);
+
+    if (!dfa->states) {
+        fatal("Out of memory.");
+    }
+
+    dfa->initial = NULL;
+    dfa->numstates = 0;
+    dfa->floating = floating;
+}
+
+void init_thread_list(ThreadList *list, int length, int numcaptures) {
+    list->pcs = malloc(length * sizeof *list->pcs);
+    list->sparse = calloc(length, sizeof *list->sparse);
+    list->captures = malloc(length * numcaptures * sizeof *list->captures);
+    list->count = 0;
+
+    if (!list->pcs || !list->sparse || !list->captures) {
+        fatal("Out of memory.");
+    }
+}
+
+Regex *compile_regex(const char *pattern, int length, unsigned int hash) {
+    Regex *re = malloc(sizeof *re);
+    char *copy = malloc(length + 1);
+
+    if (!re || !copy) {
+        fatal("Out of memory.");
+    }
+
+    memcpy(copy, pattern, length);
+    copy[length] = '\0';
+
+    re->next = NULL;
+    re->pattern = copy;
+    re->patternlength = length;
+    re->hash = hash;
+    re->program = NULL;
+    re->length = 0;
+    re->capacity = 0;
+    re->numgroups = 1;
+    re->nfaonly = 0;
+
+    Parser p;
+    p.re = re;
+    p.s = copy;
+    p.length = length;
+    p.pos = 0;
+    p.nodes = NULL;
+    p.numnodes = 0;
+    p.capacity = 0;
+
+    Node *node = parse_alt(&p);
+
+    if (p.pos < length) {
+        regex_error(&p, "unmatched )");
+    }
+
+    emit_inst(re, INST_SAVE, 0, 0);
+    compile_node(re, node);
+    emit_inst(re, INST_SAVE, 1, 0);
+    emit_inst(re, INST_MATCH, 0, 0);
+
+    // the program keeps the classes; the tree goes
+    int i;
+    for (i = 0; i < p.numnodes; i++) {
+        free(p.nodes[i]);
+    }
+
+    free(p.nodes);
+
+    init_dfa(&re->anchored, 0);
+    init_dfa(&re->floating, 1);
+
+    int numcaptures = 2 * re->numgroups;
+
+    init_thread_list(&re->lists[0], re->length, numcaptures);
+    init_thread_list(&re->lists[1], re->length, numcaptures);
+
+    re->captures = malloc(numcaptures * sizeof *re->captures);
+    re->stack = malloc(2 * re->length * sizeof *re->stack);
+    re->marks = calloc(re->length, sizeof *re->marks);
+    re->generation = 0;
+
+    if (!re->captures || !re->stack || !re->marks) {
+        fatal("Out of memory.");
+    }
+
+    return re;
+}
+
+void free_regex(Regex *re) {
+    int i;
+
+    // free each class once (repetition copies share them)
+    for (i = 0; i < re->length; i++) {
+        if (re->program[i].op == INST_CLASS) {
+            CharClass *class = re->program[i].class;
+
+            int j;
+            for (j = i; j < re->length; j++) {
+                if (re->program[j].op == INST_CLASS && re->program[j].class == class) {
+                    re->program[j].class = NULL;
+                }
+            }
+
+            if (class) {
+                free(class->ranges);
+                free(class);
+            }
+        }
+    }
+
+    Dfa *dfas[2] = { &re->anchored, &re->floating };
+
+    for (i = 0; i < 2; i++) {
+        int j;
+        for (j = 0; j < DFA_TABLE_SIZE; j++) {
+            while (dfas[i]->states[j]) {
+                DfaState *state = dfas[i]->states[j];
+                dfas[i]->states[j] = state->chain;
+
+                free(state->kernel);
+                free(state->closure);
+                free(state);
+            }
+        }
+
+        free(dfas[i]->states);
+    }
+
+    for (i = 0; i < 2; i++) {
+        free(re->lists[i].pcs);
+        free(re->lists[i].sparse);
+        free(re->lists[i].captures);
+    }
+
+    free(re->captures);
+    free(re->stack);
+    free(re->marks);
+    free(re->program);
+    free(re->pattern);
+    free(re);
+}
+
+/*
+ * Lazy DFA
+ */
+
+// collects the consuming and match instructions reachable from kernel
+int epsilon_closure(Regex *re, int *kernel, int numkernel, int atstart, int atend, int *out) {
+    int generation = ++re->generation;
+    int top = 0;
+    int n = 0;
+
+    int i;
+    for (i = numkernel - 1; i >= 0; i--) {
+        re->stack[top++] = kernel[i];
+    }
+
+    while (top > 0) {
+        int pc = re->stack[--top];
+
+        if (re->marks[pc] == generation) {
+            continue;
+        }
+
+        re->marks[pc] = generation;
+        Inst *inst = &re->program[pc];
+
+        switch (inst->op) {
+            case INST_JMP:
+                re->stack[top++] = inst->x;
+                break;
+
+            case INST_SPLIT:
+                re->stack[top++] = inst->y;
+                re->stack[top++] = inst->x;
+                break;
+
+            case INST_SAVE:
+                re->stack[top++] = pc + 1;
+                break;
+
+            case INST_BOL:
+                if (atstart) {
+                    re->stack[top++] = pc + 1;
+                }
+                break;
+
+            case INST_EOL:
+                if (atend) {
+                    re->stack[top++] = pc + 1;
+                }
+                break;
+
+            default:
+                out[n++] = pc;
+                break;
+        }
+    }
+
+    return n;
+}
+
+int has_match_inst(Regex *re, int *pcs, int n) {
+    int i;
+    for (i = 0; i < n; i++) {
+        if (re->program[pcs[i]].op == INST_MATCH) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int compare_pcs(const void *a, const void *b) {
+    return *(const int *) a - *(const int *) b;
+}
+
+unsigned int hash_kernel(int *kernel, int n, int start) {
+    unsigned int hash = 5381 + start;
+
+    int i;
+    for (i = 0; i < n; i++) {
+        hash = ((hash << 5) + hash) ^ (unsigned int) kernel[i];
+    }
+
+    return hash;
+}
+
+int *copy_pcs(int *ints, int n) {
+    int *copy = malloc((n ? n : 1) * sizeof *copy);
+
+    if (!copy) {
+        fatal("Out of memory.");
+    }
+
+    memcpy(copy, ints, n * sizeof *copy);
+    return copy;
+}
+
+// finds or creates the state for a sorted kernel; NULL if the DFA is full
+DfaState *dfa_state(Regex *re, Dfa *dfa, int *kernel, int n, int start) {
+    unsigned int hash = hash_kernel(kernel, n, start);
+    DfaState **bucket = &dfa->states[hash % DFA_TABLE_SIZE];
+
+    DfaState *state;
+    for (state = *bucket; state != NULL; state = state->chain) {
+        if (state->hash == hash && state->start == start && state->numkernel == n && memcmp(state->kernel, kernel, n * sizeof *kernel) == 0) {
+            return state;
+        }
+    }
+
+    if (dfa->numstates == MAX_DFA_STATES) {
+        re->nfaonly = 1;
+        return NULL;
+    }
+
+    state = malloc(sizeof *state);
+
+    if (!state) {
+        fatal("Out of memory.");
+    }
+
+    int *closure = malloc((re->length ? re->length : 1) * sizeof *closure);
+
+    if (!closure) {
+        fatal("Out of memory.");
+    }
+
+    state->kernel = copy_pcs(kernel, n);
+    state->numkernel = n;
+    state->start = start;
+    state->numclosure = epsilon_closure(re, kernel, n, start, 0, closure);
+    state->closure = copy_pcs(closure, state->numclosure);
+    state->accepting = has_match_inst(re, state->closure, state->numclosure);
+    state->acceptend = -1;
+    state->hash = hash;
+
+    free(closure);
+
+    int i;
+    for (i = 0; i < 128; i++) {
+        state->next[i] = NULL;
+    }
+
+    state->chain = *bucket;
+    *bucket = state;
+    dfa->numstates++;
+
+    return state;
+}
+
+DfaState *dfa_initial(Regex *re, Dfa *dfa) {
+    if (!dfa->initial) {
+        int start = 0;
+        dfa->initial = dfa_state(re, dfa, &start, 1, 1);
+    }
+
+    return dfa->initial;
+}
+
+DfaState *dfa_next(Regex *re, Dfa *dfa, DfaState *state, int c) {
+    if (c < 128 && state->next[c]) {
+        return state->next[c];
+    }
+
+    int *kernel = re->stack;
+    int n = 0;
+    int generation = ++re->generation;
+
+    if (dfa->floating) {
+        kernel[n++] = 0;
+        re->marks[0] = generation;
+    }
+
+    int i;
+    for (i = 0; i < state->numclosure; i++) {
+        int pc = state->closure[i];
+
+        if (inst_consumes(&re->program[pc], c) && re->marks[pc + 1] != generation) {
+            re->marks[pc + 1] = generation;
+            kernel[n++] = pc + 1;
+        }
+    }
+
+    qsort(kernel, n, sizeof *kernel, compare_pcs);
+
+    // dfa_state uses the stack and marks for the closure, so copy
+    int *copy = copy_pcs(kernel, n);
+    DfaState *next = dfa_state(re, dfa, copy, n, 0);
+    free(copy);
+
+    if (next && c < 128) {
+        state->next[c] = next;
+    }
+
+    return next;
+}
+
+int dfa_accepts_at_end(Regex *re, DfaState *state) {
+    if (state->acceptend == -1) {
+        int *closure = malloc((re->length ? re->length : 1) * sizeof *closure);
+
+        if (!closure) {
+            fatal("Out of memory.");
+        }
+
+        int n = epsilon_closure(re, state->kernel, state->numkernel, state->start, 1, closure);
+        state->acceptend = has_match_inst(re, closure, n);
+
+        free(closure);
+    }
+
+    return state->acceptend;
+}
+
+// 1 or 0, or -1 if the DFA gave up
+int dfa_run(Regex *re, Dfa *dfa, const char *s, int length) {
+    DfaState *state = dfa_initial(re, dfa);
+
+    int i = 0;
+    while (state && i < length) {
+        if (dfa->floating && state->accepting) {
+            return 1;
+        }
+
+        // no thread can advance (and none will start), so no match
+        if (state->numclosure == 0 && !dfa->floating) {
+            return 0;
+        }
+
+        int c = (unsigned char) s[i];
+
+        if (c < 128) {
+            i++;
+        } else {
+            i += decode_char(s, length, i, &c);
+        }
+
+        state = dfa_next(re, dfa, state, c);
+    }
+
+    if (!state) {
+        return -1;
+    }
+
+    return dfa_accepts_at_end(re, state);
+}
+
+/*
+ * Pike VM
+ */
+
+void add_thread(Regex *re, ThreadList *list, int pc, int *captures, int pos, int length) {
+    // a sparse set: membership needs no clearing between steps
+    if (list->sparse[pc] < list->count && list->pcs[list->sparse[pc]] == pc) {
+        return;
+    }
+
+    int numcaptures = 2 * re->numgroups;
+    int slot = list->count++;
+
+    list->sparse[pc] = slot;
+    list->pcs[slot] = pc;
+
+    Inst *inst = &re->program[pc];
+
+    switch (inst->op) {
+        case INST_JMP:
+            add_thread(re, list, inst->x, captures, pos, length);
+            break;
+
+        case INST_SPLIT:
+            add_thread(re, list, inst->x, captures, pos, length);
+            add_thread(re, list, inst->y, captures, pos, length);
+            break;
+
+        case INST_SAVE:
+        {
+            int old = captures[inst->x];
+            captures[inst->x] = pos;
+            add_thread(re, list, pc + 1, captures, pos, length);
+            captures[inst->x] = old;
+        } break;
+
+        case INST_BOL:
+            if (pos == 0) {
+                add_thread(re, list, pc + 1, captures, pos, length);
+            }
+            break;
+
+        case INST_EOL:
+            if (pos == length) {
+                add_thread(re, list, pc + 1, captures, pos, length);
+            }
+            break;
+
+        default:
+            memcpy(&list->captures[slot * numcaptures], captures, numcaptures * sizeof *captures);
+            break;
+    }
+}
+
+// leftmost-first match; fills re->captures with byte offsets
+int pike_run(Regex *re, const char *s, int length, int anchored, int full) {
+    int numcaptures = 2 * re->numgroups;
+
+    ThreadList *clist = &re->lists[0];
+    ThreadList *nlist = &re->lists[1];
+
+    clist->count = 0;
+
+    int matched = 0;
+    int pos = 0;
+    int n = 0;
+
+    int i;
+    for (;; pos += n) {
+        if (!matched && (!anchored || pos == 0)) {
+            for (i = 0; i < numcaptures; i++) {
+                re->captures[i] = -1;
+            }
+
+            add_thread(re, clist, 0, re->captures, pos, length);
+        }
+
+        if (clist->count == 0) {
+            break;
+        }
+
+        int c = 0;
+        n = pos < length ? decode_char(s, length, pos, &c) : 0;
+
+        nlist->count = 0;
+
+        for (i = 0; i < clist->count; i++) {
+            Inst *inst = &re->program[clist->pcs[i]];
+            int *captures = &clist->captures[i * numcaptures];
+
+            if (inst->op == INST_MATCH) {
+                if (full && pos != length) {
+                    continue;
+                }
+
+                matched = 1;
+                memcpy(re->captures, captures, numcaptures * sizeof *captures);
+
+                // lower priority threads lose
+                break;
+            }
+
+            if (pos < length && inst_consumes(inst, c)) {
+                add_thread(re, nlist, clist->pcs[i] + 1, captures, pos + n, length);
+            }
+        }
+
+        ThreadList *temp = clist;
+        clist = nlist;
+        nlist = temp;
+
+        if (pos >= length) {
+            break;
+        }
+    }
+
+    return matched;
+}
+
+/*
+ * Public interface
+ */
+
+int regex_groups(Regex *re) {
+    return re->numgroups;
+}
+
+int regex_match(Regex *re, const char *s, int length) {
+    if (!re->nfaonly) {
+        int result = dfa_run(re, &re->anchored, s, length);
+
+        if (result != -1) {
+            return result;
+        }
+    }
+
+    return pike_run(re, s, length, 1, 1);
+}
+
+int regex_search(Regex *re, const char *s, int length, int group, int *start, int *end) {
+    // the DFA rejects non-matching input without tracking positions
+    if (!re->nfaonly && dfa_run(re, &re->floating, s, length) == 0) {
+        return 0;
+    }
+
+    if (!pike_run(re, s, length, 0, 0)) {
+        return 0;
+    }
+
+    *start = re->captures[2 * group];
+    *end = re->captures[2 * group + 1];
+
+    return 1;
+}
+
+/*
+ * Constant patterns are interned strings, of which a program has only so
+ * many, so they are compiled once and cached for the life of the VM,
+ * keyed by their contents. Their hash is cached, so looking one up costs
+ * a bucket walk and a short memcmp. Any other pattern may be built anew
+ * each time, so only the last RECENT_REGEXES of those are kept, and the
+ * oldest is freed to make room. A pattern returned by lookup_regex is
+ * only valid until the next lookup.
+ */
+
+void init_regexes(VM *vm) {
+    vm->regexes = calloc(REGEX_TABLE_SIZE, sizeof *vm->regexes);
+    vm->recentregexes = calloc(RECENT_REGEXES, sizeof *vm->recentregexes);
+    vm->nextregex = 0;
+
+    if (!vm->regexes || !vm->recentregexes) {
+        fatal("Out of memory.");
+    }
+}
+
+void free_regexes(VM *vm) {
+    int i;
+    for (i = 0; i < REGEX_TABLE_SIZE; i++) {
+        while (vm->regexes[i]) {
+            Regex *temp = vm->regexes[i];
+            vm->regexes[i] = temp->next;
+            free_regex(temp);
+        }
+    }
+
+    for (i = 0; i < RECENT_REGEXES; i++) {
+        if (vm->recentregexes[i]) {
+            free_regex(vm->recentregexes[i]);
+        }
+    }
+
+    free(vm->regexes);
+    free(vm->recentregexes);
+}
+
+int same_pattern(Regex *re, const char *chars, int length, unsigned int hash) {
+    return re->hash == hash && re->patternlength == length && memcmp(re->pattern, chars, length) == 0;
+}
+
+Regex *lookup_regex(VM *vm, StringArg *pattern) {
+    const char *chars = arg_chars(pattern);
+    unsigned int hash;
+
+    if (pattern->object) {
+        hash = string_hash(as_string(pattern->object));
+    } else {
+        hash = hash_bytes(chars, pattern->length);
+        hash = hash ? hash : 1;
+    }
+
+    Regex *re;
+
+    if (!pattern->object || !is_interned(vm, pattern->object)) {
+        int i;
+        for (i = 0; i < RECENT_REGEXES; i++) {
+            re = vm->recentregexes[i];
+
+            if (re && same_pattern(re, chars, pattern->length, hash)) {
+                return re;
+            }
+        }
+
+        re = compile_regex(chars, pattern->length, hash);
+
+        if (vm->recentregexes[vm->nextregex]) {
+            free_regex(vm->recentregexes[vm->nextregex]);
+        }
+
+        vm->recentregexes[vm->nextregex] = re;
+        vm->nextregex = (vm->nextregex + 1) % RECENT_REGEXES;
+
+        return re;
+    }
+
+    Regex **bucket = &vm->regexes[hash % REGEX_TABLE_SIZE];
+
+    for (re = *bucket; re != NULL; re = re->next) {
+        if (same_pattern(re, chars, pattern->length, hash)) {
+            return re;
+        }
+    }
+
+    re = compile_regex(chars, pattern->length, hash);
+    re->next = *bucket;
+    *bucket = re;
+
+    return re;
+}
@@ -0,0 +1,154 @@
+/*
+ * Copyright (c) 2014, Eric Fritz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+ * BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <string.h>
+
+#include "search.h"
+
+/*
+ * Substring search
+ *
+ * Candidate positions are found by comparing the first and the last byte
+ * of the needle against a whole block of the haystack at once, and only
+ * positions where both match are checked with memcmp. The widest variant
+ * the processor supports is picked on first use; other platforms get the
+ * scalar loop.
+ */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SEARCH_SIMD
+#include <immintrin.h>
+#endif
+
+typedef int (*SearchFunction)(const char *, int, const char *, int);
+
+static int find_scalar(const char *haystack, int length, const char *needle, int needlelength, int start) {
+    int i;
+    for (i = start; i + needlelength <= length; i++) {
+        if (haystack[i] == needle[0] && memcmp(haystack + i, needle, needlelength) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static int find_generic(const char *haystack, int length, const char *needle, int needlelength) {
+    if (needlelength == 1) {
+        const char *p = memchr(haystack, needle[0], length);
+        return p ? p - haystack : -1;
+    }
+
+    return find_scalar(haystack, length, needle, needlelength, 0);
+}
+
+#ifdef SEARCH_SIMD
+
+__attribute__((target("sse2")))
+static int find_sse2(const char *haystack, int length, const char *needle, int needlelength) {
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[needlelength - 1]);
+
+    int i;
+    for (i = 0; i + needlelength + 15 <= length; i += 16) {
+        __m128i b1 = _mm_loadu_si128((const __m128i *) (haystack + i));
+        __m128i b2 = _mm_loadu_si128((const __m128i *) (haystack + i + needlelength - 1));
+
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(b1, first), _mm_cmpeq_epi8(b2, last)));
+
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+
+            if (memcmp(haystack + i + bit, needle, needlelength) == 0) {
+                return i + bit;
+            }
+
+            mask &= mask - 1;
+        }
+    }
+
+    return find_scalar(haystack, length, needle, needlelength, i);
+}
+
+__attribute__((target("avx2")))
+static int find_avx2(const char *haystack, int length, const char *needle, int needlelength) {
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[needlelength - 1]);
+
+    int i;
+    for (i = 0; i + needlelength + 31 <= length; i += 32) {
+        __m256i b1 = _mm256_loadu_si256((const __m256i *) (haystack + i));
+        __m256i b2 = _mm256_loadu_si256((const __m256i *) (haystack + i + needlelength - 1));
+
+        unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(b1, first), _mm256_cmpeq_epi8(b2, last)));
+
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+
+            if (memcmp(haystack + i + bit, needle, needlelength) == 0) {
+                return i + bit;
+            }
+
+            mask &= mask - 1;
+        }
+    }
+
+    return find_scalar(haystack, length, needle, needlelength, i);
+}
+
+#endif
+
+static SearchFunction select_search() {
+#ifdef SEARCH_SIMD
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2")) {
+        return find_avx2;
+    }
+
+    if (__builtin_cpu_supports("sse2")) {
+        return find_sse2;
+    }
+#endif
+
+    return find_generic;
+}
+
+/*
+ * Returns the byte offset of the first occurrence of needle in haystack,
+ * or -1. An empty needle is found at offset 0.
+ */
+
+int find_bytes(const char *haystack, int length, const char *needle, int needlelength) {
+    static SearchFunction search = NULL;
+
+    if (needlelength == 0) {
+        return 0;
+    }
+
+    if (needlelength > length) {
+        return -1;
+    }
+
+    if (!search) {
+        search = select_search();
+    }
+
+    return search(haystack, length, needle, needlelength);
+}
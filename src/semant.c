@@ -21,6 +21,7 @@
 #include <string.h>
 
 #include "chinnu.h"
+#include "builtin.h"
 
 typedef struct Contour Contour;
 typedef struct HashItem HashItem;
@@ -65,8 +66,12 @@ Scope *make_scope(Expression *expr) {
     scope->children = children;
     scope->numparams = 0;
     scope->numlocals = 0;
+    scope->numslots = 0;
     scope->numupvars = 0;
     scope->numchildren = 0;
+    scope->escapes = 1;
+    scope->pure = 0;
+    scope->upvartypes = NULL;
 
     return scope;
 }
@@ -75,6 +80,7 @@ void free_scope(Scope *scope) {
     free(scope->locals);
     free(scope->upvars);
     free(scope->children);
+    free(scope->upvartypes);
     free(scope);
 }
 
@@ -169,15 +175,21 @@ Symbol *make_symbol(char *name, int level, Expression *declaration) {
     symbol->level = level;
     symbol->name = strdup(name);
     symbol->declaration = declaration;
+    symbol->assigned = 0;
+    symbol->escapes = 0;
+    symbol->types = 0;
+    symbol->slot = 0;
+    symbol->captured = 0;
+    symbol->guarded = 0;
     return symbol;
 }
 
 // djb2 by Dan Bernstein
 int hash(char *str) {
-    int hash = 5381;
+    unsigned int hash = 5381;
     int c;
 
-    while ((c = *str++)) {
+    while ((c = (unsigned char) *str++)) {
         hash = ((hash << 5) + hash) ^ c;
     }
 
@@ -355,7 +367,9 @@ void resolve_expr(SymbolTable *table, Expression *expr) {
         {
             Symbol *symbol = find_symbol(table, expr->value.s);
 
-            if (!symbol) {
+            if (!symbol && find_builtin(expr->value.s) != -1) {
+                error(expr->pos, "Builtin '%s' can only be called directly.", expr->value.s);
+            } else if (!symbol) {
                 error(expr->pos, "Use of undeclared identifier '%s'.", expr->value.s);
 
                 // TODO - will cause error here when traversing tree
@@ -393,6 +407,30 @@ void resolve_expr(SymbolTable *table, Expression *expr) {
             break;
 
         case TYPE_CALL:
+            if (expr->lexpr->type == TYPE_VARREF && !find_symbol(table, expr->lexpr->value.s)) {
+                int id = find_builtin(expr->lexpr->value.s);
+
+                if (id != -1) {
+                    int numargs = 0;
+
+                    ExpressionNode *head;
+                    for (head = expr->llist->head; head != NULL; head = head->next) {
+                        numargs++;
+                    }
+
+                    if (numargs != builtin_arity[id]) {
+                        error(expr->pos, "Builtin '%s' expects %d arguments, got %d.", builtin_names[id], builtin_arity[id], numargs);
+                    }
+
+                    expr->type = TYPE_BUILTIN;
+
+                    enter_contour(table);
+                    resolve_list(table, expr->llist);
+                    leave_contour(table);
+                    break;
+                }
+            }
+
             resolve_expr(table, expr->lexpr);
 
             enter_contour(table);
@@ -400,6 +438,10 @@ void resolve_expr(SymbolTable *table, Expression *expr) {
             leave_contour(table);
             break;
 
+        case TYPE_BUILTIN:
+            /* only created by the call case above, once resolved */
+            break;
+
         /* binary cases */
         case TYPE_ASSIGN:
             resolve_expr(table, expr->lexpr);
@@ -410,6 +452,8 @@ void resolve_expr(SymbolTable *table, Expression *expr) {
                 message(expr->lexpr->symbol->declaration->pos, "Variable is defined here.");
             }
 
+            expr->lexpr->symbol->assigned = 1;
+
             break;
 
         case TYPE_ADD:
@@ -430,6 +474,10 @@ void resolve_expr(SymbolTable *table, Expression *expr) {
             resolve_expr(table, expr->rexpr);
             break;
 
+        case TYPE_INTERP:
+            resolve_list(table, expr->llist);
+            break;
+
         /* unary cases */
         case TYPE_NEG:
         case TYPE_NOT:
@@ -470,6 +518,221 @@ void resolve_list(SymbolTable *table, ExpressionList *list) {
     }
 }
 
+/*
+ * Calls to a function literal bound to a variable that is never assigned
+ * always reach that function, so their argument count is checked here
+ * rather than when they run. It is done once every assignment has been
+ * seen, as one may follow the call.
+ */
+
+// the function literal a variable that is never assigned is bound to
+Expression *symbol_function(Symbol *symbol) {
+    if (symbol->assigned) {
+        return NULL;
+    }
+
+    Expression *decl = symbol->declaration;
+
+    if (decl->type == TYPE_DECLARATION) {
+        decl = decl->rexpr;
+    }
+
+    if (!decl || decl->type != TYPE_FUNC) {
+        return NULL;
+    }
+
+    return decl;
+}
+
+Expression *called_function(Expression *expr) {
+    if (expr->lexpr->type != TYPE_VARREF || !expr->lexpr->symbol) {
+        return NULL;
+    }
+
+    return symbol_function(expr->lexpr->symbol);
+}
+
+/* forward */
+void check_calls(Expression *expr);
+
+void check_list_calls(ExpressionList *list) {
+    if (list) {
+        ExpressionNode *head;
+        for (head = list->head; head != NULL; head = head->next) {
+            check_calls(head->expr);
+        }
+    }
+}
+
+void check_calls(Expression *expr) {
+    if (!expr) {
+        return;
+    }
+
+    if (expr->type == TYPE_CALL) {
+        Expression *func = called_function(expr);
+
+        if (func) {
+            int numargs = 0;
+
+            ExpressionNode *head;
+            for (head = expr->llist->head; head != NULL; head = head->next) {
+                numargs++;
+            }
+
+            if (numargs != func->scope->numparams) {
+                error(expr->pos, "Function '%s' expects %d arguments, got %d.", expr->lexpr->value.s, func->scope->numparams, numargs);
+                message(func->pos, "Function is defined here.");
+            }
+        }
+    }
+
+    check_calls(expr->cond);
+    check_calls(expr->lexpr);
+    check_calls(expr->rexpr);
+    check_list_calls(expr->llist);
+    check_list_calls(expr->rlist);
+}
+
+/*
+ * A function is pure if a call depends only on its arguments and has no
+ * effect, though it may still fail: it assigns no upvar, throws nothing,
+ * calls only pure functions, and its upvars are all bound to pure
+ * functions. Builtins are pure. The analysis starts by assuming every
+ * function pure, so that recursive ones can be, and clears the flag
+ * until nothing changes. It is run on the tree as it is when the result
+ * is needed (see evaluate.c).
+ */
+
+/* forward */
+int has_effects(Expression *expr, Scope *scope);
+
+int list_has_effects(ExpressionList *list, Scope *scope) {
+    if (list) {
+        ExpressionNode *head;
+        for (head = list->head; head != NULL; head = head->next) {
+            if (has_effects(head->expr, scope)) {
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Returns non-zero if evaluating expr, part of the body of the function
+ * with the scope, could have an effect. Creating a closure has none; its
+ * body is only evaluated by calling it.
+ */
+int has_effects(Expression *expr, Scope *scope) {
+    if (!expr) {
+        return 0;
+    }
+
+    switch (expr->type) {
+        case TYPE_FUNC:
+            return 0;
+
+        case TYPE_THROW:
+            return 1;
+
+        case TYPE_ASSIGN:
+            if (local_index(scope, expr->lexpr->symbol) == -1) {
+                return 1;
+            }
+            break;
+
+        case TYPE_CALL:
+        {
+            Expression *func = called_function(expr);
+
+            if (!func || !func->scope->pure) {
+                return 1;
+            }
+        } break;
+
+        default:
+            break;
+    }
+
+    return has_effects(expr->cond, scope)
+        || has_effects(expr->lexpr, scope)
+        || has_effects(expr->rexpr, scope)
+        || list_has_effects(expr->llist, scope)
+        || list_has_effects(expr->rlist, scope);
+}
+
+int is_pure_function(Expression *func) {
+    if (has_effects(func->rexpr, func->scope)) {
+        return 0;
+    }
+
+    int i;
+    for (i = 0; i < func->scope->numupvars; i++) {
+        Expression *upvar = symbol_function(func->scope->upvars[i]);
+
+        if (!upvar || !upvar->scope->pure) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* forward */
+int clear_impure(Expression *expr, int assume);
+
+int clear_list_impure(ExpressionList *list, int assume) {
+    int count = 0;
+
+    if (list) {
+        ExpressionNode *head;
+        for (head = list->head; head != NULL; head = head->next) {
+            count += clear_impure(head->expr, assume);
+        }
+    }
+
+    return count;
+}
+
+/*
+ * Returns the number of functions found impure, after marking every
+ * function pure first if assume is set.
+ */
+int clear_impure(Expression *expr, int assume) {
+    if (!expr) {
+        return 0;
+    }
+
+    int count = 0;
+
+    if (expr->type == TYPE_FUNC) {
+        if (assume) {
+            expr->scope->pure = 1;
+        } else if (expr->scope->pure && !is_pure_function(expr)) {
+            expr->scope->pure = 0;
+            count++;
+        }
+    }
+
+    return count
+        + clear_impure(expr->cond, assume)
+        + clear_impure(expr->lexpr, assume)
+        + clear_impure(expr->rexpr, assume)
+        + clear_list_impure(expr->llist, assume)
+        + clear_list_impure(expr->rlist, assume);
+}
+
+void find_pure_functions(Expression *expr) {
+    clear_impure(expr, 1);
+
+    int changed = 1;
+    while (changed) {
+        changed = clear_impure(expr, 0);
+    }
+}
+
 void resolve(Expression *expr) {
     SymbolTable *table = malloc(sizeof *table);
 
@@ -489,4 +752,6 @@ void resolve(Expression *expr) {
     leave_contour(table);
 
     free(table);
+
+    check_calls(expr);
 }
@@ -25,6 +25,21 @@ struct Symbol {
     int level;
     char *name;
     Expression *declaration;
+
+    // set if the variable is the target of any assignment
+    int assigned;
+
+    // set by escape analysis if the value may be used other than by
+    // calling it from the declaring function
+    int escapes;
+
+    // set by type inference to every type stored in the variable
+    int types;
+
+    // set by the register allocator
+    int slot;
+    int captured;
+    int guarded;
 };
 
 struct Scope {
@@ -35,11 +50,33 @@ struct Scope {
     Scope **children;
 
     int numlocals;
+    int numslots;
     int numparams;
     int numupvars;
     int numchildren;
+
+    // cleared by escape analysis if the closure never outlives its frame
+    int escapes;
+
+    // set by find_pure_functions if a call depends only on the arguments
+    // and has no effect
+    int pure;
+
+    // set by type inference to the types each upvar may hold
+    int *upvartypes;
 };
 
+Symbol *make_symbol(char *name, int level, Expression *declaration);
+
+int add_local(Scope *scope, Symbol *local);
+int local_index(Scope *scope, Symbol *symbol);
+int upvar_index(Scope *scope, Symbol *symbol);
+int register_upvar(Scope *scope, Symbol *symbol);
+
 void free_scope(Scope *scope);
 
+Expression *symbol_function(Symbol *symbol);
+Expression *called_function(Expression *expr);
+void find_pure_functions(Expression *expr);
+
 void resolve(Expression *expr);
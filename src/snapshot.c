@@ -0,0 +1,385 @@
+/*
+ * Copyright (c) 2014, Eric Fritz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+ * BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "chinnu.h"
+#include "snapshot.h"
+
+typedef struct SnapshotObject SnapshotObject;
+typedef struct SnapshotEdge SnapshotEdge;
+typedef struct SnapshotGroup SnapshotGroup;
+typedef struct Snapshot Snapshot;
+
+struct SnapshotObject {
+    unsigned long id;
+    unsigned long size;
+    char *label;
+    char *root;
+
+    int parent;
+    int edges;
+    int reached;
+};
+
+struct SnapshotEdge {
+    int from;
+    int to;
+    int next;
+};
+
+struct SnapshotGroup {
+    char *key;
+    int count;
+    unsigned long bytes;
+};
+
+struct Snapshot {
+    SnapshotObject *objects;
+    SnapshotEdge *edges;
+    int *table;
+
+    int numobjects;
+    int numedges;
+    int tablesize;
+};
+
+#define OBJECT_CHUNK_SIZE 64
+#define EDGE_CHUNK_SIZE 64
+#define GROUP_CHUNK_SIZE 16
+#define MAX_PATH_DEPTH 8
+
+/*
+ * Objects are looked up by id while reading edges, so keep an open
+ * addressing table from id to index alongside the object array.
+ */
+
+int lookup_object(Snapshot *snapshot, unsigned long id) {
+    int i = (id >> 4) & (snapshot->tablesize - 1);
+
+    while (snapshot->table[i] != -1) {
+        if (snapshot->objects[snapshot->table[i]].id == id) {
+            return snapshot->table[i];
+        }
+
+        i = (i + 1) & (snapshot->tablesize - 1);
+    }
+
+    return -1;
+}
+
+void insert_object(Snapshot *snapshot, int index) {
+    int i = (snapshot->objects[index].id >> 4) & (snapshot->tablesize - 1);
+
+    while (snapshot->table[i] != -1) {
+        i = (i + 1) & (snapshot->tablesize - 1);
+    }
+
+    snapshot->table[i] = index;
+}
+
+void rehash(Snapshot *snapshot) {
+    free(snapshot->table);
+
+    snapshot->tablesize = snapshot->tablesize ? snapshot->tablesize * 2 : 256;
+    snapshot->table = malloc(snapshot->tablesize * sizeof *snapshot->table);
+
+    if (!snapshot->table) {
+        fatal("Out of memory.");
+    }
+
+    int i;
+    for (i = 0; i < snapshot->tablesize; i++) {
+        snapshot->table[i] = -1;
+    }
+
+    for (i = 0; i < snapshot->numobjects; i++) {
+        insert_object(snapshot, i);
+    }
+}
+
+void add_snapshot_object(Snapshot *snapshot, unsigned long id, unsigned long size, char *label) {
+    if (snapshot->numobjects % OBJECT_CHUNK_SIZE == 0) {
+        SnapshotObject *resize = realloc(snapshot->objects, (snapshot->numobjects + OBJECT_CHUNK_SIZE) * sizeof *resize);
+
+        if (!resize) {
+            fatal("Out of memory.");
+        }
+
+        snapshot->objects = resize;
+    }
+
+    SnapshotObject *obj = &snapshot->objects[snapshot->numobjects++];
+
+    obj->id = id;
+    obj->size = size;
+    obj->label = strdup(label);
+    obj->root = NULL;
+    obj->parent = -1;
+    obj->edges = -1;
+    obj->reached = 0;
+
+    if (snapshot->numobjects * 2 > snapshot->tablesize) {
+        rehash(snapshot);
+    } else {
+        insert_object(snapshot, snapshot->numobjects - 1);
+    }
+}
+
+void add_snapshot_edge(Snapshot *snapshot, int from, int to) {
+    if (snapshot->numedges % EDGE_CHUNK_SIZE == 0) {
+        SnapshotEdge *resize = realloc(snapshot->edges, (snapshot->numedges + EDGE_CHUNK_SIZE) * sizeof *resize);
+
+        if (!resize) {
+            fatal("Out of memory.");
+        }
+
+        snapshot->edges = resize;
+    }
+
+    SnapshotEdge *edge = &snapshot->edges[snapshot->numedges];
+
+    edge->from = from;
+    edge->to = to;
+    edge->next = snapshot->objects[from].edges;
+    snapshot->objects[from].edges = snapshot->numedges++;
+}
+
+void clear_snapshot(Snapshot *snapshot) {
+    int i;
+    for (i = 0; i < snapshot->numobjects; i++) {
+        free(snapshot->objects[i].label);
+        free(snapshot->objects[i].root);
+    }
+
+    free(snapshot->objects);
+    free(snapshot->edges);
+    free(snapshot->table);
+
+    snapshot->objects = NULL;
+    snapshot->edges = NULL;
+    snapshot->table = NULL;
+    snapshot->numobjects = 0;
+    snapshot->numedges = 0;
+    snapshot->tablesize = 0;
+}
+
+/*
+ * Breadth-first walk from the roots so that every reachable object
+ * remembers the retainer it was first discovered through; this gives
+ * the shortest retainer path for each object.
+ */
+
+void find_retainers(Snapshot *snapshot) {
+    int *queue = malloc((snapshot->numobjects + 1) * sizeof *queue);
+
+    if (!queue) {
+        fatal("Out of memory.");
+    }
+
+    int head = 0;
+    int tail = 0;
+
+    int i;
+    for (i = 0; i < snapshot->numobjects; i++) {
+        if (snapshot->objects[i].root) {
+            snapshot->objects[i].reached = 1;
+            queue[tail++] = i;
+        }
+    }
+
+    while (head < tail) {
+        int from = queue[head++];
+
+        int e;
+        for (e = snapshot->objects[from].edges; e != -1; e = snapshot->edges[e].next) {
+            SnapshotObject *to = &snapshot->objects[snapshot->edges[e].to];
+
+            if (!to->reached) {
+                to->reached = 1;
+                to->parent = from;
+                queue[tail++] = snapshot->edges[e].to;
+            }
+        }
+    }
+
+    free(queue);
+}
+
+void retainer_path(Snapshot *snapshot, int index, char *buffer, int length, int depth) {
+    SnapshotObject *obj = &snapshot->objects[index];
+
+    if (!obj->reached) {
+        snprintf(buffer, length, "<unreachable> > %s", obj->label);
+    } else if (obj->parent == -1) {
+        snprintf(buffer, length, "%s > %s", obj->root, obj->label);
+    } else if (depth == MAX_PATH_DEPTH) {
+        snprintf(buffer, length, "... > %s", obj->label);
+    } else {
+        retainer_path(snapshot, obj->parent, buffer, length, depth + 1);
+
+        int n = strlen(buffer);
+        snprintf(buffer + n, length - n, " > %s", obj->label);
+    }
+}
+
+void add_to_group(SnapshotGroup **groups, int *numgroups, char *key, unsigned long bytes) {
+    int i;
+    for (i = 0; i < *numgroups; i++) {
+        if (strcmp((*groups)[i].key, key) == 0) {
+            (*groups)[i].count++;
+            (*groups)[i].bytes += bytes;
+            return;
+        }
+    }
+
+    if (*numgroups % GROUP_CHUNK_SIZE == 0) {
+        SnapshotGroup *resize = realloc(*groups, (*numgroups + GROUP_CHUNK_SIZE) * sizeof *resize);
+
+        if (!resize) {
+            fatal("Out of memory.");
+        }
+
+        *groups = resize;
+    }
+
+    (*groups)[*numgroups].key = strdup(key);
+    (*groups)[*numgroups].count = 1;
+    (*groups)[*numgroups].bytes = bytes;
+    (*numgroups)++;
+}
+
+int compare_groups(const void *a, const void *b) {
+    const SnapshotGroup *g1 = a;
+    const SnapshotGroup *g2 = b;
+
+    if (g1->bytes != g2->bytes) {
+        return g1->bytes < g2->bytes ? 1 : -1;
+    }
+
+    return g2->count - g1->count;
+}
+
+void print_groups(const char *title, SnapshotGroup *groups, int numgroups) {
+    qsort(groups, numgroups, sizeof *groups, compare_groups);
+
+    printf("  %s:\n", title);
+    printf("    %8s %10s\n", "count", "bytes");
+
+    int i;
+    for (i = 0; i < numgroups; i++) {
+        printf("    %8d %10lu  %s\n", groups[i].count, groups[i].bytes, groups[i].key);
+        free(groups[i].key);
+    }
+
+    free(groups);
+}
+
+void print_snapshot(Snapshot *snapshot, int seq, char *reason) {
+    find_retainers(snapshot);
+
+    SnapshotGroup *types = NULL;
+    SnapshotGroup *paths = NULL;
+    int numtypes = 0;
+    int numpaths = 0;
+
+    unsigned long total = 0;
+
+    int i;
+    for (i = 0; i < snapshot->numobjects; i++) {
+        char path[1024];
+        retainer_path(snapshot, i, path, sizeof path, 0);
+
+        add_to_group(&types, &numtypes, snapshot->objects[i].label, snapshot->objects[i].size);
+        add_to_group(&paths, &numpaths, path, snapshot->objects[i].size);
+
+        total += snapshot->objects[i].size;
+    }
+
+    printf("Snapshot %d (%s): %d objects, %lu bytes\n", seq, reason, snapshot->numobjects, total);
+    print_groups("By type", types, numtypes);
+    print_groups("By retainer path", paths, numpaths);
+    printf("\n");
+}
+
+void summarize_snapshot(char *filename) {
+    FILE *fp = fopen(filename, "r");
+
+    if (!fp) {
+        fatal("Could not open heap snapshot file.");
+    }
+
+    Snapshot snapshot = { NULL, NULL, NULL, 0, 0, 0 };
+    rehash(&snapshot);
+
+    int seq = 0;
+    char reason[64] = "";
+
+    char *line = NULL;
+    size_t len = 0;
+
+    while (getline(&line, &len, fp) != -1) {
+        unsigned long id, to, size;
+        char type[64], chunk[256], owner[64];
+        int depth, reg;
+
+        if (sscanf(line, "snapshot %d %63s", &seq, reason) == 2) {
+            clear_snapshot(&snapshot);
+            rehash(&snapshot);
+        } else if (sscanf(line, "object %lx %63s %lu %255s %63s", &id, type, &size, chunk, owner) == 5) {
+            char label[416];
+            snprintf(label, sizeof label, "%s %s %s", type, chunk, owner);
+            add_snapshot_object(&snapshot, id, size, label);
+        } else if (sscanf(line, "object %lx %63s %lu %255s", &id, type, &size, chunk) == 4) {
+            char label[384];
+            snprintf(label, sizeof label, "%s %s", type, chunk);
+            add_snapshot_object(&snapshot, id, size, label);
+        } else if (sscanf(line, "object %lx %63s %lu", &id, type, &size) == 3) {
+            add_snapshot_object(&snapshot, id, size, type);
+        } else if (sscanf(line, "root %lx register %255s %d %d", &id, chunk, &depth, &reg) == 4) {
+            int index = lookup_object(&snapshot, id);
+
+            if (index != -1 && !snapshot.objects[index].root) {
+                char label[384];
+                snprintf(label, sizeof label, "register %s", chunk);
+                snapshot.objects[index].root = strdup(label);
+            }
+        } else if (sscanf(line, "root %lx %63s", &id, type) == 2) {
+            int index = lookup_object(&snapshot, id);
+
+            if (index != -1 && !snapshot.objects[index].root) {
+                snapshot.objects[index].root = strdup(type);
+            }
+        } else if (sscanf(line, "edge %lx %lx", &id, &to) == 2) {
+            int from = lookup_object(&snapshot, id);
+            int index = lookup_object(&snapshot, to);
+
+            if (from != -1 && index != -1) {
+                add_snapshot_edge(&snapshot, from, index);
+            }
+        } else if (strncmp(line, "end", 3) == 0) {
+            print_snapshot(&snapshot, seq, reason);
+        }
+    }
+
+    free(line);
+    fclose(fp);
+    clear_snapshot(&snapshot);
+}
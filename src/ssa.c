@@ -0,0 +1,1590 @@
+/*
+ * Copyright (c) 2014, Eric Fritz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+ * BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "chinnu.h"
+#include "ssa.h"
+#include "bytecode.h"
+#include "typeinfer.h"
+
+/*
+ * SSA form
+ *
+ * Run over each chunk with -o, ahead of the peephole passes. The chunk is
+ * split into basic blocks and every register write is given a value of
+ * its own, with a phi where writes arriving along different paths meet.
+ * The instructions stay in register form: the values only name what each
+ * register holds at each point, so a pass may replace or move code as
+ * long as the registers it reads still hold the same values there. A
+ * value that needs a home of its own gets a fresh register above the
+ * chunk's temporaries. Lowering back to a chunk lays the blocks out in
+ * their original order and recomputes the jump offsets.
+ *
+ * Two passes run over it. Loop-invariant code motion moves instructions
+ * whose operands do not change inside a loop into the block that enters
+ * the loop. Value numbering walks the dominator tree, replacing each
+ * instruction that recomputes a value some register already holds with
+ * a move, and reading each copied value from its original register so
+ * that the copies become dead.
+ *
+ * Registers captured by a closure may change in any call, so reading one
+ * never yields a known value. Chunks with try blocks are left alone, as
+ * any instruction in them may branch to a handler.
+ */
+
+#define NUM_REGISTERS 256
+
+#define CODE_CHUNK_SIZE 8
+
+typedef struct {
+    OpCode op;
+    int a;
+    int b;
+    int c;
+
+    int target;         // block a jump goes to, or -1
+    int upvar;          // an upvar descriptor following a CLOSURE
+
+    int vb;             // values read from B and C, or -1
+    int vc;
+    int def;            // value written to A, or -1
+} Instruction;
+
+typedef struct {
+    Instruction *code;
+    int length;
+
+    int succs[2];
+    int numsuccs;
+    int *preds;
+    int numpreds;
+
+    int rpo;            // position in reverse postorder, or -1 if unreachable
+    int idom;
+    int *children;      // in the dominator tree
+    int numchildren;
+    int *frontier;
+    int numfrontier;
+
+    int *phis;          // the phi value of each register, or -1
+} Block;
+
+typedef struct {
+    int block;          // defining block, or -1 for a value held on entry
+    int index;          // defining instruction, or -1 for a phi
+    int *args;          // incoming values of a phi, by predecessor
+
+    int type;
+    int hoisted;        // register holding it in a loop preheader, or -1
+} Value;
+
+typedef struct {
+    Chunk *chunk;
+    Block *blocks;
+    int numblocks;
+    int *order;         // reachable blocks in reverse postorder
+    int numreachable;
+
+    Value *values;
+    int numvalues;
+
+    int numregs;        // including fresh registers
+    int captured[NUM_REGISTERS];
+} Graph;
+
+/*
+ * Operands of each instruction.
+ */
+
+int ssa_writes_a(Instruction *inst) {
+    if (inst->upvar) {
+        return 0;
+    }
+
+    switch (generic_opcode(inst->op)) {
+        case OP_SETUPVAR:
+        case OP_RETURN:
+        case OP_TEST_EQ:
+        case OP_TEST_LT:
+        case OP_TEST_LE:
+        case OP_JUMP:
+        case OP_JUMP_TRUE:
+        case OP_JUMP_FALSE:
+        case OP_THROW:
+        case OP_ENTER_TRY:
+        case OP_LEAVE_TRY:
+            return 0;
+
+        default:
+            return 1;
+    }
+}
+
+// a register read from A, which may be replaced by another register
+int ssa_reads_a(Instruction *inst) {
+    if (inst->upvar) {
+        return 0;
+    }
+
+    switch (generic_opcode(inst->op)) {
+        case OP_SETUPVAR:
+        case OP_JUMP_TRUE:
+        case OP_JUMP_FALSE:
+        case OP_THROW:
+            return 1;
+
+        default:
+            return 0;
+    }
+}
+
+// 2 if B and C are register-or-constant operands, 1 if only B is, and 0
+// if neither is
+int ssa_rk_operands(Instruction *inst) {
+    if (inst->upvar) {
+        return 0;
+    }
+
+    switch (generic_opcode(inst->op)) {
+        case OP_MOVE:
+        case OP_NEG:
+            return 1;
+
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_MOD:
+        case OP_POW:
+        case OP_EQ:
+        case OP_NE:
+        case OP_LT:
+        case OP_LE:
+        case OP_TEST_EQ:
+        case OP_TEST_LT:
+        case OP_TEST_LE:
+            return 2;
+
+        default:
+            return 0;
+    }
+}
+
+// a register read from B which must stay a register; a dynamic call's
+// receiver is not one, as the arguments follow it
+int ssa_reads_b_register(Instruction *inst) {
+    return !inst->upvar && (inst->op == OP_CALL_DIRECT || inst->op == OP_RETURN);
+}
+
+// instructions computing a value from their operands alone
+int is_pure_op(OpCode op) {
+    switch (generic_opcode(op)) {
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_MOD:
+        case OP_POW:
+        case OP_NEG:
+        case OP_EQ:
+        case OP_NE:
+        case OP_LT:
+        case OP_LE:
+            return 1;
+
+        default:
+            return 0;
+    }
+}
+
+int ssa_is_jump(OpCode op) {
+    op = generic_opcode(op);
+    return op == OP_JUMP || op == OP_JUMP_TRUE || op == OP_JUMP_FALSE;
+}
+
+int ssa_is_test(OpCode op) {
+    op = generic_opcode(op);
+    return op == OP_TEST_EQ || op == OP_TEST_LT || op == OP_TEST_LE;
+}
+
+/*
+ * Building the graph
+ */
+
+void add_block_instruction(Block *block, int index, Instruction *inst) {
+    if (block->length % CODE_CHUNK_SIZE == 0) {
+        Instruction *resize = realloc(block->code, (block->length + CODE_CHUNK_SIZE) * sizeof *resize);
+
+        if (!resize) {
+            fatal("Out of memory.");
+        }
+
+        block->code = resize;
+    }
+
+    memmove(&block->code[index + 1], &block->code[index], (block->length - index) * sizeof *block->code);
+    block->code[index] = *inst;
+    block->length++;
+}
+
+void add_int_to_list(int **list, int *length, int value) {
+    int *resize = realloc(*list, (*length + 1) * sizeof *resize);
+
+    if (!resize) {
+        fatal("Out of memory.");
+    }
+
+    *list = resize;
+    (*list)[(*length)++] = value;
+}
+
+int add_value(Graph *g, int block, int index) {
+    if (g->numvalues % CODE_CHUNK_SIZE == 0) {
+        Value *resize = realloc(g->values, (g->numvalues + CODE_CHUNK_SIZE) * sizeof *resize);
+
+        if (!resize) {
+            fatal("Out of memory.");
+        }
+
+        g->values = resize;
+    }
+
+    Value *v = &g->values[g->numvalues];
+    v->block = block;
+    v->index = index;
+    v->args = NULL;
+    v->type = 0;
+    v->hoisted = -1;
+
+    return g->numvalues++;
+}
+
+int fresh_register(Graph *g) {
+    return g->numregs < NUM_REGISTERS ? g->numregs++ : -1;
+}
+
+// splits the chunk into blocks; the last block is empty and stands for
+// the end of the chunk
+void split_blocks(Graph *g) {
+    Chunk *chunk = g->chunk;
+    int n = chunk->numinstructions;
+
+    int *leader = calloc(n + 1, sizeof *leader);
+    int *blockof = malloc((n + 1) * sizeof *blockof);
+
+    if (!leader || !blockof) {
+        fatal("Out of memory.");
+    }
+
+    leader[0] = 1;
+    leader[n] = 1;
+
+    int i;
+    for (i = 0; i < n; i++) {
+        int instruction = chunk->instructions[i];
+        OpCode op = GET_O(instruction);
+
+        if (ssa_is_jump(op)) {
+            int b = GET_B(instruction);
+            leader[i + 1 + (GET_C(instruction) ? -b : b)] = 1;
+        }
+
+        if (ssa_is_jump(op) || ssa_is_test(op) || op == OP_RETURN || op == OP_THROW) {
+            leader[i + 1] = 1;
+        }
+    }
+
+    g->numblocks = 0;
+    for (i = 0; i <= n; i++) {
+        if (leader[i]) {
+            g->numblocks++;
+        }
+
+        blockof[i] = g->numblocks - 1;
+    }
+
+    g->blocks = calloc(g->numblocks, sizeof *g->blocks);
+
+    if (!g->blocks) {
+        fatal("Out of memory.");
+    }
+
+    for (i = 0; i < n; i++) {
+        int instruction = chunk->instructions[i];
+        Block *block = &g->blocks[blockof[i]];
+
+        Instruction inst;
+        inst.op = GET_O(instruction);
+        inst.a = GET_A(instruction);
+        inst.b = GET_B(instruction);
+        inst.c = GET_C(instruction);
+        inst.target = -1;
+        inst.upvar = 0;
+        inst.vb = -1;
+        inst.vc = -1;
+        inst.def = -1;
+
+        if (ssa_is_jump(inst.op)) {
+            inst.target = blockof[i + 1 + (inst.c ? -inst.b : inst.b)];
+        }
+
+        add_block_instruction(block, block->length, &inst);
+    }
+
+    // upvar descriptors, and the registers they capture
+    for (i = 0; i < g->numblocks; i++) {
+        Block *block = &g->blocks[i];
+
+        int j;
+        for (j = 0; j < block->length; j++) {
+            if (block->code[j].op == OP_CLOSURE) {
+                int k;
+                for (k = 0; k < chunk->children[block->code[j].b]->numupvars; k++) {
+                    Instruction *inst = &block->code[j + k + 1];
+                    inst->upvar = 1;
+
+                    if (inst->op == OP_MOVE) {
+                        g->captured[inst->b] = 1;
+                    }
+                }
+
+                j += k;
+            }
+        }
+    }
+
+    for (i = 0; i < g->numblocks; i++) {
+        Block *block = &g->blocks[i];
+        Instruction *last = block->length > 0 ? &block->code[block->length - 1] : NULL;
+
+        block->numsuccs = 0;
+
+        if (last && last->target != -1) {
+            block->succs[block->numsuccs++] = last->target;
+        }
+
+        if (i + 1 < g->numblocks && (!last || (last->op != OP_JUMP && last->op != OP_RETURN && last->op != OP_THROW))) {
+            block->succs[block->numsuccs++] = i + 1;
+        }
+
+        // a test either runs the jump after it or skips it
+        if (last && ssa_is_test(last->op)) {
+            block->succs[block->numsuccs++] = i + 2;
+        }
+
+        block->phis = malloc(NUM_REGISTERS * sizeof *block->phis);
+
+        if (!block->phis) {
+            fatal("Out of memory.");
+        }
+
+        int r;
+        for (r = 0; r < NUM_REGISTERS; r++) {
+            block->phis[r] = -1;
+        }
+    }
+
+    for (i = 0; i < g->numblocks; i++) {
+        int j;
+        for (j = 0; j < g->blocks[i].numsuccs; j++) {
+            Block *succ = &g->blocks[g->blocks[i].succs[j]];
+            add_int_to_list(&succ->preds, &succ->numpreds, i);
+        }
+    }
+
+    free(leader);
+    free(blockof);
+}
+
+void number_blocks(Graph *g, int b, int *visited, int *post, int *count) {
+    visited[b] = 1;
+
+    int i;
+    for (i = 0; i < g->blocks[b].numsuccs; i++) {
+        if (!visited[g->blocks[b].succs[i]]) {
+            number_blocks(g, g->blocks[b].succs[i], visited, post, count);
+        }
+    }
+
+    post[(*count)++] = b;
+}
+
+int intersect_dominators(Graph *g, int b1, int b2) {
+    while (b1 != b2) {
+        while (g->blocks[b1].rpo > g->blocks[b2].rpo) {
+            b1 = g->blocks[b1].idom;
+        }
+
+        while (g->blocks[b2].rpo > g->blocks[b1].rpo) {
+            b2 = g->blocks[b2].idom;
+        }
+    }
+
+    return b1;
+}
+
+// dominators by the iterative algorithm of Cooper, Harvey and Kennedy
+void compute_dominators(Graph *g) {
+    int *visited = calloc(g->numblocks, sizeof *visited);
+    int *post = malloc(g->numblocks * sizeof *post);
+    g->order = malloc(g->numblocks * sizeof *g->order);
+
+    if (!visited || !post || !g->order) {
+        fatal("Out of memory.");
+    }
+
+    int count = 0;
+    number_blocks(g, 0, visited, post, &count);
+
+    int i;
+    for (i = 0; i < g->numblocks; i++) {
+        g->blocks[i].rpo = -1;
+        g->blocks[i].idom = -1;
+    }
+
+    for (i = 0; i < count; i++) {
+        g->order[i] = post[count - i - 1];
+        g->blocks[g->order[i]].rpo = i;
+    }
+
+    g->numreachable = count;
+    g->blocks[0].idom = 0;
+
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+
+        for (i = 1; i < count; i++) {
+            Block *block = &g->blocks[g->order[i]];
+            int idom = -1;
+
+            int j;
+            for (j = 0; j < block->numpreds; j++) {
+                int p = block->preds[j];
+
+                if (g->blocks[p].idom != -1) {
+                    idom = idom == -1 ? p : intersect_dominators(g, p, idom);
+                }
+            }
+
+            if (block->idom != idom) {
+                block->idom = idom;
+                changed = 1;
+            }
+        }
+    }
+
+    for (i = 1; i < count; i++) {
+        Block *block = &g->blocks[g->order[i]];
+        add_int_to_list(&g->blocks[block->idom].children, &g->blocks[block->idom].numchildren, g->order[i]);
+    }
+
+    // dominance frontiers
+    for (i = 0; i < count; i++) {
+        int b = g->order[i];
+        Block *block = &g->blocks[b];
+
+        if (block->numpreds < 2) {
+            continue;
+        }
+
+        int j;
+        for (j = 0; j < block->numpreds; j++) {
+            int runner = block->preds[j];
+
+            if (g->blocks[runner].rpo == -1) {
+                continue;
+            }
+
+            while (runner != block->idom) {
+                Block *r = &g->blocks[runner];
+
+                if (r->numfrontier == 0 || r->frontier[r->numfrontier - 1] != b) {
+                    add_int_to_list(&r->frontier, &r->numfrontier, b);
+                }
+
+                runner = r->idom;
+            }
+        }
+    }
+
+    free(visited);
+    free(post);
+}
+
+int dominates(Graph *g, int b1, int b2) {
+    while (b2 != b1 && b2 != 0) {
+        b2 = g->blocks[b2].idom;
+    }
+
+    return b1 == b2;
+}
+
+// places a phi for a register wherever definitions of it meet
+void place_phis(Graph *g) {
+    int *work = malloc(g->numblocks * sizeof *work);
+    int *queued = malloc(g->numblocks * sizeof *queued);
+
+    if (!work || !queued) {
+        fatal("Out of memory.");
+    }
+
+    int r;
+    for (r = 0; r < g->numregs; r++) {
+        if (g->captured[r]) {
+            continue;
+        }
+
+        int n = 0;
+
+        int i;
+        for (i = 0; i < g->numblocks; i++) {
+            queued[i] = 0;
+
+            if (g->blocks[i].rpo == -1) {
+                continue;
+            }
+
+            int j;
+            for (j = 0; j < g->blocks[i].length; j++) {
+                Instruction *inst = &g->blocks[i].code[j];
+
+                if (ssa_writes_a(inst) && inst->a == r) {
+                    work[n++] = i;
+                    queued[i] = 1;
+                    break;
+                }
+            }
+        }
+
+        while (n > 0) {
+            Block *block = &g->blocks[work[--n]];
+
+            for (i = 0; i < block->numfrontier; i++) {
+                int f = block->frontier[i];
+                Block *phiblock = &g->blocks[f];
+
+                if (phiblock->phis[r] != -1) {
+                    continue;
+                }
+
+                int v = add_value(g, f, -1);
+                g->values[v].args = malloc(phiblock->numpreds * sizeof *g->values[v].args);
+
+                if (!g->values[v].args) {
+                    fatal("Out of memory.");
+                }
+
+                int j;
+                for (j = 0; j < phiblock->numpreds; j++) {
+                    g->values[v].args[j] = -1;
+                }
+
+                phiblock->phis[r] = v;
+
+                if (!queued[f]) {
+                    work[n++] = f;
+                    queued[f] = 1;
+                }
+            }
+        }
+    }
+
+    free(work);
+    free(queued);
+}
+
+int read_register(Graph *g, int *current, int r) {
+    return r < NUM_REGISTERS && !g->captured[r] ? current[r] : -1;
+}
+
+// names the value each operand reads and each instruction writes
+void rename_block(Graph *g, int b, int *parent) {
+    Block *block = &g->blocks[b];
+    int *current = malloc(NUM_REGISTERS * sizeof *current);
+
+    if (!current) {
+        fatal("Out of memory.");
+    }
+
+    memcpy(current, parent, NUM_REGISTERS * sizeof *current);
+
+    int i;
+    for (i = 0; i < NUM_REGISTERS; i++) {
+        if (block->phis[i] != -1) {
+            current[i] = block->phis[i];
+        }
+    }
+
+    for (i = 0; i < block->length; i++) {
+        Instruction *inst = &block->code[i];
+        int n = ssa_rk_operands(inst);
+
+        if (n >= 1 && inst->b < NUM_REGISTERS) {
+            inst->vb = read_register(g, current, inst->b);
+        }
+
+        if (n == 2 && inst->c < NUM_REGISTERS) {
+            inst->vc = read_register(g, current, inst->c);
+        }
+
+        if (ssa_writes_a(inst) && !g->captured[inst->a]) {
+            inst->def = add_value(g, b, i);
+            current[inst->a] = inst->def;
+        }
+    }
+
+    for (i = 0; i < block->numsuccs; i++) {
+        Block *succ = &g->blocks[block->succs[i]];
+
+        int j;
+        for (j = 0; j < succ->numpreds; j++) {
+            if (succ->preds[j] != b) {
+                continue;
+            }
+
+            int r;
+            for (r = 0; r < NUM_REGISTERS; r++) {
+                if (succ->phis[r] != -1) {
+                    g->values[succ->phis[r]].args[j] = current[r];
+                }
+            }
+        }
+    }
+
+    for (i = 0; i < block->numchildren; i++) {
+        rename_block(g, block->children[i], current);
+    }
+
+    free(current);
+}
+
+Graph *build_graph(Chunk *chunk) {
+    int i;
+    for (i = 0; i < chunk->numinstructions; i++) {
+        if (GET_O(chunk->instructions[i]) == OP_ENTER_TRY) {
+            return NULL;
+        }
+    }
+
+    Graph *g = malloc(sizeof *g);
+
+    if (!g) {
+        fatal("Out of memory.");
+    }
+
+    g->chunk = chunk;
+    g->values = NULL;
+    g->numvalues = 0;
+    g->numregs = chunk->numlocals + chunk->numtemps + 1;
+    memset(g->captured, 0, sizeof g->captured);
+
+    split_blocks(g);
+    compute_dominators(g);
+
+    // values held on entry, such as the arguments
+    int current[NUM_REGISTERS];
+    for (i = 0; i < NUM_REGISTERS; i++) {
+        current[i] = i < g->numregs ? add_value(g, -1, -1) : -1;
+    }
+
+    place_phis(g);
+    rename_block(g, 0, current);
+
+    return g;
+}
+
+void free_graph(Graph *g) {
+    int i;
+    for (i = 0; i < g->numblocks; i++) {
+        free(g->blocks[i].code);
+        free(g->blocks[i].preds);
+        free(g->blocks[i].children);
+        free(g->blocks[i].frontier);
+        free(g->blocks[i].phis);
+    }
+
+    for (i = 0; i < g->numvalues; i++) {
+        free(g->values[i].args);
+    }
+
+    free(g->blocks);
+    free(g->order);
+    free(g->values);
+    free(g);
+}
+
+// writes the blocks back in order; fails (leaving the chunk as it was)
+// if a jump no longer fits
+int lower_graph(Graph *g) {
+    int *start = malloc((g->numblocks + 1) * sizeof *start);
+
+    if (!start) {
+        fatal("Out of memory.");
+    }
+
+    int n = 0;
+
+    int i;
+    for (i = 0; i < g->numblocks; i++) {
+        start[i] = n;
+        n += g->blocks[i].length;
+    }
+
+    int *instructions = malloc((n + 1) * sizeof *instructions);
+
+    if (!instructions) {
+        fatal("Out of memory.");
+    }
+
+    int k = 0;
+    for (i = 0; i < g->numblocks; i++) {
+        int j;
+        for (j = 0; j < g->blocks[i].length; j++, k++) {
+            Instruction *inst = &g->blocks[i].code[j];
+
+            if (inst->target != -1) {
+                int offset = start[inst->target] - k - 1;
+
+                inst->b = offset < 0 ? -offset : offset;
+                inst->c = offset < 0;
+
+                if (inst->b > MAX_B) {
+                    free(start);
+                    free(instructions);
+                    return 0;
+                }
+            }
+
+            instructions[k] = CREATE(inst->op, inst->a, inst->b, inst->c);
+        }
+    }
+
+    Chunk *chunk = g->chunk;
+    free(chunk->instructions);
+
+    chunk->instructions = instructions;
+    chunk->numinstructions = n;
+    chunk->numtemps = g->numregs - chunk->numlocals - 1;
+
+    free(start);
+    return 1;
+}
+
+/*
+ * Types
+ *
+ * The types each value may have, found by iterating to a fixed point from
+ * none at all. They follow the VM: integer arithmetic stays integer, an
+ * add involving a string concatenates, and a negated real is an integer.
+ * The operands of a typed instruction are known to have its type, as
+ * type inference proved that before it was emitted.
+ */
+
+int constant_type(Chunk *chunk, int k) {
+    switch (chunk->constants[k - 256]->type) {
+        case CONST_INT:    return T_INT;
+        case CONST_REAL:   return T_REAL;
+        case CONST_BOOL:   return T_BOOL;
+        case CONST_NULL:   return T_NULL;
+        case CONST_STRING: return T_STR;
+        case CONST_FUNC:   return T_REF;
+    }
+
+    return T_ANY;
+}
+
+int operand_type(Graph *g, int r, int v) {
+    if (r >= NUM_REGISTERS) {
+        return constant_type(g->chunk, r);
+    }
+
+    return v == -1 ? T_ANY : g->values[v].type;
+}
+
+// the type the operands of a typed instruction were proven to have, or
+// any type for a generic one
+int proven_type(OpCode op) {
+    switch (op) {
+        case OP_ADD_INT:
+        case OP_SUB_INT:
+        case OP_MUL_INT:
+        case OP_DIV_INT:
+        case OP_MOD_INT:
+        case OP_NEG_INT:
+        case OP_EQ_INT:
+        case OP_NE_INT:
+        case OP_LT_INT:
+        case OP_LE_INT:
+        case OP_TEST_EQ_INT:
+        case OP_TEST_LT_INT:
+        case OP_TEST_LE_INT:
+            return T_INT;
+
+        case OP_ADD_REAL:
+        case OP_SUB_REAL:
+        case OP_MUL_REAL:
+        case OP_DIV_REAL:
+        case OP_LT_REAL:
+        case OP_LE_REAL:
+        case OP_TEST_LT_REAL:
+        case OP_TEST_LE_REAL:
+            return T_REAL;
+
+        case OP_NOT_BOOL:
+        case OP_JUMP_TRUE_BOOL:
+        case OP_JUMP_FALSE_BOOL:
+            return T_BOOL;
+
+        default:
+            return T_ANY;
+    }
+}
+
+int instruction_type(Graph *g, Instruction *inst) {
+    int t1 = operand_type(g, inst->b, inst->vb) & proven_type(inst->op);
+    int t2 = operand_type(g, inst->c, inst->vc) & proven_type(inst->op);
+
+    switch (generic_opcode(inst->op)) {
+        case OP_MOVE:
+            return t1;
+
+        case OP_ADD:
+            if ((t1 & T_STR) || (t2 & T_STR)) {
+                return arithmetic_type(t1, t2) | T_STR;
+            }
+
+            return arithmetic_type(t1, t2);
+
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_MOD:
+        case OP_POW:
+            return arithmetic_type(t1, t2);
+
+        case OP_NEG:
+            return t1 & (T_INT | T_REAL) ? T_INT : 0;
+
+        case OP_NOT:
+        case OP_EQ:
+        case OP_NE:
+        case OP_LT:
+        case OP_LE:
+            return T_BOOL;
+
+        case OP_CONCAT:
+            return T_STR;
+
+        case OP_CLOSURE:
+            return T_REF;
+
+        default:
+            return T_ANY;
+    }
+}
+
+void infer_types(Graph *g) {
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+
+        int i;
+        for (i = 0; i < g->numvalues; i++) {
+            Value *v = &g->values[i];
+            int type;
+
+            if (v->block == -1) {
+                type = T_ANY;
+            } else if (v->index == -1) {
+                type = 0;
+
+                int j;
+                for (j = 0; j < g->blocks[v->block].numpreds; j++) {
+                    type |= v->args[j] == -1 ? T_ANY : g->values[v->args[j]].type;
+                }
+            } else {
+                type = instruction_type(g, &g->blocks[v->block].code[v->index]);
+            }
+
+            if (type != v->type) {
+                v->type = type;
+                changed = 1;
+            }
+        }
+    }
+}
+
+// non-zero if the instruction could stop the program with a type error,
+// or a division by zero, given what is known of its operands
+int may_fail(Graph *g, Instruction *inst) {
+    int t1 = operand_type(g, inst->b, inst->vb) & proven_type(inst->op);
+    int t2 = operand_type(g, inst->c, inst->vc) & proven_type(inst->op);
+
+    switch (generic_opcode(inst->op)) {
+        case OP_MOVE:
+            return 0;
+
+        case OP_ADD:
+            if (t1 == T_STR || t2 == T_STR) {
+                return (t1 | t2) & ~(T_INT | T_REAL | T_STR);
+            }
+
+            return !IS_NUMBER_TYPE(t1) || !IS_NUMBER_TYPE(t2);
+
+        case OP_SUB:
+        case OP_MUL:
+        case OP_POW:
+            return !IS_NUMBER_TYPE(t1) || !IS_NUMBER_TYPE(t2);
+
+        case OP_DIV:
+        case OP_MOD:
+        {
+            if (!IS_NUMBER_TYPE(t1) || !IS_NUMBER_TYPE(t2) || inst->c < NUM_REGISTERS) {
+                return 1;
+            }
+
+            Constant *k = g->chunk->constants[inst->c - 256];
+            return k->type == CONST_INT ? k->value.i == 0 : k->value.d == 0;
+        }
+
+        case OP_NEG:
+            return !IS_NUMBER_TYPE(t1);
+
+        case OP_EQ:
+        case OP_NE:
+            return !(IS_NUMBER_TYPE(t1) && IS_NUMBER_TYPE(t2)) && t1 != T_STR && t2 != T_STR;
+
+        case OP_LT:
+        case OP_LE:
+            return !(IS_NUMBER_TYPE(t1) && IS_NUMBER_TYPE(t2)) && !(t1 == T_STR && t2 == T_STR);
+
+        default:
+            return 1;
+    }
+}
+
+/*
+ * Loop-invariant code motion
+ *
+ * A loop is found from each edge back to a block that dominates its
+ * source. It is only worked on if a single block outside it enters it,
+ * and that block has no other way out; the preheader, where hoisted
+ * instructions are placed ahead of its jump.
+ *
+ * An instruction can leave the loop if it is pure and every register it
+ * reads holds a value made outside the loop (or by an instruction already
+ * hoisted). It computes into a fresh register in the preheader, and is
+ * replaced by a move from there. Loops are worked on innermost first, so
+ * an instruction can be hoisted again out of an enclosing loop.
+ *
+ * Executing an instruction ahead of the loop is only harmless if it
+ * cannot fail: hoisting it out of a loop that would not have run it must
+ * not stop the program. Most instructions check the types of their
+ * operands, so the inferred types must show that the check passes. An
+ * instruction that may still fail its check is hoisted only from the
+ * start of the loop header, before anything that has an effect or may
+ * fail itself; the check then runs once ahead of the loop, at the point
+ * where the first iteration would have run it.
+ */
+
+typedef struct {
+    int header;
+    int *body;          // non-zero for each block in the loop
+    int size;
+} Loop;
+
+void add_to_loop(Graph *g, Loop *loop, int b) {
+    if (loop->body[b]) {
+        return;
+    }
+
+    loop->body[b] = 1;
+    loop->size++;
+
+    int i;
+    for (i = 0; i < g->blocks[b].numpreds; i++) {
+        if (g->blocks[g->blocks[b].preds[i]].rpo != -1) {
+            add_to_loop(g, loop, g->blocks[b].preds[i]);
+        }
+    }
+}
+
+int compare_loops(const void *l1, const void *l2) {
+    return ((const Loop *) l1)->size - ((const Loop *) l2)->size;
+}
+
+// the single block entering the loop, which leaves only to the header
+int find_preheader(Graph *g, Loop *loop) {
+    Block *header = &g->blocks[loop->header];
+    int preheader = -1;
+
+    int i;
+    for (i = 0; i < header->numpreds; i++) {
+        int p = header->preds[i];
+
+        if (loop->body[p] || g->blocks[p].rpo == -1) {
+            continue;
+        }
+
+        if (preheader != -1) {
+            return -1;
+        }
+
+        preheader = p;
+    }
+
+    if (preheader == -1 || g->blocks[preheader].numsuccs != 1) {
+        return -1;
+    }
+
+    // the jump skipped by a test must stay a single instruction
+    if (preheader > 0) {
+        Block *prev = &g->blocks[preheader - 1];
+
+        if (prev->length > 0 && ssa_is_test(prev->code[prev->length - 1].op)) {
+            return -1;
+        }
+    }
+
+    return preheader;
+}
+
+// the register holding the operand at the end of the preheader
+int invariant_operand(Graph *g, Loop *loop, int r, int v) {
+    if (r >= NUM_REGISTERS) {
+        return r;
+    }
+
+    if (v == -1) {
+        return -1;
+    }
+
+    if (g->values[v].block != -1 && loop->body[g->values[v].block]) {
+        return -1;
+    }
+
+    return g->values[v].hoisted != -1 ? g->values[v].hoisted : r;
+}
+
+void hoist_loop(Graph *g, Loop *loop, int preheader, OptimizerStats *stats) {
+    int i;
+    for (i = 0; i < g->numreachable; i++) {
+        int b = g->order[i];
+
+        if (!loop->body[b]) {
+            continue;
+        }
+
+        Block *block = &g->blocks[b];
+
+        // still at the start of the header, before any effect
+        int leading = b == loop->header;
+
+        int j;
+        for (j = 0; j < block->length; j++) {
+            Instruction *inst = &block->code[j];
+
+            if (inst->upvar || !is_pure_op(inst->op) || inst->def == -1) {
+                leading = leading && inst->op == OP_MOVE && !inst->upvar;
+                continue;
+            }
+
+            int fails = may_fail(g, inst);
+            int b1 = invariant_operand(g, loop, inst->b, inst->vb);
+            int c1 = generic_opcode(inst->op) == OP_NEG ? 0 : invariant_operand(g, loop, inst->c, inst->vc);
+
+            if (b1 == -1 || c1 == -1 || (fails && !leading)) {
+                leading = leading && !fails;
+                continue;
+            }
+
+            int t = fresh_register(g);
+
+            if (t == -1) {
+                return;
+            }
+
+            Instruction hoisted = *inst;
+            hoisted.a = t;
+            hoisted.b = b1;
+            hoisted.c = c1;
+
+            inst->op = OP_MOVE;
+            inst->b = t;
+            inst->c = 0;
+            inst->vb = inst->def;
+            inst->vc = -1;
+
+            // entered by a jump, or by falling into the header
+            Block *pre = &g->blocks[preheader];
+            int at = pre->length > 0 && pre->code[pre->length - 1].op == OP_JUMP ? pre->length - 1 : pre->length;
+            add_block_instruction(pre, at, &hoisted);
+
+            g->values[inst->def].block = preheader;
+            g->values[inst->def].index = at;
+            g->values[inst->def].hoisted = t;
+
+            stats->hoisted++;
+        }
+    }
+}
+
+void hoist_invariants(Graph *g, OptimizerStats *stats) {
+    Loop *loops = NULL;
+    int numloops = 0;
+
+    int i;
+    for (i = 0; i < g->numreachable; i++) {
+        int h = g->order[i];
+        Block *header = &g->blocks[h];
+        Loop loop;
+
+        loop.header = h;
+        loop.body = NULL;
+        loop.size = 0;
+
+        int j;
+        for (j = 0; j < header->numpreds; j++) {
+            int p = header->preds[j];
+
+            if (g->blocks[p].rpo == -1 || !dominates(g, h, p)) {
+                continue;
+            }
+
+            if (!loop.body) {
+                loop.body = calloc(g->numblocks, sizeof *loop.body);
+
+                if (!loop.body) {
+                    fatal("Out of memory.");
+                }
+
+                loop.body[h] = 1;
+                loop.size = 1;
+            }
+
+            add_to_loop(g, &loop, p);
+        }
+
+        if (loop.body) {
+            Loop *resize = realloc(loops, (numloops + 1) * sizeof *resize);
+
+            if (!resize) {
+                fatal("Out of memory.");
+            }
+
+            loops = resize;
+            loops[numloops++] = loop;
+        }
+    }
+
+    if (numloops > 1) {
+        qsort(loops, numloops, sizeof *loops, compare_loops);
+    }
+
+    for (i = 0; i < numloops; i++) {
+        int preheader = find_preheader(g, &loops[i]);
+
+        if (preheader != -1) {
+            hoist_loop(g, &loops[i], preheader, stats);
+        }
+
+        free(loops[i].body);
+    }
+
+    free(loops);
+}
+
+/*
+ * Global value numbering
+ *
+ * Values proven equal share a number: a move copies the number of its
+ * source, constants are numbered by their index, and pure instructions
+ * applied to the same numbers compute the same number. The walk keeps
+ * the number held by each register; reaching a block, a register with a
+ * phi gets a new number and any other register keeps the one it had at
+ * the end of the block's immediate dominator.
+ *
+ * The table of pure instructions is scoped to the dominator tree, so an
+ * instruction found there has run before the one being looked at; if
+ * it failed, this one is never reached. When the register it wrote has
+ * since been overwritten, the earlier instruction is changed to write a
+ * fresh register as well, which then holds the value for every block it
+ * dominates.
+ */
+
+typedef struct {
+    OpCode op;
+    int x;
+    int y;
+    int number;
+
+    int block;          // the instruction computing it
+    int index;
+    int reg;            // a fresh register holding it, or -1
+} Expr;
+
+typedef struct {
+    Graph *g;
+    int next;           // next unused number
+
+    int *home;          // the register each number was first computed in
+    int numhome;
+
+    Expr *table;
+    int length;
+} Numbering;
+
+int new_number(Numbering *vn, int reg) {
+    if (vn->next >= vn->numhome) {
+        int size = vn->numhome * 2 + CODE_CHUNK_SIZE;
+        int *resize = realloc(vn->home, size * sizeof *resize);
+
+        if (!resize) {
+            fatal("Out of memory.");
+        }
+
+        vn->home = resize;
+        vn->numhome = size;
+    }
+
+    vn->home[vn->next] = reg;
+    return vn->next++;
+}
+
+int operand_number(Numbering *vn, int *current, int r) {
+    if (r >= NUM_REGISTERS) {
+        return r - NUM_REGISTERS;
+    }
+
+    return vn->g->captured[r] ? new_number(vn, -1) : current[r];
+}
+
+// a register other than r holding the number, or -1
+int find_holder(Numbering *vn, int *current, int number, int r) {
+    int home = vn->home[number];
+
+    if (home != -1 && home != r && !vn->g->captured[home] && current[home] == number) {
+        return home;
+    }
+
+    return -1;
+}
+
+// reads copies from the register holding the original, or the constant
+int propagate_operand(Numbering *vn, int *current, int r, int rk) {
+    if (r >= NUM_REGISTERS || vn->g->captured[r]) {
+        return r;
+    }
+
+    int number = current[r];
+
+    if (rk && number < vn->g->chunk->numconstants && number < 256) {
+        return number + NUM_REGISTERS;
+    }
+
+    int holder = find_holder(vn, current, number, r);
+    return holder == -1 ? r : holder;
+}
+
+void propagate_copies(Numbering *vn, int *current, Instruction *inst, OptimizerStats *stats) {
+    int n = ssa_rk_operands(inst);
+    int b = inst->b;
+    int c = inst->c;
+    int a = inst->a;
+
+    if (n >= 1 || ssa_reads_b_register(inst)) {
+        inst->b = propagate_operand(vn, current, inst->b, n >= 1);
+    }
+
+    if (n == 2) {
+        inst->c = propagate_operand(vn, current, inst->c, 1);
+    }
+
+    if (ssa_reads_a(inst)) {
+        inst->a = propagate_operand(vn, current, inst->a, 0);
+    }
+
+    if (inst->a != a || inst->b != b || inst->c != c) {
+        stats->copies++;
+    }
+}
+
+void number_block(Numbering *vn, int b, int *parent, OptimizerStats *stats) {
+    Graph *g = vn->g;
+    Block *block = &g->blocks[b];
+    int *current = malloc(NUM_REGISTERS * sizeof *current);
+
+    if (!current) {
+        fatal("Out of memory.");
+    }
+
+    memcpy(current, parent, NUM_REGISTERS * sizeof *current);
+
+    int scope = vn->length;
+
+    int i;
+    for (i = 0; i < NUM_REGISTERS; i++) {
+        if (block->phis[i] != -1) {
+            current[i] = new_number(vn, i);
+        }
+    }
+
+    for (i = 0; i < block->length; i++) {
+        Instruction *inst = &block->code[i];
+
+        if (inst->upvar) {
+            continue;
+        }
+
+        propagate_copies(vn, current, inst, stats);
+
+        if (!ssa_writes_a(inst)) {
+            continue;
+        }
+
+        if (g->captured[inst->a]) {
+            continue;
+        }
+
+        if (inst->op == OP_MOVE) {
+            current[inst->a] = operand_number(vn, current, inst->b);
+            continue;
+        }
+
+        if (!is_pure_op(inst->op)) {
+            current[inst->a] = new_number(vn, inst->a);
+            continue;
+        }
+
+        int x = operand_number(vn, current, inst->b);
+        int y = generic_opcode(inst->op) == OP_NEG ? -1 : operand_number(vn, current, inst->c);
+
+        // equality does not depend on the order of its operands
+        if ((generic_opcode(inst->op) == OP_EQ || generic_opcode(inst->op) == OP_NE) && x > y) {
+            int t = x;
+            x = y;
+            y = t;
+        }
+
+        Expr *found = NULL;
+
+        int j;
+        for (j = 0; j < vn->length; j++) {
+            Expr *e = &vn->table[j];
+
+            if (e->op == inst->op && e->x == x && e->y == y) {
+                found = e;
+                break;
+            }
+        }
+
+        if (found) {
+            int holder = found->reg != -1 ? found->reg : find_holder(vn, current, found->number, -1);
+
+            if (holder == -1 && (holder = fresh_register(g)) != -1) {
+                // keep the value in a register of its own as well
+                Block *def = &g->blocks[found->block];
+                Instruction *earlier = &def->code[found->index];
+
+                Instruction move = *earlier;
+                move.op = OP_MOVE;
+                move.b = holder;
+                move.c = 0;
+
+                earlier->a = holder;
+                add_block_instruction(def, found->index + 1, &move);
+
+                for (j = 0; j < vn->length; j++) {
+                    if (vn->table[j].block == found->block && vn->table[j].index > found->index) {
+                        vn->table[j].index++;
+                    }
+                }
+
+                if (found->block == b) {
+                    i++;
+                    inst = &block->code[i];
+                }
+
+                found->reg = holder;
+            }
+
+            if (holder != -1) {
+                inst->op = OP_MOVE;
+                inst->b = holder;
+                inst->c = 0;
+
+                current[inst->a] = found->number;
+                stats->values++;
+                continue;
+            }
+        }
+
+        int number = new_number(vn, inst->a);
+        current[inst->a] = number;
+
+        if (vn->length % CODE_CHUNK_SIZE == 0) {
+            Expr *resize = realloc(vn->table, (vn->length + CODE_CHUNK_SIZE) * sizeof *resize);
+
+            if (!resize) {
+                fatal("Out of memory.");
+            }
+
+            vn->table = resize;
+        }
+
+        Expr *e = &vn->table[vn->length++];
+        e->op = inst->op;
+        e->x = x;
+        e->y = y;
+        e->number = number;
+        e->block = b;
+        e->index = i;
+        e->reg = -1;
+    }
+
+    for (i = 0; i < block->numchildren; i++) {
+        number_block(vn, block->children[i], current, stats);
+    }
+
+    vn->length = scope;
+    free(current);
+}
+
+void number_values(Graph *g, OptimizerStats *stats) {
+    Numbering vn;
+    vn.g = g;
+    vn.next = 0;
+    vn.home = NULL;
+    vn.numhome = 0;
+    vn.table = NULL;
+    vn.length = 0;
+
+    // constants first, so a number below their count names one
+    int i;
+    for (i = 0; i < g->chunk->numconstants; i++) {
+        new_number(&vn, -1);
+    }
+
+    int current[NUM_REGISTERS];
+    for (i = 0; i < NUM_REGISTERS; i++) {
+        current[i] = new_number(&vn, i);
+    }
+
+    number_block(&vn, 0, current, stats);
+
+    free(vn.home);
+    free(vn.table);
+}
+
+/*
+ * Fresh registers are never among the arguments of a call, so unlike the
+ * others it is known exactly which instructions read them. Moves into
+ * ones nothing reads, such as those left behind when a value is hoisted
+ * out of two loops or its copies are all propagated, are removed.
+ */
+
+void remove_unread_moves(Graph *g, int base, OptimizerStats *stats) {
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+
+        int read[NUM_REGISTERS];
+        memset(read, 0, sizeof read);
+
+        int i;
+        for (i = 0; i < g->numblocks; i++) {
+            int j;
+            for (j = 0; j < g->blocks[i].length; j++) {
+                Instruction *inst = &g->blocks[i].code[j];
+                int n = ssa_rk_operands(inst);
+
+                if (inst->upvar && inst->op == OP_MOVE) {
+                    read[inst->b] = 1;
+                }
+
+                if ((n >= 1 || ssa_reads_b_register(inst)) && inst->b < NUM_REGISTERS) {
+                    read[inst->b] = 1;
+                }
+
+                if (n == 2 && inst->c < NUM_REGISTERS) {
+                    read[inst->c] = 1;
+                }
+
+                if (ssa_reads_a(inst) || (generic_opcode(inst->op) == OP_NOT && !inst->upvar)) {
+                    read[inst->a] = 1;
+                }
+            }
+        }
+
+        for (i = 0; i < g->numblocks; i++) {
+            Block *block = &g->blocks[i];
+
+            int j;
+            for (j = 0; j < block->length; j++) {
+                Instruction *inst = &block->code[j];
+
+                if (!inst->upvar && inst->op == OP_MOVE && inst->a >= base && !read[inst->a]) {
+                    memmove(inst, inst + 1, (block->length - j - 1) * sizeof *inst);
+                    block->length--;
+                    j--;
+
+                    stats->stores++;
+                    changed = 1;
+                }
+            }
+        }
+    }
+}
+
+void optimize_ssa(Chunk *chunk, OptimizerStats *stats) {
+    Graph *g = build_graph(chunk);
+
+    if (!g) {
+        return;
+    }
+
+    int base = g->numregs;
+
+    OptimizerStats saved = *stats;
+
+    infer_types(g);
+    hoist_invariants(g, stats);
+
+    if (!lower_graph(g)) {
+        *stats = saved;
+    }
+
+    free_graph(g);
+
+    g = build_graph(chunk);
+    saved = *stats;
+
+    number_values(g, stats);
+    remove_unread_moves(g, base, stats);
+
+    if (!lower_graph(g)) {
+        *stats = saved;
+    }
+
+    free_graph(g);
+}
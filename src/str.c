@@ -0,0 +1,984 @@
+/*
+ * Copyright (c) 2014, Eric Fritz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+ * BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <float.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chinnu.h"
+#include "str.h"
+
+/*
+ * Flat strings live in the same allocation as their heap object header,
+ * so creating one costs a single malloc.
+ */
+
+void init_string_view(String *s, char *chars, int length) {
+    s->length = length;
+    s->hash = 0;
+    s->numchars = -1;
+    s->ascii = 0;
+    s->crumbs = NULL;
+    s->chars = chars;
+}
+
+void init_string(String *s, int length) {
+    init_string_view(s, (char *) (s + 1), length);
+    s->chars[length] = '\0';
+}
+
+HeapObject *alloc_string(VM *vm, int length) {
+    HeapObject *obj = make_object(vm, sizeof *obj + sizeof(String) + length + 1);
+    String *s = (String *) (obj + 1);
+
+    init_string(s, length);
+
+    obj->type = OBJECT_STRING;
+    obj->value.s = s;
+
+    return obj;
+}
+
+HeapObject *make_string(VM *vm, const char *s, int length) {
+    HeapObject *obj = alloc_string(vm, length);
+    memcpy(obj->value.s->chars, s, length);
+
+    return obj;
+}
+
+int string_length(HeapObject *obj) {
+    switch (obj->type) {
+        case OBJECT_ROPE:
+            return obj->value.r->length;
+
+        case OBJECT_SLICE:
+            return obj->value.sl->string.length;
+
+        default:
+            return obj->value.s->length;
+    }
+}
+
+// djb2 by Dan Bernstein
+unsigned int hash_bytes(const char *str, int length) {
+    unsigned int hash = 5381;
+
+    int i;
+    for (i = 0; i < length; i++) {
+        hash = ((hash << 5) + hash) ^ (unsigned char) str[i];
+    }
+
+    return hash;
+}
+
+unsigned int string_hash(String *s) {
+    if (!s->hash) {
+        unsigned int hash = hash_bytes(s->chars, s->length);
+        s->hash = hash ? hash : 1;
+    }
+
+    return s->hash;
+}
+
+/*
+ * String constants are interned: the first time a constant is loaded it
+ * is looked up in a VM-wide table keyed by its contents, and every later
+ * load (from any chunk) references the same object. Interned objects are
+ * never linked into the heap, so the collector never frees them; they are
+ * chained through their next pointer within a bucket instead.
+ */
+
+#define STRING_TABLE_SIZE 64
+
+void resize_strings(VM *vm, int capacity) {
+    HeapObject **strings = malloc(capacity * sizeof *strings);
+
+    if (!strings) {
+        fatal("Out of memory.");
+    }
+
+    int i;
+    for (i = 0; i < capacity; i++) {
+        strings[i] = NULL;
+    }
+
+    for (i = 0; i < vm->stringcapacity; i++) {
+        HeapObject *obj = vm->strings[i];
+
+        while (obj) {
+            HeapObject *next = obj->next;
+            HeapObject **bucket = &strings[string_hash(obj->value.s) % capacity];
+
+            obj->next = *bucket;
+            *bucket = obj;
+            obj = next;
+        }
+    }
+
+    free(vm->strings);
+    vm->strings = strings;
+    vm->stringcapacity = capacity;
+}
+
+void init_strings(VM *vm) {
+    vm->strings = NULL;
+    vm->numstrings = 0;
+    vm->stringcapacity = 0;
+
+    resize_strings(vm, STRING_TABLE_SIZE);
+}
+
+void free_strings(VM *vm) {
+    int i;
+    for (i = 0; i < vm->stringcapacity; i++) {
+        while (vm->strings[i]) {
+            HeapObject *temp = vm->strings[i];
+            vm->strings[i] = temp->next;
+            free_obj(temp);
+        }
+    }
+
+    free(vm->strings);
+}
+
+HeapObject *intern_string(VM *vm, const char *s, int length) {
+    unsigned int hash = hash_bytes(s, length);
+    hash = hash ? hash : 1;
+
+    HeapObject **bucket = &vm->strings[hash % vm->stringcapacity];
+
+    HeapObject *obj;
+    for (obj = *bucket; obj != NULL; obj = obj->next) {
+        String *t = obj->value.s;
+
+        if (t->hash == hash && t->length == length && memcmp(t->chars, s, length) == 0) {
+            return obj;
+        }
+    }
+
+    obj = malloc(sizeof *obj + sizeof(String) + length + 1);
+
+    if (!obj) {
+        fatal("Out of memory.");
+    }
+
+    String *t = (String *) (obj + 1);
+
+    init_string(t, length);
+    t->hash = hash;
+    memcpy(t->chars, s, length);
+
+    obj->type = OBJECT_STRING;
+    obj->value.s = t;
+    obj->marked = 1; // never swept
+
+    obj->next = *bucket;
+    *bucket = obj;
+
+    if (++vm->numstrings > vm->stringcapacity) {
+        resize_strings(vm, vm->stringcapacity * 2);
+    }
+
+    return obj;
+}
+
+int is_interned(VM *vm, HeapObject *obj) {
+    if (obj->type != OBJECT_STRING) {
+        return 0;
+    }
+
+    HeapObject *t;
+    for (t = vm->strings[string_hash(obj->value.s) % vm->stringcapacity]; t != NULL; t = t->next) {
+        if (t == obj) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * String concatenation
+ *
+ * Short results are copied into a new flat string. Longer results become
+ * a rope node referencing both operands, so building a string by repeated
+ * appends copies each byte once (when the rope is finally flattened)
+ * instead of once per append. A short flat leaf on the right of a rope
+ * absorbs further short appends, which keeps the leaf count down, and a
+ * rope that grows too deep is rebuilt as a balanced tree of its leaves.
+ */
+
+#define ROPE_MIN_LENGTH 64
+#define ROPE_LEAF_LENGTH 256
+#define ROPE_MAX_DEPTH 48
+
+#define IS_FLAT(obj) ((obj)->type != OBJECT_ROPE || (obj)->value.r->flat)
+
+/*
+ * Lengths are ints, and a rope can double its length with each append
+ * without copying anything, so every sum of two lengths is checked.
+ */
+
+int concat_length(int l1, int l2) {
+    if (l1 > INT_MAX - l2) {
+        fatal("String too long.");
+    }
+
+    return l1 + l2;
+}
+
+String *flat_string(HeapObject *obj) {
+    switch (obj->type) {
+        case OBJECT_ROPE:
+            return obj->value.r->flat;
+
+        case OBJECT_SLICE:
+            return &obj->value.sl->string;
+
+        default:
+            return obj->value.s;
+    }
+}
+
+int rope_depth(HeapObject *obj) {
+    return IS_FLAT(obj) ? 0 : obj->value.r->depth;
+}
+
+void flatten_rope(HeapObject *obj) {
+    Rope *rope = obj->value.r;
+    String *flat = malloc(sizeof *flat + rope->length + 1);
+
+    if (!flat) {
+        fatal("Out of memory.");
+    }
+
+    init_string(flat, rope->length);
+
+    // explicit stack instead of recursion; bounded by the rope depth
+    HeapObject *stack[ROPE_MAX_DEPTH + 2];
+    int top = 0;
+    int n = 0;
+
+    stack[top++] = obj;
+
+    while (top > 0) {
+        HeapObject *node = stack[--top];
+
+        if (node != obj && IS_FLAT(node)) {
+            String *s = flat_string(node);
+            memcpy(flat->chars + n, s->chars, s->length);
+            n += s->length;
+        } else {
+            stack[top++] = node->value.r->right;
+            stack[top++] = node->value.r->left;
+        }
+    }
+
+    rope->flat = flat;
+    rope->left = NULL;
+    rope->right = NULL;
+}
+
+String *as_string(HeapObject *obj) {
+    if (obj->type == OBJECT_ROPE && !obj->value.r->flat) {
+        flatten_rope(obj);
+    }
+
+    return flat_string(obj);
+}
+
+HeapObject *make_rope(VM *vm, HeapObject *left, HeapObject *right) {
+    // checked before the object joins the heap half-initialized
+    int length = concat_length(string_length(left), string_length(right));
+
+    // cheap to build, but its flat copy would not be
+    charge_allocation(vm, length);
+
+    HeapObject *obj = make_object(vm, sizeof *obj + sizeof(Rope));
+    Rope *rope = (Rope *) (obj + 1);
+
+    int d1 = rope_depth(left);
+    int d2 = rope_depth(right);
+
+    rope->left = left;
+    rope->right = right;
+    rope->flat = NULL;
+    rope->length = length;
+    rope->depth = (d1 > d2 ? d1 : d2) + 1;
+
+    obj->type = OBJECT_ROPE;
+    obj->value.r = rope;
+
+    PROFILE_ALLOC(vm, ALLOC_CONCAT, sizeof *obj + sizeof *rope);
+    return obj;
+}
+
+HeapObject *make_flat_concat(VM *vm, HeapObject *left, HeapObject *right) {
+    String *s1 = as_string(left);
+    String *s2 = as_string(right);
+
+    HeapObject *obj = alloc_string(vm, s1->length + s2->length);
+
+    memcpy(obj->value.s->chars, s1->chars, s1->length);
+    memcpy(obj->value.s->chars + s1->length, s2->chars, s2->length);
+
+    PROFILE_ALLOC(vm, ALLOC_CONCAT, sizeof *obj + sizeof(String) + obj->value.s->length + 1);
+    return obj;
+}
+
+void collect_leaves(HeapObject *obj, HeapObject **leaves, int *numleaves) {
+    if (IS_FLAT(obj)) {
+        leaves[(*numleaves)++] = obj;
+    } else {
+        collect_leaves(obj->value.r->left, leaves, numleaves);
+        collect_leaves(obj->value.r->right, leaves, numleaves);
+    }
+}
+
+int count_leaves(HeapObject *obj) {
+    return IS_FLAT(obj) ? 1 : count_leaves(obj->value.r->left) + count_leaves(obj->value.r->right);
+}
+
+HeapObject *build_balanced(VM *vm, HeapObject **leaves, int lo, int hi) {
+    if (hi - lo == 1) {
+        return leaves[lo];
+    }
+
+    int mid = lo + (hi - lo) / 2;
+    return make_rope(vm, build_balanced(vm, leaves, lo, mid), build_balanced(vm, leaves, mid, hi));
+}
+
+HeapObject *rebalance_rope(VM *vm, HeapObject *left, HeapObject *right) {
+    int n1 = count_leaves(left);
+    int n2 = count_leaves(right);
+
+    HeapObject **leaves = malloc((n1 + n2) * sizeof *leaves);
+
+    if (!leaves) {
+        fatal("Out of memory.");
+    }
+
+    int numleaves = 0;
+    collect_leaves(left, leaves, &numleaves);
+    collect_leaves(right, leaves, &numleaves);
+
+    HeapObject *obj = build_balanced(vm, leaves, 0, numleaves);
+    free(leaves);
+
+    return obj;
+}
+
+/*
+ * The caller must keep the collector from running (vm->nogc) while the
+ * operands and the result are unrooted.
+ */
+
+HeapObject *concat_strings(VM *vm, HeapObject *left, HeapObject *right) {
+    int length = concat_length(string_length(left), string_length(right));
+
+    if (length < ROPE_MIN_LENGTH) {
+        return make_flat_concat(vm, left, right);
+    }
+
+    if (!IS_FLAT(left) && IS_FLAT(right)) {
+        HeapObject *leaf = left->value.r->right;
+
+        if (IS_FLAT(leaf) && string_length(leaf) + string_length(right) <= ROPE_LEAF_LENGTH) {
+            return make_rope(vm, left->value.r->left, make_flat_concat(vm, leaf, right));
+        }
+    }
+
+    int d1 = rope_depth(left);
+    int d2 = rope_depth(right);
+
+    if ((d1 > d2 ? d1 : d2) + 1 > ROPE_MAX_DEPTH) {
+        return rebalance_rope(vm, left, right);
+    }
+
+    return make_rope(vm, left, right);
+}
+
+/*
+ * String values
+ *
+ * A string held in a register is either a short string stored inline or
+ * a reference to a heap string or rope. Results short enough to be
+ * stored inline never touch the heap.
+ */
+
+void make_string_value(VM *vm, StackObject *o, const char *s, int length) {
+    if (length <= SHORT_STRING_LENGTH) {
+        memcpy(o->value.ss, s, length);
+        SHORT_LENGTH(o) = length;
+        o->type = OBJECT_SHORT_STRING;
+    } else {
+        o->value.o = make_string(vm, s, length);
+        o->type = OBJECT_REFERENCE;
+    }
+}
+
+/*
+ * Makes o a string of the given length and returns where its characters
+ * go, so a result can be written in place instead of built elsewhere and
+ * copied.
+ */
+
+char *begin_string_value(VM *vm, StackObject *o, int length) {
+    if (length <= SHORT_STRING_LENGTH) {
+        SHORT_LENGTH(o) = length;
+        o->type = OBJECT_SHORT_STRING;
+
+        return o->value.ss;
+    }
+
+    o->value.o = alloc_string(vm, length);
+    o->type = OBJECT_REFERENCE;
+
+    return o->value.o->value.s->chars;
+}
+
+int value_length(StackObject *o) {
+    return o->type == OBJECT_SHORT_STRING ? SHORT_LENGTH(o) : string_length(o->value.o);
+}
+
+const char *value_chars(StackObject *o) {
+    return o->type == OBJECT_SHORT_STRING ? o->value.ss : as_string(o->value.o)->chars;
+}
+
+/*
+ * Number formatting
+ *
+ * Numbers are formatted into a caller-supplied buffer of at least
+ * NUMBER_LENGTH bytes; both functions return the number of characters
+ * written. Reals are printed with the fewest significant digits that
+ * read back as the same double: every double with at most DBL_DIG
+ * digits survives a round trip, so only values that need more digits
+ * than that pay for a second or third attempt. Subnormals carry fewer
+ * significant digits than DBL_DIG, so their search starts from a single
+ * digit instead. A real that prints like an integer gets a trailing
+ * ".0" so the two stay distinguishable.
+ */
+
+int format_int(char *buffer, int i) {
+    char digits[NUMBER_LENGTH];
+    unsigned int u = i < 0 ? -(unsigned int) i : (unsigned int) i;
+    int n = 0;
+
+    do {
+        digits[n++] = '0' + u % 10;
+        u /= 10;
+    } while (u);
+
+    int length = 0;
+
+    if (i < 0) {
+        buffer[length++] = '-';
+    }
+
+    while (n > 0) {
+        buffer[length++] = digits[--n];
+    }
+
+    buffer[length] = '\0';
+    return length;
+}
+
+int format_real(char *buffer, double d) {
+    int subnormal = d != 0 && d > -DBL_MIN && d < DBL_MIN;
+
+    int precision;
+    for (precision = subnormal ? 1 : DBL_DIG; precision < 17; precision++) {
+        snprintf(buffer, NUMBER_LENGTH, "%.*g", precision, d);
+
+        if (strtod(buffer, NULL) == d) {
+            break;
+        }
+    }
+
+    if (precision == 17) {
+        snprintf(buffer, NUMBER_LENGTH, "%.17g", d);
+    }
+
+    int length = strlen(buffer);
+
+    if (strspn(buffer, "-0123456789") == (size_t) length) {
+        buffer[length++] = '.';
+        buffer[length++] = '0';
+        buffer[length] = '\0';
+    }
+
+    return length;
+}
+
+/*
+ * Concatenation operands
+ *
+ * An operand of a string concatenation is described by a StringArg: a
+ * heap string (left unflattened until its characters are needed) or
+ * characters placed in the argument's own buffer. Numbers, booleans and
+ * short strings all go in the buffer, so coercing an operand allocates
+ * nothing; the characters are copied straight into the result.
+ */
+
+const char *arg_chars(StringArg *arg) {
+    return arg->object ? as_string(arg->object)->chars : arg->buffer;
+}
+
+HeapObject *arg_to_object(VM *vm, StringArg *arg) {
+    if (arg->object) {
+        return arg->object;
+    }
+
+    PROFILE_ALLOC(vm, ALLOC_COERCE, sizeof(HeapObject) + sizeof(String) + arg->length + 1);
+    return make_string(vm, arg->buffer, arg->length);
+}
+
+void set_string_arg(StringArg *arg, const char *s) {
+    arg->object = NULL;
+    arg->length = strlen(s);
+    memcpy(arg->buffer, s, arg->length + 1);
+}
+
+void value_to_arg(StringArg *arg, StackObject *o) {
+    switch (o->type) {
+        case OBJECT_INT:
+            arg->object = NULL;
+            arg->length = format_int(arg->buffer, o->value.i);
+            break;
+
+        case OBJECT_REAL:
+            arg->object = NULL;
+            arg->length = format_real(arg->buffer, o->value.d);
+            break;
+
+        case OBJECT_BOOL:
+            set_string_arg(arg, o->value.i == 1 ? "true" : "false");
+            break;
+
+        case OBJECT_NULL:
+            set_string_arg(arg, "<null>");
+            break;
+
+        case OBJECT_SHORT_STRING:
+            arg->object = NULL;
+            arg->length = SHORT_LENGTH(o);
+            memcpy(arg->buffer, o->value.ss, arg->length);
+            break;
+
+        case OBJECT_REFERENCE:
+            if (IS_STRING_OBJECT(o->value.o)) {
+                arg->object = o->value.o;
+                arg->length = string_length(o->value.o);
+            } else {
+                set_string_arg(arg, "<closure>");
+            }
+            break;
+    }
+}
+
+/*
+ * Appending buffered characters to a rope whose rightmost leaf is short
+ * copies them straight into a replacement leaf, instead of first giving
+ * them a heap string of their own that concat_strings would only copy
+ * again. Returns NULL when the shortcut does not apply.
+ */
+
+HeapObject *append_to_leaf(VM *vm, StringArg *left, StringArg *right) {
+    if (right->object || !left->object || IS_FLAT(left->object)) {
+        return NULL;
+    }
+
+    Rope *rope = left->object->value.r;
+
+    if (!IS_FLAT(rope->right) || string_length(rope->right) + right->length > ROPE_LEAF_LENGTH) {
+        return NULL;
+    }
+
+    String *s = flat_string(rope->right);
+    HeapObject *leaf = alloc_string(vm, s->length + right->length);
+
+    memcpy(leaf->value.s->chars, s->chars, s->length);
+    memcpy(leaf->value.s->chars + s->length, right->buffer, right->length);
+
+    PROFILE_ALLOC(vm, ALLOC_CONCAT, sizeof *leaf + sizeof(String) + leaf->value.s->length + 1);
+    return make_rope(vm, rope->left, leaf);
+}
+
+/*
+ * The caller must keep the collector from running (vm->nogc) until the
+ * result has been stored.
+ */
+
+void concat_args(VM *vm, StackObject *dest, StringArg *left, StringArg *right) {
+    int l1 = left->length;
+    int l2 = right->length;
+    int length = concat_length(l1, l2);
+
+    if (length <= SHORT_STRING_LENGTH) {
+        memcpy(dest->value.ss, arg_chars(left), l1);
+        memcpy(dest->value.ss + l1, arg_chars(right), l2);
+        SHORT_LENGTH(dest) = length;
+        dest->type = OBJECT_SHORT_STRING;
+        return;
+    }
+
+    HeapObject *obj;
+
+    if (length < ROPE_MIN_LENGTH) {
+        obj = alloc_string(vm, length);
+
+        memcpy(obj->value.s->chars, arg_chars(left), l1);
+        memcpy(obj->value.s->chars + l1, arg_chars(right), l2);
+
+        PROFILE_ALLOC(vm, ALLOC_CONCAT, sizeof *obj + sizeof(String) + length + 1);
+    } else if (!(obj = append_to_leaf(vm, left, right))) {
+        obj = concat_strings(vm, arg_to_object(vm, left), arg_to_object(vm, right));
+    }
+
+    dest->value.o = obj;
+    dest->type = OBJECT_REFERENCE;
+}
+
+/*
+ * Joins count consecutive registers (an interpolated string) into dest.
+ * Every piece is coerced first, so the result is sized once and each
+ * piece is copied into it exactly once.
+ */
+
+#define CONCAT_ARGS 16
+
+void concat_range(VM *vm, StackObject *dest, StackObject *values, int count) {
+    StringArg local[CONCAT_ARGS];
+    StringArg *args = local;
+
+    if (count > CONCAT_ARGS) {
+        args = malloc(count * sizeof *args);
+
+        if (!args) {
+            fatal("Out of memory.");
+        }
+    }
+
+    int i;
+    int length = 0;
+
+    for (i = 0; i < count; i++) {
+        value_to_arg(&args[i], &values[i]);
+        length = concat_length(length, args[i].length);
+    }
+
+    char *chars = begin_string_value(vm, dest, length);
+
+    if (dest->type == OBJECT_REFERENCE) {
+        PROFILE_ALLOC(vm, ALLOC_CONCAT, sizeof(HeapObject) + sizeof(String) + length + 1);
+    }
+
+    int n = 0;
+    for (i = 0; i < count; i++) {
+        memcpy(chars + n, arg_chars(&args[i]), args[i].length);
+        n += args[i].length;
+    }
+
+    if (args != local) {
+        free(args);
+    }
+}
+
+/*
+ * String comparison
+ *
+ * Equal objects (every load of the same constant yields the same
+ * interned object) compare equal without looking at their characters,
+ * and strings of different lengths or with different cached hashes
+ * compare unequal. Otherwise the bytes are compared with memcmp, which
+ * the C library implements with wide loads.
+ */
+
+int string_args_equal(StringArg *left, StringArg *right) {
+    if (left->object && left->object == right->object) {
+        return 1;
+    }
+
+    if (left->length != right->length) {
+        return 0;
+    }
+
+    if (left->object && right->object && IS_FLAT(left->object) && IS_FLAT(right->object)) {
+        unsigned int h1 = flat_string(left->object)->hash;
+        unsigned int h2 = flat_string(right->object)->hash;
+
+        if (h1 && h2 && h1 != h2) {
+            return 0;
+        }
+    }
+
+    return memcmp(arg_chars(left), arg_chars(right), left->length) == 0;
+}
+
+int compare_string_args(StringArg *left, StringArg *right) {
+    if (left->object && left->object == right->object) {
+        return 0;
+    }
+
+    int length = left->length < right->length ? left->length : right->length;
+    int cmp = memcmp(arg_chars(left), arg_chars(right), length);
+
+    if (cmp != 0) {
+        return cmp;
+    }
+
+    return left->length - right->length;
+}
+
+/*
+ * UTF-8
+ *
+ * Strings hold UTF-8 bytes; characters are code points. A code point
+ * starts at every byte that is not a continuation byte (10xxxxxx), so
+ * malformed input still has a well-defined (if odd) character count.
+ *
+ * Indexing a string that turns out to be pure ASCII is a byte offset.
+ * Otherwise the first index builds breadcrumbs, after which any index
+ * is found by scanning at most BREADCRUMB_INTERVAL code points.
+ */
+
+#define BREADCRUMB_INTERVAL 64
+
+#define IS_CONTINUATION(c) (((unsigned char) (c) & 0xC0) == 0x80)
+
+int utf8_count(const char *s, int length) {
+    int n = 0;
+
+    int i;
+    for (i = 0; i < length; i++) {
+        if (!IS_CONTINUATION(s[i])) {
+            n++;
+        }
+    }
+
+    return n;
+}
+
+int utf8_offset(const char *s, int length, int start, int count) {
+    int i = start;
+
+    while (count > 0 && i < length) {
+        i++;
+
+        while (i < length && IS_CONTINUATION(s[i])) {
+            i++;
+        }
+
+        count--;
+    }
+
+    return i;
+}
+
+int is_ascii(const char *s, int length) {
+    int i = 0;
+
+    // eight bytes at a time, then the tail
+    for (; i + 8 <= length; i += 8) {
+        unsigned long long word;
+        memcpy(&word, s + i, sizeof word);
+
+        if (word & 0x8080808080808080ULL) {
+            return 0;
+        }
+    }
+
+    for (; i < length; i++) {
+        if ((unsigned char) s[i] & 0x80) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+int string_numchars(String *s) {
+    if (s->numchars < 0) {
+        s->ascii = is_ascii(s->chars, s->length);
+        s->numchars = s->ascii ? s->length : utf8_count(s->chars, s->length);
+    }
+
+    return s->numchars;
+}
+
+void build_crumbs(String *s) {
+    int numcrumbs = string_numchars(s) / BREADCRUMB_INTERVAL + 1;
+    s->crumbs = malloc(numcrumbs * sizeof *s->crumbs);
+
+    if (!s->crumbs) {
+        fatal("Out of memory.");
+    }
+
+    int i = 0;
+    int n = 0;
+
+    int k;
+    for (k = 0; k < s->length; k++) {
+        if (!IS_CONTINUATION(s->chars[k])) {
+            if (n % BREADCRUMB_INTERVAL == 0) {
+                s->crumbs[i++] = k;
+            }
+
+            n++;
+        }
+    }
+
+    // a string with no characters still has a crumb for index 0
+    if (i == 0) {
+        s->crumbs[0] = 0;
+    }
+}
+
+int string_offset(String *s, int index) {
+    if (index >= string_numchars(s)) {
+        return s->length;
+    }
+
+    if (s->ascii) {
+        return index;
+    }
+
+    if (!s->crumbs) {
+        build_crumbs(s);
+    }
+
+    int start = s->crumbs[index / BREADCRUMB_INTERVAL];
+    return utf8_offset(s->chars, s->length, start, index % BREADCRUMB_INTERVAL);
+}
+
+/*
+ * Character access on any string operand. Short and buffered strings are
+ * at most a few bytes long and are simply scanned.
+ */
+
+int arg_numchars(StringArg *arg) {
+    if (arg->object) {
+        return string_numchars(as_string(arg->object));
+    }
+
+    return utf8_count(arg->buffer, arg->length);
+}
+
+int arg_char_index(StringArg *arg, int offset) {
+    if (arg->object) {
+        String *s = as_string(arg->object);
+        string_numchars(s);
+
+        return s->ascii ? offset : utf8_count(s->chars, offset);
+    }
+
+    return utf8_count(arg->buffer, offset);
+}
+
+int arg_offset(StringArg *arg, int index) {
+    if (arg->object) {
+        return string_offset(as_string(arg->object), index);
+    }
+
+    return utf8_offset(arg->buffer, arg->length, 0, index);
+}
+
+/*
+ * Substrings
+ *
+ * A substring of a heap string is made a slice of it, which shares its
+ * characters instead of copying them. Slicing a slice makes a slice of
+ * the same parent, so chains never form. A small substring is copied
+ * anyway: below SLICE_MIN_LENGTH a copy costs about as much as the slice
+ * object, and one that is a sliver of a large parent would otherwise
+ * keep all of the parent alive.
+ */
+
+#define SLICE_MIN_LENGTH 24
+#define SLICE_PIN_LENGTH 4096
+#define SLICE_PIN_RATIO 32
+
+HeapObject *make_slice(VM *vm, HeapObject *parent, int offset, int length) {
+    String *p = as_string(parent);
+
+    if (parent->type == OBJECT_SLICE) {
+        offset += p->chars - as_string(parent->value.sl->parent)->chars;
+        parent = parent->value.sl->parent;
+    }
+
+    HeapObject *obj = make_object(vm, sizeof *obj + sizeof(Slice));
+    Slice *slice = (Slice *) (obj + 1);
+
+    slice->parent = parent;
+    init_string_view(&slice->string, as_string(parent)->chars + offset, length);
+
+    // a substring of an ASCII string is ASCII
+    if (p->numchars >= 0 && p->ascii) {
+        slice->string.ascii = 1;
+        slice->string.numchars = length;
+    }
+
+    obj->type = OBJECT_SLICE;
+    obj->value.sl = slice;
+
+    return obj;
+}
+
+/*
+ * Makes o the length bytes of arg starting at byte offset. The caller
+ * must keep the collector from running until o has been stored.
+ */
+
+void substring_value(VM *vm, StackObject *o, StringArg *arg, int offset, int length) {
+    if (arg->object && offset == 0 && length == arg->length) {
+        o->value.o = arg->object;
+        o->type = OBJECT_REFERENCE;
+        return;
+    }
+
+    int parentlength = 0;
+
+    if (arg->object) {
+        HeapObject *parent = arg->object;
+
+        if (parent->type == OBJECT_SLICE) {
+            parent = parent->value.sl->parent;
+        }
+
+        parentlength = string_length(parent);
+    }
+
+    if (!arg->object || length < SLICE_MIN_LENGTH
+        || (parentlength >= SLICE_PIN_LENGTH && length < parentlength / SLICE_PIN_RATIO)) {
+        make_string_value(vm, o, arg_chars(arg) + offset, length);
+
+        if (o->type == OBJECT_REFERENCE) {
+            PROFILE_ALLOC(vm, ALLOC_SUBSTRING, sizeof(HeapObject) + sizeof(String) + length + 1);
+        }
+
+        return;
+    }
+
+    o->value.o = make_slice(vm, arg->object, offset, length);
+    o->type = OBJECT_REFERENCE;
+
+    PROFILE_ALLOC(vm, ALLOC_SUBSTRING, sizeof(HeapObject) + sizeof(Slice));
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2014, Eric Fritz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+ * BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "vm.h"
+
+#define IS_STRING_OBJECT(obj) ((obj)->type == OBJECT_STRING || (obj)->type == OBJECT_ROPE \
+    || (obj)->type == OBJECT_SLICE)
+
+#define IS_STRING_VALUE(val) ((val)->type == OBJECT_SHORT_STRING \
+    || ((val)->type == OBJECT_REFERENCE && IS_STRING_OBJECT((val)->value.o)))
+
+HeapObject *alloc_string(VM *vm, int length);
+HeapObject *make_string(VM *vm, const char *s, int length);
+
+unsigned int hash_bytes(const char *str, int length);
+
+int string_length(HeapObject *obj);
+String *as_string(HeapObject *obj);
+unsigned int string_hash(String *s);
+
+void init_strings(VM *vm);
+void free_strings(VM *vm);
+HeapObject *intern_string(VM *vm, const char *s, int length);
+int is_interned(VM *vm, HeapObject *obj);
+
+int concat_length(int l1, int l2);
+HeapObject *concat_strings(VM *vm, HeapObject *left, HeapObject *right);
+
+void make_string_value(VM *vm, StackObject *o, const char *s, int length);
+char *begin_string_value(VM *vm, StackObject *o, int length);
+int value_length(StackObject *o);
+const char *value_chars(StackObject *o);
+
+#define NUMBER_LENGTH 32
+
+int format_int(char *buffer, int i);
+int format_real(char *buffer, double d);
+
+typedef struct {
+    HeapObject *object;
+    int length;
+    char buffer[NUMBER_LENGTH];
+} StringArg;
+
+void value_to_arg(StringArg *arg, StackObject *o);
+void set_string_arg(StringArg *arg, const char *s);
+void concat_args(VM *vm, StackObject *dest, StringArg *left, StringArg *right);
+void concat_range(VM *vm, StackObject *dest, StackObject *values, int count);
+
+int string_args_equal(StringArg *left, StringArg *right);
+int compare_string_args(StringArg *left, StringArg *right);
+
+const char *arg_chars(StringArg *arg);
+
+int utf8_count(const char *s, int length);
+int string_numchars(String *s);
+int string_offset(String *s, int index);
+int arg_numchars(StringArg *arg);
+int arg_offset(StringArg *arg, int index);
+int arg_char_index(StringArg *arg, int offset);
+
+void substring_value(VM *vm, StackObject *o, StringArg *arg, int offset, int length);
@@ -0,0 +1,476 @@
+/*
+ * Copyright (c) 2014, Eric Fritz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+ * BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "chinnu.h"
+#include "typeinfer.h"
+#include "escape.h"
+
+/*
+ * Type inference
+ *
+ * Run with -o after register allocation. Finds the types the value of
+ * each expression may have, so that codegen can emit the typed form of
+ * an instruction whose operands can only have one type. Types are sets,
+ * as in ssa.c; an expression proven to be an integer has exactly T_INT,
+ * and one that is never evaluated has none.
+ *
+ * Each function is worked on by itself, following its body in the order
+ * it runs and keeping the types each local may hold at that point. The
+ * branches of an if are joined where they meet, and a loop is gone
+ * round until the types at its top stop growing. A handler may be
+ * entered from anywhere in its protected block, so a local written there
+ * may hold anything in the handler. Nothing follows a throw.
+ *
+ * A local captured by reference is not followed, since a call may change
+ * it. Neither are upvars, except those captured by value: such an upvar
+ * holds what its local held when the closure was created, or something
+ * the local was given later (a closure owned by the frame reads the
+ * register itself). The types of upvars are settled before the function
+ * is worked on, as the function that creates it is worked on first.
+ */
+
+typedef struct {
+    Scope *scope;
+    int *types;     // the types each local may hold here
+} Inferrer;
+
+int *copy_types(Inferrer *inf) {
+    int *copy = malloc((inf->scope->numlocals + 1) * sizeof *copy);
+
+    if (!copy) {
+        fatal("Out of memory.");
+    }
+
+    memcpy(copy, inf->types, inf->scope->numlocals * sizeof *copy);
+    return copy;
+}
+
+// adds the types in other to those in types, and returns non-zero if any grew
+int merge_types(int *types, int *other, int numlocals) {
+    int grew = 0;
+
+    int i;
+    for (i = 0; i < numlocals; i++) {
+        if (other[i] & ~types[i]) {
+            types[i] |= other[i];
+            grew = 1;
+        }
+    }
+
+    return grew;
+}
+
+// the index of a local whose types are followed, or -1
+int followed_local(Inferrer *inf, Symbol *symbol) {
+    return symbol->captured ? -1 : local_index(inf->scope, symbol);
+}
+
+void store_type(Inferrer *inf, Symbol *symbol, int type) {
+    int i = followed_local(inf, symbol);
+
+    if (i != -1) {
+        inf->types[i] = type;
+    }
+
+    symbol->types |= type;
+}
+
+int *upvar_types(Scope *scope) {
+    if (!scope->upvartypes) {
+        scope->upvartypes = calloc(scope->numupvars + 1, sizeof *scope->upvartypes);
+
+        if (!scope->upvartypes) {
+            fatal("Out of memory.");
+        }
+    }
+
+    return scope->upvartypes;
+}
+
+/*
+ * A local written inside a protected block may hold anything in its
+ * handler.
+ */
+void forget_writes(Inferrer *inf, Expression *expr);
+
+void forget_list_writes(Inferrer *inf, ExpressionList *list) {
+    if (list) {
+        ExpressionNode *head;
+        for (head = list->head; head != NULL; head = head->next) {
+            forget_writes(inf, head->expr);
+        }
+    }
+}
+
+void forget_writes(Inferrer *inf, Expression *expr) {
+    if (!expr) {
+        return;
+    }
+
+    Symbol *symbol = NULL;
+
+    switch (expr->type) {
+        case TYPE_ASSIGN:
+            symbol = expr->lexpr->symbol;
+            break;
+
+        case TYPE_DECLARATION:
+        case TYPE_FUNC:
+            symbol = expr->symbol;
+            break;
+
+        default:
+            break;
+    }
+
+    if (symbol && followed_local(inf, symbol) != -1) {
+        inf->types[followed_local(inf, symbol)] = T_ANY;
+    }
+
+    if (expr->type == TYPE_FUNC) {
+        return;
+    }
+
+    forget_writes(inf, expr->cond);
+    forget_writes(inf, expr->lexpr);
+    forget_writes(inf, expr->rexpr);
+    forget_list_writes(inf, expr->llist);
+    forget_list_writes(inf, expr->rlist);
+}
+
+/* forward */
+int infer_expr(Inferrer *inf, Expression *expr);
+
+int infer_list(Inferrer *inf, ExpressionList *list) {
+    int type = T_ANY;
+
+    ExpressionNode *head;
+    for (head = list->head; head != NULL; head = head->next) {
+        type = infer_expr(inf, head->expr);
+    }
+
+    return type;
+}
+
+int infer_expr(Inferrer *inf, Expression *expr) {
+    int numlocals = inf->scope->numlocals;
+    int type = T_ANY;
+
+    switch (expr->type) {
+        case TYPE_MODULE:
+            type = infer_expr(inf, expr->lexpr);
+            break;
+
+        case TYPE_DECLARATION:
+            type = expr->rexpr ? infer_expr(inf, expr->rexpr) : T_ANY;
+            store_type(inf, expr->symbol, type);
+            break;
+
+        case TYPE_ASSIGN:
+            type = infer_expr(inf, expr->rexpr);
+            store_type(inf, expr->lexpr->symbol, type);
+            break;
+
+        case TYPE_FUNC:
+        {
+            Scope *scope = expr->scope;
+            int *types = upvar_types(scope);
+
+            // a copy is taken of what a local holds now
+            int i;
+            for (i = 0; i < scope->numupvars; i++) {
+                if (local_index(inf->scope, scope->upvars[i]) != -1) {
+                    int j = followed_local(inf, scope->upvars[i]);
+                    types[i] |= j != -1 ? inf->types[j] : T_ANY;
+                }
+            }
+
+            if (expr->symbol) {
+                store_type(inf, expr->symbol, T_REF);
+            }
+
+            type = T_REF;
+        } break;
+
+        case TYPE_VARREF:
+        {
+            int i = local_index(inf->scope, expr->symbol);
+
+            if (i != -1) {
+                type = expr->symbol->captured ? T_ANY : inf->types[i];
+            } else {
+                type = upvar_types(inf->scope)[upvar_index(inf->scope, expr->symbol)];
+            }
+        } break;
+
+        case TYPE_CALL:
+            infer_expr(inf, expr->lexpr);
+            infer_list(inf, expr->llist);
+            break;
+
+        case TYPE_BUILTIN:
+            infer_list(inf, expr->llist);
+            break;
+
+        /* control flow */
+        case TYPE_IF:
+        {
+            infer_expr(inf, expr->cond);
+
+            int *orelse = copy_types(inf);
+            type = infer_expr(inf, expr->lexpr);
+
+            int *taken = inf->types;
+            inf->types = orelse;
+
+            type |= expr->rexpr ? infer_expr(inf, expr->rexpr) : T_NULL;
+
+            merge_types(inf->types, taken, numlocals);
+            free(taken);
+        } break;
+
+        case TYPE_WHILE:
+        {
+            // the condition is evaluated before each iteration, and once
+            // more to leave
+            int *top = copy_types(inf);
+
+            for (;;) {
+                infer_expr(inf, expr->cond);
+                infer_expr(inf, expr->lexpr);
+
+                int grew = merge_types(top, inf->types, numlocals);
+                memcpy(inf->types, top, numlocals * sizeof *top);
+
+                if (!grew) {
+                    break;
+                }
+            }
+
+            free(top);
+            infer_expr(inf, expr->cond);
+
+            type = T_NULL;
+        } break;
+
+        case TYPE_AND:
+        case TYPE_OR:
+        {
+            infer_expr(inf, expr->lexpr);
+
+            int *decided = copy_types(inf);
+            infer_expr(inf, expr->rexpr);
+
+            merge_types(inf->types, decided, numlocals);
+            free(decided);
+
+            type = T_BOOL;
+        } break;
+
+        case TYPE_BLOCK:
+        {
+            if (!expr->rlist) {
+                type = infer_list(inf, expr->llist);
+                break;
+            }
+
+            int *handler = copy_types(inf);
+            type = infer_list(inf, expr->llist);
+
+            int *done = inf->types;
+            inf->types = handler;
+
+            forget_list_writes(inf, expr->llist);
+            type |= infer_list(inf, expr->rlist);
+
+            merge_types(inf->types, done, numlocals);
+            free(done);
+        } break;
+
+        case TYPE_THROW:
+            infer_expr(inf, expr->lexpr);
+            memset(inf->types, 0, numlocals * sizeof *inf->types);
+
+            type = 0;
+            break;
+
+        /* binary cases */
+        case TYPE_ADD:
+        {
+            int t1 = infer_expr(inf, expr->lexpr);
+            int t2 = infer_expr(inf, expr->rexpr);
+
+            type = arithmetic_type(t1, t2) | ((t1 | t2) & T_STR);
+        } break;
+
+        case TYPE_SUB:
+        case TYPE_MUL:
+        case TYPE_DIV:
+        case TYPE_MOD:
+        case TYPE_POW:
+        {
+            int t1 = infer_expr(inf, expr->lexpr);
+            int t2 = infer_expr(inf, expr->rexpr);
+
+            type = arithmetic_type(t1, t2);
+        } break;
+
+        case TYPE_EQEQ:
+        case TYPE_NEQ:
+        case TYPE_LT:
+        case TYPE_LEQ:
+        case TYPE_GT:
+        case TYPE_GEQ:
+            infer_expr(inf, expr->lexpr);
+            infer_expr(inf, expr->rexpr);
+
+            type = T_BOOL;
+            break;
+
+        case TYPE_INTERP:
+            infer_list(inf, expr->llist);
+            type = T_STR;
+            break;
+
+        /* unary cases */
+        case TYPE_NEG:
+            // the VM negates a real into an integer
+            type = infer_expr(inf, expr->lexpr) & (T_INT | T_REAL) ? T_INT : 0;
+            break;
+
+        case TYPE_NOT:
+            infer_expr(inf, expr->lexpr);
+            type = T_BOOL;
+            break;
+
+        /* constants */
+        case TYPE_INT:    type = T_INT;  break;
+        case TYPE_REAL:   type = T_REAL; break;
+        case TYPE_BOOL:   type = T_BOOL; break;
+        case TYPE_NULL:   type = T_NULL; break;
+        case TYPE_STRING: type = T_STR;  break;
+    }
+
+    // a loop is gone round more than once
+    expr->types |= type;
+    return type;
+}
+
+/* forward */
+void infer_function(Expression *expr);
+
+void infer_nested(Expression *expr);
+
+void infer_list_nested(ExpressionList *list) {
+    if (list) {
+        ExpressionNode *head;
+        for (head = list->head; head != NULL; head = head->next) {
+            infer_nested(head->expr);
+        }
+    }
+}
+
+// works on each function created directly by expr
+void infer_nested(Expression *expr) {
+    if (!expr) {
+        return;
+    }
+
+    if (expr->type == TYPE_FUNC) {
+        infer_function(expr);
+        return;
+    }
+
+    infer_nested(expr->cond);
+    infer_nested(expr->lexpr);
+    infer_nested(expr->rexpr);
+    infer_list_nested(expr->llist);
+    infer_list_nested(expr->rlist);
+}
+
+void infer_function(Expression *expr) {
+    Scope *scope = expr->scope;
+    Expression *body = expr;
+
+    if (expr->type == TYPE_FUNC) {
+        Scope *parent = scope->parent;
+        int *types = upvar_types(scope);
+
+        int i;
+        for (i = 0; i < scope->numupvars; i++) {
+            Symbol *upvar = scope->upvars[i];
+
+            if (local_index(parent, upvar) == -1) {
+                types[i] = upvar_types(parent)[upvar_index(parent, upvar)];
+            } else if (captures_by_value(expr, upvar)) {
+                types[i] |= upvar->types;
+            } else {
+                types[i] = T_ANY;
+            }
+        }
+
+        ExpressionNode *head;
+        for (head = expr->llist->head; head != NULL; head = head->next) {
+            head->expr->symbol->types = T_ANY;
+        }
+
+        body = expr->rexpr;
+    }
+
+    Inferrer inf;
+    inf.scope = scope;
+    inf.types = malloc((scope->numlocals + 1) * sizeof *inf.types);
+
+    if (!inf.types) {
+        fatal("Out of memory.");
+    }
+
+    // parameters hold anything, and other locals hold what their
+    // register did before they are written
+    int i;
+    for (i = 0; i < scope->numlocals; i++) {
+        inf.types[i] = T_ANY;
+    }
+
+    infer_expr(&inf, body);
+    free(inf.types);
+
+    infer_nested(body);
+}
+
+int arithmetic_type(int t1, int t2) {
+    int type = 0;
+
+    if ((t1 & T_INT) && (t2 & T_INT)) {
+        type |= T_INT;
+    }
+
+    if (((t1 & T_REAL) && (t2 & (T_INT | T_REAL))) || ((t2 & T_REAL) && (t1 & (T_INT | T_REAL)))) {
+        type |= T_REAL;
+    }
+
+    return type;
+}
+
+void infer_static_types(Expression *expr) {
+    infer_function(expr);
+}
@@ -0,0 +1,37 @@
+/*
+ * Copyright (c) 2014, Eric Fritz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+ * BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "ast.h"
+
+// the types a value may have at run time
+#define T_INT  (1 << 0)
+#define T_REAL (1 << 1)
+#define T_BOOL (1 << 2)
+#define T_STR  (1 << 3)
+#define T_NULL (1 << 4)
+#define T_REF  (1 << 5)
+#define T_ANY  (T_INT | T_REAL | T_BOOL | T_STR | T_NULL | T_REF)
+
+#define IS_NUMBER_TYPE(t) ((t) != 0 && ((t) & ~(T_INT | T_REAL)) == 0)
+
+int arithmetic_type(int t1, int t2);
+
+void infer_static_types(Expression *expr);
@@ -18,135 +18,48 @@
  */
 
 #include <math.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "vm.h"
+#include "str.h"
+#include "builtin.h"
+#include "regex.h"
 #include "chinnu.h"
 #include "bytecode.h"
+#include "profile.h"
 
-typedef struct Upval Upval;
-typedef struct Closure Closure;
-typedef struct Frame Frame;
-typedef struct CatchFrame CatchFrame;
-typedef struct VM VM;
-typedef struct HeapObject HeapObject;
-typedef struct StackObject StackObject;
-
-struct Upval {
-    int refcount;
-    int open;
-    union {
-        struct {
-            int slot;
-            Frame *frame;
-        } ref;
-        StackObject *o;
-    } data;
-};
-
-struct Closure {
-    Chunk *chunk;
-    Upval **upvals;
-};
-
-struct CatchFrame {
-    CatchFrame *parent;
-    Frame *frame;
-
-    int target;
-};
-
-struct Frame {
-    Frame *parent;
-
-    Closure *closure;
-    StackObject *registers;
-    int pc;
-};
-
-typedef struct UpvalNode UpvalNode;
-
-struct UpvalNode {
-    Upval *upval;
-    UpvalNode *next;
-    UpvalNode *prev;
-};
-
-typedef enum {
-    OBJECT_STRING,
-    OBJECT_CLOSURE
-} HeapObjectType;
-
-struct HeapObject {
-    HeapObject *next;
-    unsigned int marked;
-
-    HeapObjectType type;
-
-    union {
-        char *s;
-        Closure *c;
-    } value;
-};
-
-typedef enum {
-    OBJECT_INT,
-    OBJECT_REAL,
-    OBJECT_BOOL,
-    OBJECT_NULL,
-    OBJECT_REFERENCE
-} StackObjectType;
-
-struct StackObject {
-    StackObjectType type;
-
-    union {
-        int i;
-        double d;
-        HeapObject *o;
-    } value;
-};
-
-// TODO - rename
-
-struct VM {
-    Frame *current;
-    UpvalNode *open;
-
-    CatchFrame *catchframe;
-
-    HeapObject *heap;
-    int numobjects;
-    int maxobjects;
-};
+#define IS_INT(reg) ((reg < 256) ? registers[reg].type == OBJECT_INT : chunk->constants[reg - 256]->type == CONST_INT)
+#define AS_INT(reg) ((reg < 256) ? registers[reg].value.i : chunk->constants[reg - 256]->value.i)
 
-#define IS_INT(reg) ((reg < 256) ? registers[reg].type == OBJECT_INT : chunk->constants[b - 256]->type == CONST_INT)
-#define AS_INT(reg) ((reg < 256) ? registers[reg].value.i : chunk->constants[b - 256]->value.i)
+#define IS_REAL(reg) ((reg < 256) ? registers[reg].type == OBJECT_REAL : chunk->constants[reg - 256]->type == CONST_REAL)
+#define AS_REAL(reg) ((reg < 256) ? registers[reg].value.d : chunk->constants[reg - 256]->value.d)
 
-#define IS_REAL(reg) ((reg < 256) ? registers[reg].type == OBJECT_REAL : chunk->constants[b - 256]->type == CONST_REAL)
-#define AS_REAL(reg) ((reg < 256) ? registers[reg].value.d : chunk->constants[b - 256]->value.d)
-
-#define IS_STR(reg) ((reg < 256)                                                                 \
-    ? (registers[reg].type == OBJECT_REFERENCE && registers[reg].value.o->type == OBJECT_STRING) \
+#define IS_STR(reg) ((reg < 256)                    \
+    ? IS_STRING_VALUE(&registers[reg])               \
     : (chunk->constants[reg - 256]->type == CONST_STRING))
 
 #define TO_STR(reg) ((reg < 256) ? obj_to_str(&registers[reg]) : const_to_str(chunk->constants[reg - 256]))
 
+#define TO_STRING_ARG(reg, arg) ((reg < 256)                \
+    ? value_to_arg(arg, &registers[reg])                    \
+    : const_to_arg(vm, arg, chunk->constants[reg - 256]))
+
 char *obj_to_str(StackObject *o) {
     switch (o->type) {
         case OBJECT_INT:
         {
-            char *str = malloc(15 * sizeof *str);
-            sprintf(str, "%d", o->value.i);
-            return str;
+            char buffer[NUMBER_LENGTH];
+            format_int(buffer, o->value.i);
+            return strdup(buffer);
         }
 
         case OBJECT_REAL:
         {
-            char *str = malloc(15 * sizeof *str);
-            sprintf(str, "%.2f", o->value.d);
-            return str;
+            char buffer[NUMBER_LENGTH];
+            format_real(buffer, o->value.d);
+            return strdup(buffer);
         }
 
         case OBJECT_BOOL:
@@ -155,13 +68,21 @@ char *obj_to_str(StackObject *o) {
         case OBJECT_NULL:
             return strdup("<null>");
 
+        case OBJECT_SHORT_STRING:
+            return strndup(o->value.ss, SHORT_LENGTH(o));
+
         case OBJECT_REFERENCE:
             switch (o->value.o->type) {
                 case OBJECT_STRING:
-                    return strdup(o->value.o->value.s);
+                case OBJECT_ROPE:
+                case OBJECT_SLICE:
+                {
+                    String *s = as_string(o->value.o);
+                    return strndup(s->chars, s->length);
+                }
 
                 case OBJECT_CLOSURE:
-                    return "<closure>";
+                    return strdup("<closure>");
             }
     }
 }
@@ -170,16 +91,16 @@ char *const_to_str(Constant *c) {
     switch (c->type) {
         case CONST_INT:
         {
-            char *str = malloc(15 * sizeof *str);
-            sprintf(str, "%d", c->value.i);
-            return str;
+            char buffer[NUMBER_LENGTH];
+            format_int(buffer, c->value.i);
+            return strdup(buffer);
         }
 
         case CONST_REAL:
         {
-            char *str = malloc(15 * sizeof *str);
-            sprintf(str, "%.2f", c->value.d);
-            return str;
+            char buffer[NUMBER_LENGTH];
+            format_real(buffer, c->value.d);
+            return strdup(buffer);
         }
 
         case CONST_NULL:
@@ -190,18 +111,41 @@ char *const_to_str(Constant *c) {
 
         case CONST_STRING:
             return strdup(c->value.s);
+
+        case CONST_FUNC:
+            return strdup("<closure>");
     }
 }
 
 /* forward */
 void gc(VM *vm);
+void check_snapshot_threshold(VM *vm);
 
-HeapObject *make_object(VM *vm) {
-    if (vm->numobjects >= vm->maxobjects) {
-        gc(vm);
+void charge_allocation(VM *vm, size_t bytes) {
+    // a call evaluated at compile time gives up when out of budget
+    if (vm->sandboxed) {
+        if (bytes > vm->allocbudget) {
+            fatal("Evaluation budget exhausted.");
+        }
+
+        vm->allocbudget -= bytes;
     }
+}
 
-    HeapObject *obj = malloc(sizeof *obj);
+HeapObject *make_object(VM *vm, size_t size) {
+    charge_allocation(vm, size);
+
+    if (!vm->nogc) {
+        if (vm->numobjects >= vm->maxobjects) {
+            gc(vm);
+        }
+
+        if (snapshot_threshold) {
+            check_snapshot_threshold(vm);
+        }
+    }
+
+    HeapObject *obj = malloc(size);
 
     if (!obj) {
         fatal("Out of memory.");
@@ -227,33 +171,54 @@ void free_obj(HeapObject *obj) {
             for (i = 0; i < obj->value.c->chunk->numupvars; i++) {
                 Upval *u = obj->value.c->upvals[i];
 
-                if (--u->refcount == 0) {
+                // an open upval is still on the open list; it is freed
+                // when its frame returns instead
+                if (--u->refcount == 0 && !u->open) {
                     free_upval(u);
                 }
             }
 
+            free(obj->value.c->upvals);
             free(obj->value.c);
         } break;
 
         case OBJECT_STRING:
-            free(obj->value.s);
+            free(obj->value.s->crumbs);
+            break;
+
+        case OBJECT_ROPE:
+            if (obj->value.r->flat) {
+                free(obj->value.r->flat->crumbs);
+                free(obj->value.r->flat);
+            }
+            break;
+
+        case OBJECT_SLICE:
+            free(obj->value.sl->string.crumbs);
             break;
     }
 
     free(obj);
 }
 
-HeapObject *make_string_ref(VM *vm, char *s) {
-    HeapObject *obj = make_object(vm);
+void release_constants(Chunk *chunk) {
+    int i;
+    for (i = 0; i < chunk->numconstants; i++) {
+        // interned strings are freed with the string table
+        if (chunk->constants[i]->object && chunk->constants[i]->type == CONST_FUNC) {
+            free_static_closure(chunk->constants[i]->object);
+        }
 
-    obj->type = OBJECT_STRING;
-    obj->value.s = s;
+        chunk->constants[i]->object = NULL;
+    }
 
-    return obj;
+    for (i = 0; i < chunk->numchildren; i++) {
+        release_constants(chunk->children[i]);
+    }
 }
 
 HeapObject *make_closure_ref(VM *vm, Closure *c) {
-    HeapObject *obj = make_object(vm);
+    HeapObject *obj = make_object(vm, sizeof *obj);
 
     obj->type = OBJECT_CLOSURE;
     obj->value.c = c;
@@ -287,6 +252,31 @@ Upval *make_upval(VM *vm, int slot) {
     return upval;
 }
 
+/* forward */
+void copy_object(StackObject *o1, StackObject *o2);
+
+/*
+ * Returns an upval holding a copy of the value, for a variable that is
+ * never assigned.
+ */
+Upval *make_closed_upval(StackObject *value) {
+    Upval *upval = malloc(sizeof *upval);
+    StackObject *o = malloc(sizeof *o);
+
+    if (!upval || !o) {
+        fatal("Out of memory.");
+    }
+
+    o->type = -1; // uninitialized
+    copy_object(o, value);
+
+    upval->data.o = o;
+    upval->refcount = 1;
+    upval->open = 0;
+
+    return upval;
+}
+
 void free_upval(Upval *upval) {
     if (upval->open == 0) {
         free(upval->data.o);
@@ -310,9 +300,129 @@ Closure *make_closure(Chunk *chunk) {
 
     closure->chunk = chunk;
     closure->upvals = upvals;
+    closure->frame = NULL;
     return closure;
 }
 
+/*
+ * Returns a closure that is never linked into the heap, so the collector
+ * never frees it. Its upvals are set with set_static_upval.
+ */
+HeapObject *make_static_closure(Chunk *chunk) {
+    HeapObject *obj = malloc(sizeof *obj);
+
+    if (!obj) {
+        fatal("Out of memory.");
+    }
+
+    obj->type = OBJECT_CLOSURE;
+    obj->value.c = make_closure(chunk);
+    obj->marked = 1; // never swept
+    obj->next = NULL;
+
+    return obj;
+}
+
+void set_static_upval(HeapObject *obj, int index, HeapObject *value) {
+    StackObject o;
+    o.type = OBJECT_REFERENCE;
+    o.value.o = value;
+
+    obj->value.c->upvals[index] = make_closed_upval(&o);
+}
+
+void free_static_closure(HeapObject *obj) {
+    int i;
+    for (i = 0; i < obj->value.c->chunk->numupvars; i++) {
+        if (obj->value.c->upvals[i]) {
+            free_upval(obj->value.c->upvals[i]);
+        }
+    }
+
+    free(obj->value.c->upvals);
+    free(obj->value.c);
+    free(obj);
+}
+
+/*
+ * Returns the closure of the chunk owned by the frame, creating it from
+ * the upvar descriptors following the current instruction the first
+ * time.
+ */
+HeapObject *make_local_closure(VM *vm, Frame *frame, Chunk *chunk) {
+    LocalClosure *local;
+    for (local = frame->closures; local != NULL; local = local->next) {
+        if (local->closure.chunk == chunk) {
+            return &local->object;
+        }
+    }
+
+    local = malloc(sizeof *local);
+    Upval **upvals = malloc(chunk->numupvars * sizeof *upvals);
+    Upval *cells = malloc(chunk->numupvars * sizeof *cells);
+
+    if (!local || (chunk->numupvars > 0 && (!upvals || !cells))) {
+        fatal("Out of memory.");
+    }
+
+    PROFILE_ALLOC(vm, ALLOC_CLOSURE, sizeof *local + chunk->numupvars * (sizeof *upvals + sizeof *cells));
+
+    int i;
+    for (i = 0; i < chunk->numupvars; i++) {
+        int inst = frame->closure->chunk->instructions[frame->pc + i + 1];
+
+        if (GET_O(inst) == OP_MOVE) {
+            // the frame outlives the closure; never on the open list
+            cells[i].data.ref.frame = frame;
+            cells[i].data.ref.slot = GET_B(inst);
+            cells[i].refcount = 1;
+            cells[i].open = 1;
+
+            upvals[i] = &cells[i];
+        } else {
+            upvals[i] = frame->closure->upvals[GET_B(inst)];
+            upvals[i]->refcount++;
+        }
+    }
+
+    local->object.next = NULL;
+    local->object.marked = 0;
+    local->object.type = OBJECT_CLOSURE;
+    local->object.value.c = &local->closure;
+
+    local->closure.chunk = chunk;
+    local->closure.upvals = upvals;
+    local->closure.frame = frame;
+
+    local->cells = cells;
+    local->next = frame->closures;
+    frame->closures = local;
+
+    return &local->object;
+}
+
+void free_local_closures(LocalClosure *local) {
+    while (local) {
+        LocalClosure *temp = local->next;
+
+        int i;
+        for (i = 0; i < local->closure.chunk->numupvars; i++) {
+            Upval *u = local->closure.upvals[i];
+
+            // shared with the frame's own closure
+            if (u != &local->cells[i] && --u->refcount == 0 && !u->open) {
+                free_upval(u);
+            }
+        }
+
+        free(local->closure.upvals);
+        free(local->cells);
+        free(local);
+
+        local = temp;
+    }
+}
+
 Frame *make_frame(Frame *parent, Closure *closure) {
     // move this to code gen, not responsibility of the vm [?]
     int numregs = closure->chunk->numlocals + closure->chunk->numtemps + 1;
@@ -333,10 +443,12 @@ Frame *make_frame(Frame *parent, Closure *closure) {
     frame->parent = parent;
     frame->closure = closure;
     frame->registers = registers;
+    frame->closures = NULL;
     return frame;
 }
 
 void free_frame(Frame *frame) {
+    free_local_closures(frame->closures);
     free(frame->registers);
     free(frame);
 }
@@ -372,6 +484,18 @@ VM *make_vm(Frame *root, int maxobjects) {
     vm->catchframe = NULL;
     vm->numobjects = 0;
     vm->maxobjects = maxobjects;
+    vm->nogc = 0;
+    vm->budget = 0;
+    vm->allocbudget = 0;
+    vm->sandboxed = 0;
+
+    init_strings(vm);
+    init_regexes(vm);
+
+    vm->root = root->closure->chunk;
+    vm->numsnapshots = 0;
+    vm->overthreshold = 0;
+    vm->allocsample = profile_sample;
 
     return vm;
 }
@@ -381,7 +505,11 @@ void mark(HeapObject *obj) {
         return;
     }
 
-    obj->marked = 1;
+    // a closure owned by a frame is never swept, which is what clears a
+    // mark; no heap object refers to one, so it cannot be part of a cycle
+    if (obj->type != OBJECT_CLOSURE || !obj->value.c->frame) {
+        obj->marked = 1;
+    }
 
     switch (obj->type) {
         case OBJECT_CLOSURE:
@@ -398,6 +526,18 @@ void mark(HeapObject *obj) {
             }
         } break;
 
+        case OBJECT_ROPE:
+        {
+            if (obj->value.r->left) {
+                mark(obj->value.r->left);
+                mark(obj->value.r->right);
+            }
+        } break;
+
+        case OBJECT_SLICE:
+            mark(obj->value.sl->parent);
+            break;
+
         default:
             break;
     }
@@ -436,9 +576,342 @@ void sweep(VM *vm) {
     }
 }
 
-void gc(VM *vm) {
-    mark_all(vm);
-    sweep(vm);
+void gc(VM *vm) {
+    mark_all(vm);
+    sweep(vm);
+}
+
+/*
+ * Heap snapshots
+ *
+ * A snapshot is a plain-text block appended to snapshot_file. Every
+ * object on the heap is listed with its type and size (closures also
+ * name their chunk), followed by the edges that keep it alive: roots
+ * are frame registers, and closures retain the values of their
+ * upvalues. Closures owned by a frame or shared by a function constant
+ * are listed as well, tagged with their owner. See snapshot.c for the
+ * reader.
+ */
+
+volatile sig_atomic_t snapshot_requested = 0;
+
+void request_snapshot(int sig) {
+    snapshot_requested = 1;
+}
+
+const char *object_type_name(HeapObject *obj) {
+    switch (obj->type) {
+        case OBJECT_STRING:
+            return "string";
+
+        case OBJECT_ROPE:
+            return "rope";
+
+        case OBJECT_SLICE:
+            return "slice";
+
+        case OBJECT_CLOSURE:
+            return "closure";
+    }
+
+    return "?";
+}
+
+size_t object_size(HeapObject *obj) {
+    switch (obj->type) {
+        case OBJECT_STRING:
+            return sizeof *obj + sizeof *obj->value.s + obj->value.s->length + 1;
+
+        case OBJECT_ROPE:
+            return sizeof *obj + sizeof *obj->value.r + (obj->value.r->flat ? sizeof(String) + obj->value.r->length + 1 : 0);
+
+        case OBJECT_SLICE:
+            return sizeof *obj + sizeof *obj->value.sl;
+
+        case OBJECT_CLOSURE:
+            return sizeof *obj + sizeof *obj->value.c + obj->value.c->chunk->numupvars * sizeof *obj->value.c->upvals;
+    }
+
+    return sizeof *obj;
+}
+
+void write_closure_object(FILE *fp, VM *vm, HeapObject *obj, size_t size, const char *owner) {
+    char name[256];
+    chunk_name(vm->root, obj->value.c->chunk, name, sizeof name);
+
+    fprintf(fp, "object %p closure %lu %s", (void *) obj, (unsigned long) size, name);
+
+    if (owner) {
+        fprintf(fp, " %s", owner);
+    }
+
+    fprintf(fp, "\n");
+}
+
+void write_upval_edges(FILE *fp, HeapObject *obj) {
+    int i;
+    for (i = 0; i < obj->value.c->chunk->numupvars; i++) {
+        Upval *u = obj->value.c->upvals[i];
+
+        // an open upval still refers to a register of a live frame
+        StackObject *o = u->open ? &u->data.ref.frame->registers[u->data.ref.slot] : u->data.o;
+
+        if (o->type == OBJECT_REFERENCE) {
+            fprintf(fp, "edge %p %p upval %d\n", (void *) obj, (void *) o->value.o, i);
+        }
+    }
+}
+
+// the closures shared by function constants are created on first load
+int count_shared_closures(Chunk *chunk) {
+    int count = 0;
+
+    int i;
+    for (i = 0; i < chunk->numconstants; i++) {
+        if (chunk->constants[i]->type == CONST_FUNC && chunk->constants[i]->object) {
+            count++;
+        }
+    }
+
+    for (i = 0; i < chunk->numchildren; i++) {
+        count += count_shared_closures(chunk->children[i]);
+    }
+
+    return count;
+}
+
+void write_shared_closures(FILE *fp, VM *vm, Chunk *chunk) {
+    int i;
+    for (i = 0; i < chunk->numconstants; i++) {
+        HeapObject *obj = chunk->constants[i]->object;
+
+        if (chunk->constants[i]->type == CONST_FUNC && obj) {
+            write_closure_object(fp, vm, obj, object_size(obj), "shared");
+        }
+    }
+
+    for (i = 0; i < chunk->numchildren; i++) {
+        write_shared_closures(fp, vm, chunk->children[i]);
+    }
+}
+
+void write_snapshot(VM *vm, const char *reason) {
+    FILE *fp = fopen(snapshot_file, vm->numsnapshots == 0 ? "w" : "a");
+
+    if (!fp) {
+        fatal("Could not open heap snapshot file.");
+    }
+
+    // only live objects belong in the snapshot
+    gc(vm);
+
+    // closures owned by a frame or shared by a constant are not on the heap
+    int numunlinked = count_shared_closures(vm->root);
+
+    Frame *frame;
+    LocalClosure *local;
+    for (frame = vm->current; frame != NULL; frame = frame->parent) {
+        for (local = frame->closures; local != NULL; local = local->next) {
+            numunlinked++;
+        }
+    }
+
+    // the count covers every object line below, interned strings included
+    fprintf(fp, "snapshot %d %s %d\n", vm->numsnapshots++, reason, vm->numobjects + vm->numstrings + numunlinked);
+
+    char name[256];
+
+    HeapObject *obj;
+    for (obj = vm->heap; obj != NULL; obj = obj->next) {
+        if (obj->type == OBJECT_CLOSURE) {
+            write_closure_object(fp, vm, obj, object_size(obj), NULL);
+        } else {
+            fprintf(fp, "object %p %s %lu\n", (void *) obj, object_type_name(obj), (unsigned long) object_size(obj));
+        }
+    }
+
+    for (frame = vm->current; frame != NULL; frame = frame->parent) {
+        for (local = frame->closures; local != NULL; local = local->next) {
+            int numupvars = local->closure.chunk->numupvars;
+            write_closure_object(fp, vm, &local->object, sizeof *local + numupvars * (sizeof(Upval *) + sizeof(Upval)), "frame");
+        }
+    }
+
+    write_shared_closures(fp, vm, vm->root);
+
+    int i;
+    for (i = 0; i < vm->stringcapacity; i++) {
+        for (obj = vm->strings[i]; obj != NULL; obj = obj->next) {
+            fprintf(fp, "object %p string %lu interned\n", (void *) obj, (unsigned long) object_size(obj));
+        }
+    }
+
+    int depth = 0;
+
+    for (frame = vm->current; frame != NULL; frame = frame->parent, depth++) {
+        int numregs = frame->closure->chunk->numlocals + frame->closure->chunk->numtemps + 1;
+        chunk_name(vm->root, frame->closure->chunk, name, sizeof name);
+
+        int i;
+        for (i = 0; i < numregs; i++) {
+            if (frame->registers[i].type == OBJECT_REFERENCE) {
+                fprintf(fp, "root %p register %s %d %d\n",
+                    (void *) frame->registers[i].value.o,
+                    name, depth, i);
+            }
+        }
+    }
+
+    for (i = 0; i < vm->stringcapacity; i++) {
+        for (obj = vm->strings[i]; obj != NULL; obj = obj->next) {
+            fprintf(fp, "root %p interned\n", (void *) obj);
+        }
+    }
+
+    for (obj = vm->heap; obj != NULL; obj = obj->next) {
+        if (obj->type == OBJECT_ROPE && obj->value.r->left) {
+            fprintf(fp, "edge %p %p left\n", (void *) obj, (void *) obj->value.r->left);
+            fprintf(fp, "edge %p %p right\n", (void *) obj, (void *) obj->value.r->right);
+        }
+
+        if (obj->type == OBJECT_SLICE) {
+            fprintf(fp, "edge %p %p parent\n", (void *) obj, (void *) obj->value.sl->parent);
+        }
+
+        if (obj->type == OBJECT_CLOSURE) {
+            write_upval_edges(fp, obj);
+        }
+    }
+
+    for (frame = vm->current; frame != NULL; frame = frame->parent) {
+        for (local = frame->closures; local != NULL; local = local->next) {
+            write_upval_edges(fp, &local->object);
+        }
+    }
+
+    fprintf(fp, "end\n");
+    fclose(fp);
+}
+
+void check_snapshot_threshold(VM *vm) {
+    if (vm->numobjects >= snapshot_threshold) {
+        if (!vm->overthreshold) {
+            vm->overthreshold = 1;
+            write_snapshot(vm, "threshold");
+        }
+    } else {
+        vm->overthreshold = 0;
+    }
+}
+
+void check_snapshot_signal(VM *vm) {
+    if (snapshot_requested) {
+        snapshot_requested = 0;
+        write_snapshot(vm, "signal");
+    }
+}
+
+/*
+ * Called on every call and backward jump, which any long-running program
+ * passes through often.
+ */
+void check_interrupts(VM *vm) {
+    // a call evaluated at compile time gives up when out of budget
+    if (vm->budget && --vm->budget == 0) {
+        fatal("Evaluation budget exhausted.");
+    }
+
+    check_snapshot_signal(vm);
+}
+
+/*
+ * Allocation profiling
+ *
+ * Every allocation made on behalf of the running program is counted
+ * against the instruction that caused it. Only one in profile_sample
+ * allocations is recorded, and recorded allocations are weighted by
+ * the sampling interval.
+ */
+
+void append_stack(VM *vm, Frame *frame, char *buffer, int length) {
+    if (frame->parent) {
+        append_stack(vm, frame->parent, buffer, length);
+    }
+
+    char name[256];
+    chunk_name(vm->root, frame->closure->chunk, name, sizeof name);
+
+    int n = strlen(buffer);
+    snprintf(buffer + n, length - n, "%s@%d;", name, frame->pc + 1);
+}
+
+void profile_allocation(VM *vm, AllocKind kind, size_t bytes) {
+    char stack[1024] = "";
+
+    vm->allocsample = profile_sample;
+
+    append_stack(vm, vm->current, stack, sizeof stack);
+
+    int n = strlen(stack);
+    snprintf(stack + n, sizeof stack - n, "%s", alloc_kind_names[kind]);
+
+    record_allocation(vm->current->closure->chunk, vm->current->pc, stack, kind, bytes, profile_sample);
+}
+
+HeapObject *const_to_string_object(VM *vm, Constant *c) {
+    if (!c->object) {
+        c->object = intern_string(vm, c->value.s, strlen(c->value.s));
+        PROFILE_ALLOC(vm, ALLOC_CONSTANT, sizeof(HeapObject) + sizeof(String) + c->object->value.s->length + 1);
+    }
+
+    return c->object;
+}
+
+/*
+ * A function without upvars has one closure, shared by every evaluation
+ * of its literal and created the first time it is loaded. Like an
+ * interned string it is never linked into the heap, so the collector
+ * never frees it; release_constants does.
+ */
+HeapObject *const_to_closure_object(VM *vm, Constant *c) {
+    if (!c->object) {
+        // constants are only loaded by the chunk they belong to
+        c->object = make_static_closure(vm->current->closure->chunk->children[c->value.i]);
+        PROFILE_ALLOC(vm, ALLOC_CONSTANT, sizeof(HeapObject) + sizeof(Closure));
+    }
+
+    return c->object;
+}
+
+void const_to_arg(VM *vm, StringArg *arg, Constant *c) {
+    switch (c->type) {
+        case CONST_INT:
+            arg->object = NULL;
+            arg->length = format_int(arg->buffer, c->value.i);
+            break;
+
+        case CONST_REAL:
+            arg->object = NULL;
+            arg->length = format_real(arg->buffer, c->value.d);
+            break;
+
+        case CONST_NULL:
+            set_string_arg(arg, "<null>");
+            break;
+
+        case CONST_BOOL:
+            set_string_arg(arg, c->value.i == 1 ? "true" : "false");
+            break;
+
+        case CONST_STRING:
+            arg->object = const_to_string_object(vm, c);
+            arg->length = arg->object->value.s->length;
+            break;
+
+        case CONST_FUNC:
+            set_string_arg(arg, "<closure>");
+            break;
+    }
 }
 
 void copy_object(StackObject *o1, StackObject *o2) {
@@ -465,6 +938,11 @@ void copy_object(StackObject *o1, StackObject *o2) {
             o1->type = OBJECT_NULL;
             break;
 
+        case OBJECT_SHORT_STRING:
+            o1->type = OBJECT_SHORT_STRING;
+            memcpy(o1->value.ss, o2->value.ss, sizeof o1->value.ss);
+            break;
+
         case OBJECT_REFERENCE:
             o1->type = OBJECT_REFERENCE;
             o1->value.o = o2->value.o;
@@ -473,9 +951,6 @@ void copy_object(StackObject *o1, StackObject *o2) {
 }
 
 void copy_constant(VM *vm, StackObject *o, Constant *c) {
-    // TODO - share string instances as a heap object,
-    // garbage collect at this point (instead of free)
-
     switch (c->type) {
         case CONST_INT:
             o->type = OBJECT_INT;
@@ -497,13 +972,13 @@ void copy_constant(VM *vm, StackObject *o, Constant *c) {
             break;
 
         case CONST_STRING:
-            // TODO - how to deal with strings created by the program?
-            // Right now we have no concat operator, so there's no worry,
-            // but how do we know when to free a string (user-supplied) or when
-            // to leave it alone in the pool (interned)?
+            o->value.o = const_to_string_object(vm, c);
+            o->type = OBJECT_REFERENCE;
+            break;
 
-            o->value.o = make_string_ref(vm, strdup(c->value.s));
-            o->type = OBJECT_REFERENCE; // put this after
+        case CONST_FUNC:
+            o->value.o = const_to_closure_object(vm, c);
+            o->type = OBJECT_REFERENCE;
             break;
     }
 }
@@ -562,33 +1037,30 @@ restart: {
             case OP_ADD:
             {
                 // TODO - make string coercion better
-                // TODO - make string type with special operators
 
                 if (IS_STR(b) || IS_STR(c)) {
-                    char *arg1 = TO_STR(b);
-                    char *arg2 = TO_STR(c);
+                    // operands and intermediate nodes are unrooted until
+                    // the result lands in a register
+                    vm->nogc++;
 
-                    char *arg3 = malloc((strlen(arg1) + strlen(arg2) + 1) + sizeof *arg3);
+                    StringArg arg1, arg2;
+                    TO_STRING_ARG(b, &arg1);
+                    TO_STRING_ARG(c, &arg2);
 
-                    strcpy(arg3, arg1);
-                    strcat(arg3, arg2);
+                    concat_args(vm, &registers[a], &arg1, &arg2);
 
-                    registers[a].value.o = make_string_ref(vm, arg3);
-                    registers[a].type = OBJECT_REFERENCE; // put this after
-
-                    free(arg1);
-                    free(arg2);
+                    vm->nogc--;
                 } else {
                     if (!(IS_INT(b) || IS_REAL(b)) || !(IS_INT(c) || IS_REAL(c))) {
                         fatal("Cannot add types.");
                     }
 
                     if (IS_INT(b) && IS_INT(c)) {
-                        int arg1 = AS_INT(b);
-                        int arg2 = AS_INT(c);
+                        unsigned int arg1 = AS_INT(b);
+                        unsigned int arg2 = AS_INT(c);
 
                         registers[a].type = OBJECT_INT;
-                        registers[a].value.i = arg1 + arg2;
+                        registers[a].value.i = (int) (arg1 + arg2);
                     } else {
                         double arg1 = IS_INT(b) ? (double) AS_INT(b) : AS_REAL(b);
                         double arg2 = IS_INT(c) ? (double) AS_INT(c) : AS_REAL(c);
@@ -606,11 +1078,11 @@ restart: {
                 }
 
                 if (IS_INT(b) && IS_INT(c)) {
-                    int arg1 = AS_INT(b);
-                    int arg2 = AS_INT(c);
+                    unsigned int arg1 = AS_INT(b);
+                    unsigned int arg2 = AS_INT(c);
 
                     registers[a].type = OBJECT_INT;
-                    registers[a].value.i = arg1 - arg2;
+                    registers[a].value.i = (int) (arg1 - arg2);
                 } else {
                     double arg1 = IS_INT(b) ? (double) AS_INT(b) : AS_REAL(b);
                     double arg2 = IS_INT(c) ? (double) AS_INT(c) : AS_REAL(c);
@@ -627,11 +1099,11 @@ restart: {
                 }
 
                 if (IS_INT(b) && IS_INT(c)) {
-                    int arg1 = AS_INT(b);
-                    int arg2 = AS_INT(c);
+                    unsigned int arg1 = AS_INT(b);
+                    unsigned int arg2 = AS_INT(c);
 
                     registers[a].type = OBJECT_INT;
-                    registers[a].value.i = arg1 * arg2;
+                    registers[a].value.i = (int) (arg1 * arg2);
                 } else {
                     double arg1 = IS_INT(b) ? (double) AS_INT(b) : AS_REAL(b);
                     double arg2 = IS_INT(c) ? (double) AS_INT(c) : AS_REAL(c);
@@ -655,8 +1127,9 @@ restart: {
                     int arg1 = AS_INT(b);
                     int arg2 = AS_INT(c);
 
+                    // by -1 is a negation, so INT_MIN wraps instead of trapping
                     registers[a].type = OBJECT_INT;
-                    registers[a].value.i = arg1 / arg2;
+                    registers[a].value.i = arg2 == -1 ? (int) -(unsigned int) arg1 : arg1 / arg2;
                 } else {
                     double arg1 = IS_INT(b) ? (double) AS_INT(b) : AS_REAL(b);
                     double arg2 = IS_INT(c) ? (double) AS_INT(c) : AS_REAL(c);
@@ -681,7 +1154,7 @@ restart: {
                     int arg2 = AS_INT(c);
 
                     registers[a].type = OBJECT_INT;
-                    registers[a].value.i = arg1 % arg2;
+                    registers[a].value.i = arg2 == -1 ? 0 : arg1 % arg2;
                 } else {
                     double arg1 = IS_INT(b) ? (double) AS_INT(b) : AS_REAL(b);
                     double arg2 = IS_INT(c) ? (double) AS_INT(c) : AS_REAL(c);
@@ -716,7 +1189,7 @@ restart: {
             {
                 if (IS_INT(b)) {
                     registers[a].type = OBJECT_INT;
-                    registers[a].value.i = -AS_INT(b);
+                    registers[a].value.i = (int) -(unsigned int) AS_INT(b);
                 } else if (IS_REAL(b)) {
                     registers[a].type = OBJECT_INT;
                     registers[a].value.i = -AS_REAL(b);
@@ -734,49 +1207,136 @@ restart: {
                 registers[a].value.i = registers[a].value.i == 1 ? 0 : 1;
             } break;
 
+            case OP_BUILTIN:
+            {
+                vm->nogc++;
+                call_builtin(vm, b, &registers[a], &registers[c]);
+                vm->nogc--;
+            } break;
+
+            case OP_CONCAT:
+            {
+                vm->nogc++;
+                concat_range(vm, &registers[a], &registers[b], c);
+                vm->nogc--;
+            } break;
+
             case OP_EQ:
+            case OP_NE:
+            case OP_TEST_EQ:
             {
+                int equal = 0;
+
                 if ((IS_INT(b) || IS_REAL(b)) && (IS_INT(c) || IS_REAL(c))) {
                     double arg1 = IS_INT(b) ? (double) AS_INT(b) : AS_REAL(b);
                     double arg2 = IS_INT(c) ? (double) AS_INT(c) : AS_REAL(c);
 
-                    registers[a].type = OBJECT_BOOL;
-                    registers[a].value.i = arg1 == arg2;
-                } else {
+                    equal = arg1 == arg2;
+                } else if (IS_STR(b) && IS_STR(c)) {
+                    StringArg arg1, arg2;
+                    TO_STRING_ARG(b, &arg1);
+                    TO_STRING_ARG(c, &arg2);
+
+                    equal = string_args_equal(&arg1, &arg2);
+                } else if (!IS_STR(b) && !IS_STR(c)) {
                     fatal("Comparison of reference types not yet supported.");
                 }
+
+                // a test skips the jump after it unless the result is A
+                if (o == OP_TEST_EQ) {
+                    if (equal != a) {
+                        frame->pc++;
+                    }
+
+                    break;
+                }
+
+                registers[a].type = OBJECT_BOOL;
+                registers[a].value.i = o == OP_EQ ? equal : !equal;
             } break;
 
             case OP_LT:
+            case OP_TEST_LT:
             {
-                if (!(IS_INT(b) || IS_REAL(b)) || !(IS_INT(c) || IS_REAL(c))) {
-                    fatal("Tried to compare non-numbers.");
+                int result;
+
+                if (IS_STR(b) && IS_STR(c)) {
+                    StringArg arg1, arg2;
+                    TO_STRING_ARG(b, &arg1);
+                    TO_STRING_ARG(c, &arg2);
+
+                    result = compare_string_args(&arg1, &arg2) < 0;
+                } else {
+                    if (!(IS_INT(b) || IS_REAL(b)) || !(IS_INT(c) || IS_REAL(c))) {
+                        fatal("Tried to compare non-numbers.");
+                    }
+
+                    double arg1 = IS_INT(b) ? (double) AS_INT(b) : AS_REAL(b);
+                    double arg2 = IS_INT(c) ? (double) AS_INT(c) : AS_REAL(c);
+
+                    result = arg1 < arg2;
                 }
 
-                double arg1 = IS_INT(b) ? (double) AS_INT(b) : AS_REAL(b);
-                double arg2 = IS_INT(c) ? (double) AS_INT(c) : AS_REAL(c);
+                if (o == OP_TEST_LT) {
+                    if (result != a) {
+                        frame->pc++;
+                    }
+
+                    break;
+                }
 
                 registers[a].type = OBJECT_BOOL;
-                registers[a].value.i = arg1 < arg2;
+                registers[a].value.i = result;
             } break;
 
             case OP_LE:
+            case OP_TEST_LE:
             {
-                if (!(IS_INT(b) || IS_REAL(b)) || !(IS_INT(c) || IS_REAL(c))) {
-                    fatal("Tried to compare non-numbers.");
+                int result;
+
+                if (IS_STR(b) && IS_STR(c)) {
+                    StringArg arg1, arg2;
+                    TO_STRING_ARG(b, &arg1);
+                    TO_STRING_ARG(c, &arg2);
+
+                    result = compare_string_args(&arg1, &arg2) <= 0;
+                } else {
+                    if (!(IS_INT(b) || IS_REAL(b)) || !(IS_INT(c) || IS_REAL(c))) {
+                        fatal("Tried to compare non-numbers.");
+                    }
+
+                    double arg1 = IS_INT(b) ? (double) AS_INT(b) : AS_REAL(b);
+                    double arg2 = IS_INT(c) ? (double) AS_INT(c) : AS_REAL(c);
+
+                    result = arg1 <= arg2;
                 }
 
-                double arg1 = IS_INT(b) ? (double) AS_INT(b) : AS_REAL(b);
-                double arg2 = IS_INT(c) ? (double) AS_INT(c) : AS_REAL(c);
+                if (o == OP_TEST_LE) {
+                    if (result != a) {
+                        frame->pc++;
+                    }
+
+                    break;
+                }
 
                 registers[a].type = OBJECT_BOOL;
-                registers[a].value.i = arg1 <= arg2;
+                registers[a].value.i = result;
             } break;
 
             case OP_CLOSURE:
             {
+                if (c) {
+                    registers[a].value.o = make_local_closure(vm, frame, chunk->children[b]);
+                    registers[a].type = OBJECT_REFERENCE;
+
+                    frame->pc += chunk->children[b]->numupvars;
+                    break;
+                }
+
                 Closure *child = make_closure(chunk->children[b]);
 
+                PROFILE_ALLOC(vm, ALLOC_CLOSURE, sizeof(HeapObject) + sizeof(Closure) + child->chunk->numupvars * sizeof(Upval *));
+
                 int i;
                 for (i = 0; i < chunk->children[b]->numupvars; i++) {
                     int inst = chunk->instructions[++frame->pc];
@@ -786,9 +1346,14 @@ restart: {
                     int bc = GET_B(inst);
                     int cc = GET_C(inst);
 
-                    if (oc == OP_MOVE) {
+                    if (oc == OP_MOVE && cc) {
+                        // a copy of a variable that is never assigned
+                        child->upvals[ac] = make_closed_upval(&registers[bc]);
+                        PROFILE_ALLOC(vm, ALLOC_UPVAL, sizeof(Upval) + sizeof(StackObject));
+                    } else if (oc == OP_MOVE) {
                         // first upval for this variable
                         child->upvals[ac] = make_upval(vm, bc);
+                        PROFILE_ALLOC(vm, ALLOC_UPVAL, sizeof(Upval) + sizeof(UpvalNode));
                     } else {
                         // share upval
                         child->upvals[ac] = closure->upvals[bc];
@@ -802,15 +1367,42 @@ restart: {
 
             case OP_CALL:
             {
+                check_interrupts(vm);
+
                 if (registers[b].type != OBJECT_REFERENCE || registers[b].value.o->type != OBJECT_CLOSURE) {
                     fatal("Tried to call non-closure.");
                 }
 
-                // TODO - safety issue (see compile.c for notes)
+                Closure *child = registers[b].value.o->value.c;
+
+                // the callee would read past the arguments into the caller's
+                // registers, or past the end of its frame
+                if (c != child->chunk->numparams) {
+                    fatal("Function expects %d arguments, got %d.", child->chunk->numparams, c);
+                }
+
+                Frame *subframe = make_frame(frame, child);
+
+                PROFILE_ALLOC(vm, ALLOC_FRAME, sizeof(Frame) + (child->chunk->numlocals + child->chunk->numtemps + 1) * sizeof(StackObject));
+
+                int i;
+                for (i = 0; i < c; i++) {
+                    copy_object(&subframe->registers[i + 1], &registers[b + 1 + i]);
+                }
+
+                vm->current = subframe;
+                goto restart;
+            } break;
+
+            case OP_CALL_DIRECT:
+            {
+                check_interrupts(vm);
 
                 Closure *child = registers[b].value.o->value.c;
                 Frame *subframe = make_frame(frame, child);
 
+                PROFILE_ALLOC(vm, ALLOC_FRAME, sizeof(Frame) + (child->chunk->numlocals + child->chunk->numtemps + 1) * sizeof(StackObject));
+
                 int i;
                 for (i = 0; i < child->chunk->numparams; i++) {
                     copy_object(&subframe->registers[i + 1], &registers[c + i]);
@@ -827,23 +1419,33 @@ restart: {
                     Upval *u = head->upval;
 
                     if (u->data.ref.frame == frame) {
-                        StackObject *o = malloc(sizeof *o);
+                        if (u->refcount == 0) {
+                            // every closure referring to it has been collected
+                            free(u);
+                        } else {
+                            StackObject *o = malloc(sizeof *o);
 
-                        if (!o) {
-                            fatal("Out of memory.");
-                        }
+                            if (!o) {
+                                fatal("Out of memory.");
+                            }
+
+                            PROFILE_ALLOC(vm, ALLOC_UPVAL, sizeof *o);
 
-                        u->open = 0;
-                        copy_object(o, &registers[u->data.ref.slot]);
-                        u->data.o = o;
+                            u->open = 0;
+                            copy_object(o, &registers[u->data.ref.slot]);
+                            u->data.o = o;
+                        }
 
                         if (vm->open == head) {
                             vm->open = head->next;
                         } else {
-                            head->next->prev = head->prev;
                             head->prev->next = head->next;
                         }
 
+                        if (head->next) {
+                            head->next->prev = head->prev;
+                        }
+
                         UpvalNode *temp = head;
                         head = head->next;
                         free(temp);
@@ -858,9 +1460,11 @@ restart: {
 
                     if (b < 256) {
                         // debug
-                        char *d = obj_to_str(&registers[b]);
-                        printf("Return value: %s\n", d);
-                        free(d);
+                        if (!vm->sandboxed) {
+                            char *d = obj_to_str(&registers[b]);
+                            printf("Return value: %s\n", d);
+                            free(d);
+                        }
 
                         copy_object(target, &registers[b]);
                     } else {
@@ -871,12 +1475,27 @@ restart: {
 
                     vm->current = p;
                     goto restart;
+                } else if (vm->sandboxed) {
+                    // the result of a call evaluated at compile time
+                    if (b < 256) {
+                        copy_object(&vm->result, &registers[b]);
+                    } else {
+                        copy_constant(vm, &vm->result, chunk->constants[b - 256]);
+                    }
+
+                    free_frame(frame);
+                    vm->current = NULL;
+                    return;
                 } else {
                     // debug
                     char *d = obj_to_str(&registers[b]);
                     printf("Return value: %s\n", d);
                     free(d);
 
+                    if (snapshot_file) {
+                        write_snapshot(vm, "exit");
+                    }
+
                     free_frame(frame);
                     vm->current = NULL;
                     return;
@@ -884,8 +1503,13 @@ restart: {
             } break;
 
             case OP_JUMP:
+            {
+                if (c) {
+                    check_interrupts(vm);
+                }
+
                 frame->pc += c ? -b : b;
-                break;
+            } break;
 
             case OP_JUMP_TRUE:
             {
@@ -894,6 +1518,10 @@ restart: {
                 }
 
                 if (registers[a].value.i == 1) {
+                    if (c) {
+                        check_interrupts(vm);
+                    }
+
                     frame->pc += c ? -b : b;
                 }
             } break;
@@ -905,6 +1533,10 @@ restart: {
                 }
 
                 if (registers[a].value.i == 0) {
+                    if (c) {
+                        check_interrupts(vm);
+                    }
+
                     frame->pc += c ? -b : b;
                 }
             } break;
@@ -912,6 +1544,7 @@ restart: {
             case OP_ENTER_TRY:
             {
                 vm->catchframe = make_catch_frame(frame, vm->catchframe, frame->pc + b);
+                PROFILE_ALLOC(vm, ALLOC_CATCH_FRAME, sizeof(CatchFrame));
             } break;
 
             case OP_LEAVE_TRY:
@@ -962,6 +1595,151 @@ restart: {
 
                 goto restart;
             } break;
+
+            /* typed forms: the operands are known to have the type */
+
+            // int arithmetic wraps on overflow, computed unsigned as fold.c does;
+            // dividing INT_MIN by -1 wraps as well
+            case OP_ADD_INT:
+                registers[a].type = OBJECT_INT;
+                registers[a].value.i = (int) ((unsigned int) AS_INT(b) + (unsigned int) AS_INT(c));
+                break;
+
+            case OP_SUB_INT:
+                registers[a].type = OBJECT_INT;
+                registers[a].value.i = (int) ((unsigned int) AS_INT(b) - (unsigned int) AS_INT(c));
+                break;
+
+            case OP_MUL_INT:
+                registers[a].type = OBJECT_INT;
+                registers[a].value.i = (int) ((unsigned int) AS_INT(b) * (unsigned int) AS_INT(c));
+                break;
+
+            case OP_DIV_INT:
+            {
+                if (AS_INT(c) == 0) {
+                    fatal("Div by 0.");
+                }
+
+                registers[a].type = OBJECT_INT;
+                registers[a].value.i = AS_INT(c) == -1 ? (int) -(unsigned int) AS_INT(b) : AS_INT(b) / AS_INT(c);
+            } break;
+
+            case OP_MOD_INT:
+            {
+                if (AS_INT(c) == 0) {
+                    fatal("Mod by 0.");
+                }
+
+                registers[a].type = OBJECT_INT;
+                registers[a].value.i = AS_INT(c) == -1 ? 0 : AS_INT(b) % AS_INT(c);
+            } break;
+
+            case OP_NEG_INT:
+                registers[a].type = OBJECT_INT;
+                registers[a].value.i = (int) -(unsigned int) AS_INT(b);
+                break;
+
+            case OP_ADD_REAL:
+                registers[a].type = OBJECT_REAL;
+                registers[a].value.d = AS_REAL(b) + AS_REAL(c);
+                break;
+
+            case OP_SUB_REAL:
+                registers[a].type = OBJECT_REAL;
+                registers[a].value.d = AS_REAL(b) - AS_REAL(c);
+                break;
+
+            case OP_MUL_REAL:
+                registers[a].type = OBJECT_REAL;
+                registers[a].value.d = AS_REAL(b) * AS_REAL(c);
+                break;
+
+            case OP_DIV_REAL:
+            {
+                if (AS_REAL(c) == 0) {
+                    fatal("Div by 0.");
+                }
+
+                registers[a].type = OBJECT_REAL;
+                registers[a].value.d = AS_REAL(b) / AS_REAL(c);
+            } break;
+
+            case OP_NOT_BOOL:
+                registers[a].value.i = !registers[a].value.i;
+                break;
+
+            case OP_EQ_INT:
+                registers[a].type = OBJECT_BOOL;
+                registers[a].value.i = AS_INT(b) == AS_INT(c);
+                break;
+
+            case OP_NE_INT:
+                registers[a].type = OBJECT_BOOL;
+                registers[a].value.i = AS_INT(b) != AS_INT(c);
+                break;
+
+            case OP_LT_INT:
+                registers[a].type = OBJECT_BOOL;
+                registers[a].value.i = AS_INT(b) < AS_INT(c);
+                break;
+
+            case OP_LE_INT:
+                registers[a].type = OBJECT_BOOL;
+                registers[a].value.i = AS_INT(b) <= AS_INT(c);
+                break;
+
+            case OP_LT_REAL:
+                registers[a].type = OBJECT_BOOL;
+                registers[a].value.i = AS_REAL(b) < AS_REAL(c);
+                break;
+
+            case OP_LE_REAL:
+                registers[a].type = OBJECT_BOOL;
+                registers[a].value.i = AS_REAL(b) <= AS_REAL(c);
+                break;
+
+            case OP_TEST_EQ_INT:
+                if ((AS_INT(b) == AS_INT(c)) != a) {
+                    frame->pc++;
+                }
+                break;
+
+            case OP_TEST_LT_INT:
+                if ((AS_INT(b) < AS_INT(c)) != a) {
+                    frame->pc++;
+                }
+                break;
+
+            case OP_TEST_LE_INT:
+                if ((AS_INT(b) <= AS_INT(c)) != a) {
+                    frame->pc++;
+                }
+                break;
+
+            case OP_TEST_LT_REAL:
+                if ((AS_REAL(b) < AS_REAL(c)) != a) {
+                    frame->pc++;
+                }
+                break;
+
+            case OP_TEST_LE_REAL:
+                if ((AS_REAL(b) <= AS_REAL(c)) != a) {
+                    frame->pc++;
+                }
+                break;
+
+            case OP_JUMP_TRUE_BOOL:
+            case OP_JUMP_FALSE_BOOL:
+            {
+                if (registers[a].value.i == (o == OP_JUMP_TRUE_BOOL)) {
+                    if (c) {
+                        check_interrupts(vm);
+                    }
+
+                    frame->pc += c ? -b : b;
+                }
+            } break;
         }
 
         frame->pc++;
@@ -971,14 +1749,168 @@ restart: {
 }
 }
 
+/*
+ * Compile-time evaluation
+ *
+ * A call to a pure function with constant arguments is made while
+ * compiling (see evaluate.c), in a VM of its own. The call is given a
+ * budget of calls and backward jumps, and one of bytes allocated (a rope
+ * is charged for the flat copy it may need later). A runtime error,
+ * including running out of either budget, gives up on the call through
+ * sandbox_exit (see fatal) instead of ending the compiler; so does a
+ * result that is not a number, a boolean, null or a string without NULs,
+ * as it cannot be a constant.
+ */
+
+Constant *value_to_constant(StackObject *o) {
+    Constant *c = malloc(sizeof *c);
+
+    if (!c) {
+        fatal("Out of memory.");
+    }
+
+    c->object = NULL;
+
+    switch (o->type) {
+        case OBJECT_INT:
+            c->type = CONST_INT;
+            c->value.i = o->value.i;
+            return c;
+
+        case OBJECT_REAL:
+            c->type = CONST_REAL;
+            c->value.d = o->value.d;
+            return c;
+
+        case OBJECT_BOOL:
+            c->type = CONST_BOOL;
+            c->value.i = o->value.i;
+            return c;
+
+        case OBJECT_NULL:
+            c->type = CONST_NULL;
+            return c;
+
+        default:
+            break;
+    }
+
+    if (IS_STRING_VALUE(o)) {
+        int length = value_length(o);
+        const char *chars = value_chars(o);
+
+        if (!memchr(chars, '\0', length)) {
+            c->type = CONST_STRING;
+            c->value.s = strndup(chars, length);
+            return c;
+        }
+    }
+
+    free(c);
+    return NULL;
+}
+
+void free_sandbox(VM *vm) {
+    // a call given up on leaves its frames behind
+    while (vm->open) {
+        UpvalNode *head = vm->open;
+        Upval *u = head->upval;
+
+        if (u->refcount == 0) {
+            free(u);
+        } else {
+            StackObject *o = malloc(sizeof *o);
+
+            if (!o) {
+                fatal("Out of memory.");
+            }
+
+            o->type = OBJECT_NULL;
+
+            u->open = 0;
+            u->data.o = o;
+        }
+
+        vm->open = head->next;
+        free(head);
+    }
+
+    while (vm->current) {
+        Frame *parent = vm->current->parent;
+        free_frame(vm->current);
+        vm->current = parent;
+    }
+
+    while (vm->catchframe) {
+        CatchFrame *parent = vm->catchframe->parent;
+        free_catch_frame(vm->catchframe);
+        vm->catchframe = parent;
+    }
+
+    gc(vm);
+    free_strings(vm);
+    free_regexes(vm);
+    free(vm);
+}
+
+Constant *evaluate_call(HeapObject *closure, Constant **args, int budget, size_t allocbudget) {
+    Frame *frame = make_frame(NULL, closure->value.c);
+    VM *vm = make_vm(frame, 0);
+
+    vm->budget = budget;
+    vm->allocbudget = allocbudget;
+    vm->sandboxed = 1;
+
+    // the program's profile and snapshots are not about this call
+    char *profile = profile_file;
+    int threshold = snapshot_threshold;
+
+    profile_file = NULL;
+    snapshot_threshold = 0;
+
+    int i;
+    for (i = 0; i < closure->value.c->chunk->numparams; i++) {
+        copy_constant(vm, &frame->registers[i + 1], args[i]);
+    }
+
+    jmp_buf exit;
+    Constant *result = NULL;
+
+    sandbox_exit = &exit;
+
+    if (setjmp(exit) == 0) {
+        execute_function(vm);
+        result = value_to_constant(&vm->result);
+    }
+
+    sandbox_exit = NULL;
+
+    profile_file = profile;
+    snapshot_threshold = threshold;
+
+    free_sandbox(vm);
+    return result;
+}
+
 void execute(Chunk *chunk) {
     Closure *closure = make_closure(chunk);
     Frame *frame = make_frame(NULL, closure);
     VM *vm = make_vm(frame, 0);
 
+    if (snapshot_file) {
+        signal(SIGUSR1, request_snapshot);
+    }
+
     execute_function(vm);
 
+    if (profile_file) {
+        write_profile(chunk);
+    }
+
     gc(vm);
+    free_strings(vm);
+    free_regexes(vm);
+    release_constants(chunk);
     free(vm);
 
     // TODO - free last closure [?]
@@ -19,6 +19,243 @@
 
 #pragma once
 
+#include <setjmp.h>
+#include <stddef.h>
+
 #include "codegen.h"
+#include "profile.h"
+
+typedef struct Upval Upval;
+typedef struct Closure Closure;
+typedef struct LocalClosure LocalClosure;
+typedef struct String String;
+typedef struct Rope Rope;
+typedef struct Slice Slice;
+typedef struct Frame Frame;
+typedef struct CatchFrame CatchFrame;
+typedef struct VM VM;
+typedef struct StackObject StackObject;
+typedef struct Regex Regex;
+
+struct Upval {
+    int refcount;
+    int open;
+    union {
+        struct {
+            int slot;
+            Frame *frame;
+        } ref;
+        StackObject *o;
+    } data;
+};
+
+struct Closure {
+    Chunk *chunk;
+    Upval **upvals;
+
+    // the frame owning a closure that does not escape it, or NULL
+    Frame *frame;
+};
+
+/*
+ * A flat string of UTF-8 bytes. The characters of an owned string follow
+ * the header in the same allocation (and that allocation follows the heap
+ * object header for heap strings); the characters of a slice are part of
+ * another string's. The length is explicit, so the bytes may contain
+ * NULs. Owned strings keep a terminator after them; slices cannot, so
+ * never rely on one.
+ *
+ * The hash, the code point count and the breadcrumbs (the byte offset of
+ * every BREADCRUMB_INTERVAL-th code point) are computed on first use.
+ * A hash of zero and a negative numchars mean not yet computed.
+ */
+
+struct String {
+    int length;
+    unsigned int hash;
+
+    int numchars;
+    int ascii;
+    int *crumbs;
+
+    char *chars;
+};
+
+/*
+ * A rope is a string built by concatenation that has not been copied
+ * into contiguous memory yet. The first time its characters are needed
+ * it is flattened into a string of its own and drops its children.
+ */
+
+struct Rope {
+    HeapObject *left;
+    HeapObject *right;
+    String *flat;
+
+    int length;
+    int depth;
+};
+
+/*
+ * A slice is a substring that shares the characters of its parent, which
+ * it keeps alive. The parent is always an owned flat string or a rope
+ * that has been flattened, never another slice.
+ */
+
+struct Slice {
+    HeapObject *parent;
+    String string;
+};
+
+struct CatchFrame {
+    CatchFrame *parent;
+    Frame *frame;
+
+    int target;
+};
+
+struct Frame {
+    Frame *parent;
+
+    Closure *closure;
+    StackObject *registers;
+    LocalClosure *closures;
+    int pc;
+};
+
+typedef struct UpvalNode UpvalNode;
+
+struct UpvalNode {
+    Upval *upval;
+    UpvalNode *next;
+    UpvalNode *prev;
+};
+
+typedef enum {
+    OBJECT_STRING,
+    OBJECT_ROPE,
+    OBJECT_SLICE,
+    OBJECT_CLOSURE
+} HeapObjectType;
+
+struct HeapObject {
+    HeapObject *next;
+    unsigned int marked;
+
+    HeapObjectType type;
+
+    union {
+        String *s;
+        Rope *r;
+        Slice *sl;
+        Closure *c;
+    } value;
+};
+
+/*
+ * A closure that does not escape the frame creating it (see escape.c)
+ * is owned by that frame instead of the heap, and freed with it. Its
+ * upvals refer to the frame's registers and are never closed; the cells
+ * holding them are allocated with the closure. The frame creates it only
+ * once, and hands out the same closure each time its declaration is
+ * evaluated again.
+ */
+
+struct LocalClosure {
+    HeapObject object;
+    Closure closure;
+    Upval *cells;
+    LocalClosure *next;
+};
+
+typedef enum {
+    OBJECT_INT,
+    OBJECT_REAL,
+    OBJECT_BOOL,
+    OBJECT_NULL,
+    OBJECT_SHORT_STRING,
+    OBJECT_REFERENCE
+} StackObjectType;
+
+/*
+ * Strings of up to SHORT_STRING_LENGTH bytes are stored directly in the
+ * value instead of on the heap, with their length in the last byte. They
+ * fit in the space the union already reserves for a double, so they cost
+ * no allocation and are invisible to the collector.
+ */
+
+#define SHORT_STRING_LENGTH 7
+#define SHORT_LENGTH(o) ((o)->value.ss[SHORT_STRING_LENGTH])
+
+struct StackObject {
+    StackObjectType type;
+
+    union {
+        int i;
+        double d;
+        HeapObject *o;
+        char ss[SHORT_STRING_LENGTH + 1];
+    } value;
+};
+
+// TODO - rename
+
+struct VM {
+    Frame *current;
+    UpvalNode *open;
+
+    CatchFrame *catchframe;
+
+    HeapObject *heap;
+    int numobjects;
+    int maxobjects;
+    int nogc;
+
+    HeapObject **strings;
+    int numstrings;
+    int stringcapacity;
+
+    Regex **regexes;
+    Regex **recentregexes;
+    int nextregex;
+
+    Chunk *root;
+    int numsnapshots;
+    int overthreshold;
+    int allocsample;
+
+    // set while evaluating a call at compile time: the calls and backward
+    // jumps left (or 0 for no limit), the bytes it may still allocate, and
+    // the result
+    int sandboxed;
+    int budget;
+    size_t allocbudget;
+    StackObject result;
+};
+
+#define PROFILE_ALLOC(vm, kind, bytes)                      \
+    do {                                                    \
+        if (profile_file && --(vm)->allocsample == 0) {     \
+            profile_allocation((vm), (kind), (bytes));      \
+        }                                                   \
+    } while (0)
+
+char *snapshot_file;
+int snapshot_threshold;
+
+// where fatal gives up on a call evaluated at compile time, or NULL
+jmp_buf *sandbox_exit;
+
+void charge_allocation(VM *vm, size_t bytes);
+HeapObject *make_object(VM *vm, size_t size);
+void free_obj(HeapObject *obj);
+void profile_allocation(VM *vm, AllocKind kind, size_t bytes);
+
+void release_constants(Chunk *chunk);
+
+HeapObject *make_static_closure(Chunk *chunk);
+void set_static_upval(HeapObject *obj, int index, HeapObject *value);
+void free_static_closure(HeapObject *obj);
 
+Constant *evaluate_call(HeapObject *closure, Constant **args, int budget, size_t allocbudget);
 void execute(Chunk *chunk);